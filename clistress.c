@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libcli.h"
+
+// vim:sw=4 tw=120 et
+
+/*
+ * Registers and unregisters a command over and over while sessions sharing the commands keep worker threads busy
+ * running them, as an application adding commands at runtime on a loaded server would.  Fails if registering is held
+ * off for longer than TIME_LIMIT seconds.
+ */
+#define SESSIONS 6
+#define THREADS 4
+#define REGISTRATIONS 20000
+#define TIME_LIMIT 30
+#define FILLER 500  // Commands making "help" take a while, holding the commands still for as long
+
+#ifdef __GNUC__
+#define UNUSED(d) d __attribute__((unused))
+#else
+#define UNUSED(d) d
+#endif
+
+static volatile int stopping;
+static int registered;
+
+static int cmd_busy(struct cli_def *cli, UNUSED(const char *command), UNUSED(char *argv[]), UNUSED(int argc)) {
+  int i;
+
+  for (i = 0; i < 20; i++) cli_print(cli, "busy %d", i);
+  return CLI_OK;
+}
+
+static int cmd_probe(struct cli_def *cli, UNUSED(const char *command), UNUSED(char *argv[]), UNUSED(int argc)) {
+  cli_print(cli, "probe");
+  return CLI_OK;
+}
+
+// The client end of a session, typing commands one after another until told to stop
+static void *client(void *arg) {
+  static const char *commands[] = {"help\r\n", "busy\r\n", "probe\r\n", "help | include 1\r\n", "show probe\r\n"};
+  int fd = *(int *)arg;
+  char buf[16384], last = 0;
+  unsigned int n = 0;
+  ssize_t r;
+
+  while (!stopping) {
+    // Wait for the prompt before typing the next command
+    while ((r = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      if ((r > 1 ? buf[r - 2] : last) == '>' && buf[r - 1] == ' ') break;
+      last = buf[r - 1];
+    }
+    if (r <= 0) break;
+    if (send(fd, commands[n % 5], strlen(commands[n % 5]), 0) < 0) break;
+    n++;
+  }
+
+  // Hang up the way a user would, letting the session see end of input rather than a reset
+  shutdown(fd, SHUT_WR);
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  close(fd);
+  return NULL;
+}
+
+static void *server_thread(void *arg) {
+  cli_server_run(arg);
+  return NULL;
+}
+
+static void timed_out(UNUSED(int sig)) {
+  static const char message[] = "FAIL: registering commands was held off by the running sessions\n";
+
+  if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) _exit(2);
+  _exit(1);
+}
+
+int main(void) {
+  struct cli_def *cli = cli_init(), *session;
+  struct cli_server *server = cli_server_init();
+  struct cli_command *show, *probe;
+  pthread_t clients[SESSIONS], server_tid;
+  int fds[SESSIONS][2];
+  struct timeval start, end;
+  int i;
+
+  if (!cli || !server) return 1;
+  signal(SIGPIPE, SIG_IGN);
+  cli_register_command(cli, NULL, "busy", cmd_busy, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, NULL);
+  for (i = 0; i < FILLER; i++) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "filler-%d", i);
+    cli_register_command(cli, NULL, name, cmd_busy, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Makes help longer");
+  }
+  show = cli_register_command(cli, NULL, "show", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, NULL);
+  cli_server_set_threads(server, THREADS);
+
+  for (i = 0; i < SESSIONS; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0 || !(session = cli_init_shared(cli))) return 1;
+    cli_telnet_protocol(session, 0);
+    if (cli_server_add_session(server, session, fds[i][0]) != CLI_OK) return 1;
+  }
+  pthread_create(&server_tid, NULL, server_thread, server);
+  for (i = 0; i < SESSIONS; i++) pthread_create(&clients[i], NULL, client, &fds[i][1]);
+
+  // Let the sessions get going before registering against them
+  poll(NULL, 0, 200);
+  signal(SIGALRM, timed_out);
+  alarm(TIME_LIMIT);
+  gettimeofday(&start, NULL);
+  for (registered = 0; registered < REGISTRATIONS; registered++) {
+    probe = cli_register_command(cli, registered % 2 ? show : NULL, "probe", cmd_probe, PRIVILEGE_UNPRIVILEGED,
+                                 MODE_EXEC, NULL);
+    if (!probe || cli_unregister_command(cli, registered % 2 ? "show probe" : "probe") != CLI_OK) {
+      fprintf(stderr, "FAIL: couldn't register and unregister \"probe\" (%d)\n", registered);
+      return 1;
+    }
+  }
+  gettimeofday(&end, NULL);
+  alarm(0);
+
+  stopping = 1;
+  for (i = 0; i < SESSIONS; i++) pthread_join(clients[i], NULL);
+  pthread_join(server_tid, NULL);
+  cli_server_done(server);
+  cli_done(cli);
+
+  printf("%d commands registered and unregistered in %.2fs with %d sessions on %d threads\n", REGISTRATIONS,
+         (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0, SESSIONS, THREADS);
+  return 0;
+}
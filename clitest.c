@@ -106,6 +106,12 @@ int cmd_set(struct cli_def *cli, UNUSED(const char *command), char *argv[], int
     return CLI_OK;
   }
 
+  if (strcmp(argv[0], "pager") == 0) {
+    cli_set_pager(cli, strcmp(argv[1], "off") != 0);
+    cli_print(cli, "Paging is now %s", strcmp(argv[1], "off") ? "on" : "off");
+    return CLI_OK;
+  }
+
   cli_print(cli, "Setting \"%s\" to \"%s\"", argv[0], argv[1]);
   return CLI_OK;
 }
@@ -137,6 +143,25 @@ int cmd_show_regular(struct cli_def *cli, UNUSED(const char *command), char *arg
   return CLI_OK;
 }
 
+// Print the next few numbers each time the client has room for more output
+int stream_numbers(struct cli_def *cli, void *arg) {
+  unsigned int *next = arg;
+  int i;
+
+  for (i = 0; i < 100; i++) cli_print(cli, "%u", (*next)++);
+  return (*next < 100000) ? CLI_OK : CLI_ERROR;
+}
+
+int cmd_show_numbers(struct cli_def *cli, UNUSED(const char *command), UNUSED(char *argv[]), UNUSED(int argc)) {
+  unsigned int *next = calloc(sizeof(unsigned int), 1);
+
+  if (!next || cli_stream(cli, stream_numbers, free, next) != CLI_OK) {
+    free(next);
+    return CLI_ERROR;
+  }
+  return CLI_OK;
+}
+
 int cmd_debug_regular(struct cli_def *cli, UNUSED(const char *command), char *argv[], int argc) {
   debug_regular = !debug_regular;
   cli_print(cli, "cli_regular() debugging is %s", debug_regular ? "enabled" : "disabled");
@@ -371,21 +396,16 @@ int cmd_long_name(struct cli_def *cli, const char *command, char *argv[], int ar
   return CLI_OK;
 }
 
-void run_child(int x) {
-  struct cli_command *c;
-  struct cli_def *cli;
-  struct cli_optarg *o;
+// Prepare a small user context
+char mymessage[] = "I contain user data!";
+struct my_context myctx = {5, mymessage};
 
-  // Prepare a small user context
-  char mymessage[] = "I contain user data!";
-  struct my_context myctx;
-  myctx.value = 5;
-  myctx.message = mymessage;
-
-  cli = cli_init();
+// The settings each session needs, whether it has its own commands or shares them
+void setup_session(struct cli_def *cli) {
   cli_set_banner(cli, "libcli test environment");
   cli_set_hostname(cli, "router");
   cli_telnet_protocol(cli, 1);
+  cli_set_pager(cli, 1);
   cli_regular(cli, regular_callback);
 
   // change regular update to 5 seconds rather than default of 1 second
@@ -393,6 +413,19 @@ void run_child(int x) {
 
   // set 60 second idle timeout
   cli_set_idle_timeout_callback(cli, 60, idle_timeout);
+
+  cli_set_context(cli, (void *)&myctx);
+  cli_set_auth_callback(cli, check_auth);
+  cli_set_enable_callback(cli, check_enable);
+}
+
+struct cli_def *setup_cli(void) {
+  struct cli_command *c;
+  struct cli_def *cli;
+  struct cli_optarg *o;
+
+  cli = cli_init();
+  setup_session(cli);
   cli_register_command(cli, NULL, "test", cmd_test, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, NULL);
   cli_register_command(cli, NULL, "simple", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, NULL);
   cli_register_command(cli, NULL, "simon", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, NULL);
@@ -403,6 +436,8 @@ void run_child(int x) {
   cli_register_command(cli, c, "counters", cmd_test, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
                        "Show the counters that the system uses");
   cli_register_command(cli, c, "junk", cmd_test, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, NULL);
+  cli_register_command(cli, c, "numbers", cmd_show_numbers, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
+                       "Stream a lot of output to the client");
   cli_register_command(cli, NULL, "interface", cmd_config_int, PRIVILEGE_PRIVILEGED, MODE_CONFIG,
                        "Configure an interface");
   cli_register_command(cli, NULL, "exit", cmd_config_int_exit, PRIVILEGE_PRIVILEGED, MODE_CONFIG_INT,
@@ -473,29 +508,34 @@ void run_child(int x) {
                       MODE_EXEC, "flag", NULL, NULL, NULL);
   cli_register_optarg(c, "text", CLI_CMD_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "text string", NULL, NULL, NULL);
 
-  // Set user context and its command
-  cli_set_context(cli, (void *)&myctx);
+  // The user context is set for each session, this command shows it
   cli_register_command(cli, NULL, "context", cmd_context, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
                        "Test a user-specified context");
 
-  struct cli_command *d1, *d2, *d3;
-
-  d1 = cli_register_command(cli, NULL, "deep", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "top level deep dive cmd");
-  d2 = cli_register_command(cli, d1, "dive", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "mid level dep dive cmd");
-  d3 = cli_register_command(cli, d2, "cmd", cmd_deep_dive, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
-                            "bottom level dep dive cmd");
-  o = cli_register_optarg(d3, "howdeep", CLI_CMD_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Specify how deep", NULL,
-                          int_validator, NULL);
-  o = cli_register_optarg(d3, "howlong", CLI_CMD_OPTIONAL_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
-                          "Specify how long", NULL, int_validator, NULL);
+  // A tree declared as tables and used in place, the way a generated command set would be
+  static const struct cli_optarg_spec deep_dive_optargs[] = {
+      {"howdeep", CLI_CMD_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Specify how deep", NULL, int_validator, NULL},
+      {"howlong", CLI_CMD_OPTIONAL_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "Specify how long", NULL,
+       int_validator, NULL},
+  };
+  static const struct cli_command_spec deep_dive_cmd[] = {
+      {"cmd", cmd_deep_dive, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "bottom level dep dive cmd", NULL, 0, deep_dive_optargs,
+       2},
+  };
+  static const struct cli_command_spec deep_dive[] = {
+      {"dive", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "mid level dep dive cmd", deep_dive_cmd, 1, NULL, 0},
+  };
+  static const struct cli_command_spec deep[] = {
+      {"deep", NULL, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, "top level deep dive cmd", deep_dive, 1, NULL, 0},
+  };
+
+  cli_register_static_commands(cli, NULL, deep, 1);
 
   c = cli_register_command(
       cli, NULL, "serioously_long_cammand_to_test_with", cmd_long_name, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
       "show long command name with "
       "newline\nand_a_really_long_line_that_is_much_longer_than_80_columns_to_show_that_wrap_case");
 
-  cli_set_auth_callback(cli, check_auth);
-  cli_set_enable_callback(cli, check_enable);
   // Test reading from a file
   {
     FILE *fh;
@@ -508,11 +548,33 @@ void run_child(int x) {
       fclose(fh);
     }
   }
+  return cli;
+}
+
+void run_child(int x) {
+  struct cli_def *cli = setup_cli();
   cli_loop(cli, x);
   cli_done(cli);
 }
 
-int main() {
+#ifndef WIN32
+// Every session run by the server uses the commands registered on this one
+struct cli_def *server_commands;
+
+struct cli_def *server_session_init(UNUSED(struct cli_server *server), int x) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  struct cli_def *cli;
+
+  if (getpeername(x, (struct sockaddr *)&addr, &len) >= 0)
+    printf(" * accepted connection from %s\n", inet_ntoa(addr.sin_addr));
+  if (!(cli = cli_init_shared(server_commands))) return NULL;
+  setup_session(cli);
+  return cli;
+}
+#endif
+
+int main(int argc, char *argv[]) {
   int s, x;
   struct sockaddr_in addr;
   int on = 1;
@@ -551,6 +613,23 @@ int main() {
   }
 
   printf("Listening on port %d\n", CLITEST_PORT);
+#ifndef WIN32
+  // With -s, run every session from this process using the event driven server instead of forking; "-s 4" runs the
+  // sessions on 4 worker threads
+  if (argc > 1 && !strcmp(argv[1], "-s")) {
+    struct cli_server *server = cli_server_init();
+    server_commands = setup_cli();
+    if (!server || !server_commands || cli_server_set_threads(server, argc > 2 ? atoi(argv[2]) : 0) != CLI_OK ||
+        cli_server_add_listener(server, s, server_session_init) != CLI_OK) {
+      fprintf(stderr, "Unable to start cli server\n");
+      return 1;
+    }
+    cli_server_run(server);
+    cli_server_done(server);
+    cli_done(server_commands);
+    return 0;
+  }
+#endif
   while ((x = accept(s, NULL, 0))) {
 #ifndef WIN32
     int pid = fork();
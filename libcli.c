@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <memory.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #if !defined(__APPLE__) && !defined(__FreeBSD__)
@@ -27,8 +28,36 @@
 #else
 #define CLI_SOCKET_WAIT_PERROR "select"
 #endif
+#ifndef WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <crypt.h>
+#include <sys/epoll.h>
+#define CLI_SERVER_USE_EPOLL
+#else
+#include <poll.h>
+#endif
+#define CLI_USE_THREADS
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define CLI_USE_AVX2
+#endif
 #include "libcli.h"
 
+// Streams which write through a callback, used to make cli->client go through the session output buffer
+#if defined(__linux__)
+#define CLI_CLIENT_FOPENCOOKIE
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || \
+    defined(__DragonFly__)
+#define CLI_CLIENT_FUNOPEN
+#endif
+
 #ifdef __GNUC__
 #define UNUSED(d) d __attribute__((unused))
 #else
@@ -125,6 +154,97 @@ struct cli_filter_cmds {
   const char *help;
 };
 
+struct cli_stream {
+  int (*callback)(struct cli_def *cli, void *arg);
+  void (*cleanup)(void *arg);
+  void *arg;
+  struct cli_filter *filters;  // Filters of the command, kept until the stream finishes
+};
+
+// Input is read from the socket in chunks of up to this size, rather than one byte per read()
+#define CLI_READ_BUFFER_SIZE 4096
+
+// Output is collected and written in one go once it reaches this size, or when the input being processed runs out
+#define CLI_WRITE_BUFFER_SIZE 16384
+
+// Default limit on unsent output before a cli_stream() callback is held off until the client catches up
+#define CLI_OUTPUT_HIGH_WATER 65536
+
+// Default limit on unsent output before the command producing it is stopped, see cli_set_output_limit()
+#define CLI_OUTPUT_LIMIT (4 * 1024 * 1024)
+
+#define CLI_MORE_PROMPT "--More--"
+#define CLI_MORE_BLANK "        "
+
+// Telnet commands (RFC 854) and the options which are negotiated
+#define TELNET_SE 240
+#define TELNET_BRK 243
+#define TELNET_IP 244
+#define TELNET_SB 250
+#define TELNET_WILL 251
+#define TELNET_WONT 252
+#define TELNET_DO 253
+#define TELNET_DONT 254
+#define TELNET_IAC 255
+#define TELOPT_ECHO 1
+#define TELOPT_SGA 3
+#define TELOPT_NAWS 31
+
+enum cli_telnet_states {
+  TELNET_STATE_DATA,
+  TELNET_STATE_IAC,
+  TELNET_STATE_OPTION,  // WILL, WONT, DO or DONT waiting for its option
+  TELNET_STATE_SB,
+  TELNET_STATE_SB_IAC,
+};
+
+// Where the telnet parser got to, which can be part way through a command when a read ends
+struct cli_telnet {
+  int state;
+  unsigned char verb;
+  unsigned char sb[16];  // Subnegotiation parameters, anything longer than any option used here is truncated
+  size_t sb_len;
+};
+
+/*
+ * The line editor used to live in stack locals of cli_loop().  It is kept in a per-session structure now so the same
+ * state machine can be driven by cli_loop(), the event driven cli_server or an application's own event loop through
+ * cli_session_feed().
+ */
+struct cli_session {
+  int sockfd;  // -1 if output is left in 'out' for the application to send
+  int async;   // Driven by an event loop, so never block waiting for the client
+  unsigned char in[CLI_READ_BUFFER_SIZE];
+  char *out;
+  size_t out_len;
+  size_t out_size;
+  size_t retry_len;        // The socket was full, so output isn't sent again until there's this much of it
+  unsigned char *pending;  // Input which arrived while a command was running
+  size_t pending_len;
+  size_t pending_size;
+  const unsigned char *feed_rest;  // Input after the line being run, still to be processed by cli_int_session_feed()
+  size_t feed_rest_len;
+  int in_command;
+  int cancelled;  // The user interrupted the command which is running
+  struct timeval last_poll;
+  int more;       // Waiting at --More--, the rest of the command's output is held until a key is pressed
+  int page_rows;  // Rows of the screen filled since the command started or the last --More--
+  char *held;     // Output lines which didn't fit on the screen, each ending in '\n'
+  size_t held_len;
+  size_t held_size;
+  char *cmd;
+  int l;
+  int cursor;
+  int oldl;
+  int restore;  // Redisplay the current line when the next one starts (after '?' help)
+  int in_history;
+  int esc;
+  struct cli_telnet telnet;
+  unsigned char lastchar;
+  char *username;
+  char *password;
+};
+
 // Free and zero (to avoid double-free)
 #define free_z(p) \
   do {            \
@@ -139,15 +259,29 @@ static int cli_search_flags_validator(struct cli_def *cli, const char *word, con
 static int cli_match_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt);
 static int cli_range_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt);
 static int cli_count_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt);
+static int cli_multi_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt);
 static int cli_match_filter(struct cli_def *cli, const char *string, void *data);
+static int cli_match_filter_line(struct cli_def *cli, const char *line, size_t len, void *data);
 static int cli_range_filter(struct cli_def *cli, const char *string, void *data);
+static int cli_range_filter_line(struct cli_def *cli, const char *line, size_t len, void *data);
 static int cli_count_filter(struct cli_def *cli, const char *string, void *data);
+static int cli_count_filter_line(struct cli_def *cli, const char *line, size_t len, void *data);
+static int cli_multi_filter(struct cli_def *cli, const char *string, void *data);
+static int cli_multi_filter_line(struct cli_def *cli, const char *line, size_t len, void *data);
+static void cli_int_fuse_filters(struct cli_def *cli);
+static int cli_program_filter(struct cli_def *cli, const char *string, void *data);
+static int cli_program_filter_line(struct cli_def *cli, const char *line, size_t len, void *data);
+static void cli_int_compile_filters(struct cli_def *cli);
+#ifdef CLI_USE_THREADS
+static char *cli_int_print_parallel(struct cli_def *cli, char *p, char *end);
+#endif
 static void cli_int_parse_optargs(struct cli_def *cli, struct cli_pipeline_stage *stage, struct cli_command *cmd,
                                   char lastchar, struct cli_comphelp *comphelp);
 static int cli_int_enter_buildmode(struct cli_def *cli, struct cli_pipeline_stage *stage, char *mode_text);
 static char *cli_int_buildmode_extend_cmdline(char *, char *word);
 static void cli_int_free_buildmode(struct cli_def *cli);
 static void cli_free_command(struct cli_def *cli, struct cli_command *cmd);
+void cli_free_optarg(struct cli_optarg *optarg);
 static int cli_int_unregister_command_core(struct cli_def *cli, const char *command, int command_type);
 static int cli_int_unregister_buildmode_command(struct cli_def *cli, const char *command) __attribute__((unused));
 static struct cli_command *cli_int_register_buildmode_command(struct cli_def *cli, struct cli_command *parent,
@@ -173,17 +307,32 @@ static struct cli_pipeline *cli_int_generate_pipeline(struct cli_def *cli, const
 static int cli_int_validate_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline);
 static int cli_int_execute_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline);
 inline void cli_int_show_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline);
-static void cli_int_free_pipeline(struct cli_pipeline *pipeline);
+static void cli_int_free_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline);
+static void cli_int_cache_free(struct cli_def *cli);
+static void cli_int_patterns_free(struct cli_registry *registry);
+static void cli_int_arena_free(struct cli_def *cli);
 static struct cli_command *cli_register_command_core(struct cli_def *cli, struct cli_command *parent,
                                                      struct cli_command *c);
-static void cli_int_wrap_help_line(char *nameptr, char *helpptr, struct cli_comphelp *comphelp);
+static void cli_int_wrap_help_line(struct cli_def *cli, char *nameptr, char *helpptr, struct cli_comphelp *comphelp);
 static int cli_socket_wait(int sockfd, struct timeval *tm);
+static void cli_int_stream_run(struct cli_def *cli);
+static void cli_int_stream_free(struct cli_def *cli);
+static void cli_int_free_filters(struct cli_def *cli);
+static void cli_int_session_poll_input(struct cli_def *cli);
+static int cli_int_session_feed_pending(struct cli_def *cli);
+static void cli_int_page_line(struct cli_def *cli, const char *line, size_t len);
+static void cli_int_pager_key(struct cli_def *cli, unsigned char c);
+static void cli_int_pager_clear(struct cli_def *cli);
+static void cli_int_pager_keep(struct cli_def *cli, const char *buf, size_t len);
+static void cli_int_pager_hold(struct cli_def *cli, const char *line, size_t len);
+static void cli_optarg_build_shortest(struct cli_optarg *optarg);
 
 static char DELIM_OPT_START[] = "[";
 static char DELIM_OPT_END[] = "]";
 static char DELIM_ARG_START[] = "<";
 static char DELIM_ARG_END[] = ">";
 static char DELIM_NONE[] = "";
+static char PIPE_WORD[] = "|";
 
 static ssize_t _write(int fd, const void *buf, size_t count) {
   size_t written = 0;
@@ -201,32 +350,415 @@ static ssize_t _write(int fd, const void *buf, size_t count) {
   return written;
 }
 
-char *cli_int_command_name(struct cli_def *cli, struct cli_command *command) {
-  char *name;
-  char *o;
+/*
+ * Send as much as the session socket will take without blocking (a blocking socket takes everything).  Returns the
+ * number of bytes sent or -1 if the socket is broken.
+ */
+static ssize_t cli_int_send(struct cli_session *sess, const char *buf, size_t count) {
+  size_t written = 0;
+
+  while (written < count) {
+    ssize_t n = write(sess->sockfd, buf + written, count - written);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    written += n;
+  }
+  return written;
+}
 
-  if (command->full_command_name) {
-    free(command->full_command_name);
-    command->full_command_name = NULL;
+// Send whatever is collected in the session output buffer to the client, keeping anything the socket won't take yet
+static void cli_int_flush(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+  ssize_t n;
+
+  if (!sess || sess->sockfd < 0 || !sess->out_len) return;
+
+  // Output from a command is a good time to see if the user wants it to stop
+  if (sess->in_command && !sess->more) cli_int_session_poll_input(cli);
+  if (!sess->out_len) return;
+
+  // If the socket is broken the output is dropped, the next read will notice
+  if ((n = cli_int_send(sess, sess->out, sess->out_len)) < 0) n = sess->out_len;
+  if ((size_t)n < sess->out_len) memmove(sess->out, sess->out + n, sess->out_len - n);
+  sess->out_len -= n;
+
+  // Rather than trying a full socket again for every line, wait until another buffer's worth has built up
+  sess->retry_len = sess->out_len ? sess->out_len + CLI_WRITE_BUFFER_SIZE : 0;
+}
+
+static size_t cli_int_output_limit(struct cli_def *cli) {
+  return cli->output_limit ? cli->output_limit : CLI_OUTPUT_LIMIT;
+}
+
+/*
+ * Stop the running command once the client has fallen so far behind that its output would pile up without limit.
+ * What has been collected is still sent, followed by a note saying why the rest is missing.
+ */
+static void cli_int_output_overflow(struct cli_def *cli) {
+  static const char note[] = "\r\nOutput stopped, too much is waiting to be sent\r\n";
+  struct cli_session *sess = cli->session;
+  char *out;
+
+  sess->cancelled = 1;
+  if (sess->out_len + sizeof(note) - 1 > sess->out_size) {
+    if (!(out = realloc(sess->out, sess->out_len + sizeof(note) - 1))) return;
+    sess->out = out;
+    sess->out_size = sess->out_len + sizeof(note) - 1;
   }
+  memcpy(sess->out + sess->out_len, note, sizeof(note) - 1);
+  sess->out_len += sizeof(note) - 1;
+}
+
+// Make room for 'count' more bytes of output, returns a pointer to where they should go
+static char *cli_int_write_reserve(struct cli_def *cli, size_t count) {
+  struct cli_session *sess = cli->session;
 
-  if (!(name = calloc(1, 1))) return NULL;
+  if (sess->sockfd >= 0 && sess->out_len && sess->out_len + count > CLI_WRITE_BUFFER_SIZE &&
+      sess->out_len + count > sess->retry_len)
+    cli_int_flush(cli);
+  if (sess->cancelled) return NULL;
 
-  while (command) {
-    o = name;
-    if (asprintf(&name, "%s%s%s", command->command, *o ? " " : "", o) == -1) {
-      fprintf(stderr, "Couldn't allocate memory for command_name: %s", strerror(errno));
-      free(o);
+  if (sess->sockfd >= 0 && sess->in_command && sess->out_len + count > cli_int_output_limit(cli)) {
+    cli_int_flush(cli);
+    if (sess->out_len + count > cli_int_output_limit(cli)) {
+      cli_int_output_overflow(cli);
       return NULL;
     }
-    command = command->parent;
-    free(o);
+  }
+
+  if (sess->out_len + count > sess->out_size) {
+    size_t size = sess->out_size ? sess->out_size : 256;
+    char *out;
+
+    while (size < sess->out_len + count) size *= 2;
+    if (!(out = realloc(sess->out, size))) return NULL;
+    sess->out = out;
+    sess->out_size = size;
+  }
+  return sess->out + sess->out_len;
+}
+
+// Write to the client of the session currently being run
+static ssize_t cli_int_write(struct cli_def *cli, const void *buf, size_t count) {
+  struct cli_session *sess = cli->session;
+  const char *data = buf;
+  size_t left = count;
+  char *p;
+
+  if (!sess) {
+    if (cli->client && fwrite(buf, 1, count, cli->client) == count) return count;
+    return -1;
+  }
+
+  // Output from a command which has been interrupted is thrown away
+  if (sess->cancelled) return count;
+
+  // Large blocks are sent as they are rather than being copied through the buffer
+  if (sess->sockfd >= 0 && count >= CLI_WRITE_BUFFER_SIZE && !sess->retry_len) {
+    cli_int_flush(cli);
+    if (!sess->out_len) {
+      ssize_t n = cli_int_send(sess, data, left);
+      if (n < 0) return -1;
+      data += n;
+      left -= n;
+      if (!left) return count;
+    }
+  }
+
+  if (!(p = cli_int_write_reserve(cli, left))) return sess->cancelled ? (ssize_t)count : -1;
+  memcpy(p, data, left);
+  sess->out_len += left;
+  return count;
+}
+
+// Write a line of output followed by CRLF
+static void cli_int_write_line(struct cli_def *cli, const char *line, size_t len) {
+  char *p;
+
+  if (!cli->session) return;
+  if (!(p = cli_int_write_reserve(cli, len + 2))) return;
+  memcpy(p, line, len);
+  memcpy(p + len, "\r\n", 2);
+  cli->session->out_len += len + 2;
+}
+
+// Write the same character 'count' times, used for moving the cursor around
+static void cli_int_write_repeat(struct cli_def *cli, char c, int count) {
+  char *p;
+
+  if (count <= 0 || !cli->session) return;
+  if (!(p = cli_int_write_reserve(cli, count))) return;
+  memset(p, c, count);
+  cli->session->out_len += count;
+}
+
+/*
+ * Write command output which doesn't go through the pager.  While --More-- is showing it's kept behind the lines held
+ * there, complete lines as lines to be paged and anything after the last one to be joined to whatever comes next.
+ */
+static ssize_t cli_int_write_direct(struct cli_def *cli, const char *buf, size_t count) {
+  const char *p = buf, *end = buf + count, *nl;
+
+  if (!cli->session || !cli->session->more) return cli_int_write(cli, buf, count);
+  if (cli->session->cancelled) return count;
+
+  while (p < end) {
+    size_t len;
+
+    if (!(nl = memchr(p, '\n', end - p))) {
+      cli_int_pager_keep(cli, p, end - p);
+      break;
+    }
+    len = nl - p;
+    if (len && p[len - 1] == '\r') len--;
+    cli_int_pager_hold(cli, p, len);
+    p = nl + 1;
+  }
+  return count;
+}
+
+// printf() style output straight to the client, bypassing filters and the print callback
+static void cli_int_client_printf(struct cli_def *cli, const char *format, ...) {
+  va_list ap;
+  char *p = NULL;
+  int n;
+
+  va_start(ap, format);
+  n = vasprintf(&p, format, ap);
+  va_end(ap);
+  if (n < 0) return;
+  cli_int_write_direct(cli, p, n);
+  free(p);
+}
+
+/*
+ * Sessions sharing commands (see cli_init_shared()) may be running on different threads, see cli_server_set_threads().
+ * Looking commands up takes cli_tree_lock for reading, registering or unregistering them takes it for writing.  It's
+ * one lock for every tree as optargs are registered against a command without saying which cli it belongs to.
+ * Buildmode's commands belong to a single session, so aren't locked.
+ *
+ * Commands are run without holding the lock, so one unregistered while a session might still be using it is retired
+ * rather than freed.  Sessions pin themselves while they hold on to commands, noting the epoch at the time, and
+ * retired commands are freed once every session pinned before they were retired has let go.
+ *
+ * glibc's rwlocks let new readers in ahead of a waiting writer by default, so sessions busy running commands could
+ * keep commands from being registered for ever; the lock is made to prefer writers.  That's only safe because the
+ * read lock is never taken while already holding it, which is why callbacks run under it mustn't run commands.
+ */
+#ifdef CLI_USE_THREADS
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+static pthread_rwlock_t cli_tree_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+static pthread_rwlock_t cli_tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+static pthread_mutex_t cli_tree_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the pins and the parts filled in lazily
+#define CLI_ATOMIC_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define CLI_ATOMIC_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+#else
+#define CLI_ATOMIC_LOAD(v) (v)
+#define CLI_ATOMIC_STORE(v, x) ((v) = (x))
+#endif
+
+struct cli_retired {
+  unsigned long epoch;
+  struct cli_registry *registry;  // Where the command came from, NULL for an optarg
+  struct cli_command *command;
+  struct cli_optarg *optarg;
+  struct cli_retired *next;
+};
+
+static unsigned long cli_tree_epoch;
+static unsigned long cli_tree_generation;  // Moved on by every change to the commands
+static struct cli_def *cli_tree_pinned;
+static struct cli_retired *cli_tree_retired;
+
+static void cli_int_destroy_command(struct cli_command *cmd);
+
+static void cli_int_tree_read(void) {
+#ifdef CLI_USE_THREADS
+  pthread_rwlock_rdlock(&cli_tree_lock);
+#endif
+}
+
+static void cli_int_tree_unlock(void) {
+#ifdef CLI_USE_THREADS
+  pthread_rwlock_unlock(&cli_tree_lock);
+#endif
+}
+
+// Lock for a change to commands of 'type'
+static void cli_int_tree_write(int type) {
+  if (type == CLI_BUILDMODE_COMMAND) return;
+#ifdef CLI_USE_THREADS
+  pthread_rwlock_wrlock(&cli_tree_lock);
+#endif
+  // Whatever was found before now may be out of date, see cli_int_cache_lookup()
+  cli_tree_generation++;
+}
+
+static unsigned long cli_int_tree_generation(void) {
+  unsigned long generation;
+
+  cli_int_tree_read();
+  generation = cli_tree_generation;
+  cli_int_tree_unlock();
+  return generation;
+}
+
+static void cli_int_tree_written(int type) {
+  if (type != CLI_BUILDMODE_COMMAND) cli_int_tree_unlock();
+}
+
+static void cli_int_tree_mutex_lock(void) {
+#ifdef CLI_USE_THREADS
+  pthread_mutex_lock(&cli_tree_mutex);
+#endif
+}
+
+static void cli_int_tree_mutex_unlock(void) {
+#ifdef CLI_USE_THREADS
+  pthread_mutex_unlock(&cli_tree_mutex);
+#endif
+}
+
+static void cli_int_destroy_retired(struct cli_retired *r) {
+  if (r->command) cli_int_destroy_command(r->command);
+  if (r->optarg) cli_free_optarg(r->optarg);
+  free(r);
+}
+
+// Note that the session may be using commands it found, until the matching cli_int_unpin()
+static void cli_int_pin(struct cli_def *cli) {
+  cli_int_tree_mutex_lock();
+  if (!cli->pins++) {
+    cli->pin_epoch = cli_tree_epoch;
+    cli->pin_next = cli_tree_pinned;
+    cli_tree_pinned = cli;
+  }
+  cli_int_tree_mutex_unlock();
+}
+
+static void cli_int_unpin(struct cli_def *cli) {
+  struct cli_retired *done = NULL, *r, **rp;
+  struct cli_def **p;
+  unsigned long oldest;
+
+  cli_int_tree_mutex_lock();
+  if (--cli->pins) {
+    cli_int_tree_mutex_unlock();
+    return;
+  }
+  for (p = &cli_tree_pinned; *p != cli; p = &(*p)->pin_next)
+    ;
+  *p = cli->pin_next;
+
+  // Anything retired before the oldest remaining pin was taken can't be in use
+  oldest = cli_tree_epoch;
+  for (cli = cli_tree_pinned; cli; cli = cli->pin_next)
+    if (cli->pin_epoch < oldest) oldest = cli->pin_epoch;
+  for (rp = &cli_tree_retired; (r = *rp);) {
+    if (r->epoch < oldest) {
+      *rp = r->next;
+      r->next = done;
+      done = r;
+    } else {
+      rp = &r->next;
+    }
+  }
+  cli_int_tree_mutex_unlock();
+
+  while ((r = done)) {
+    done = r->next;
+    cli_int_destroy_retired(r);
+  }
+}
+
+// Free a command or optarg which has been taken out of the tree, or once no session can still be using it
+static void cli_int_retire(struct cli_registry *registry, struct cli_command *command, struct cli_optarg *optarg) {
+  struct cli_retired *r;
+
+  if (!(r = calloc(sizeof(struct cli_retired), 1))) return;  // Better leaked than freed while in use
+  r->registry = registry;
+  r->command = command;
+  r->optarg = optarg;
+
+  cli_int_tree_mutex_lock();
+  if (cli_tree_pinned) {
+    r->epoch = cli_tree_epoch++;
+    r->next = cli_tree_retired;
+    cli_tree_retired = r;
+    r = NULL;
+  }
+  cli_int_tree_mutex_unlock();
+
+  if (r) cli_int_destroy_retired(r);
+}
+
+// Free everything retired from a registry nobody is using any more
+static void cli_int_retired_flush(struct cli_registry *registry) {
+  struct cli_retired *done = NULL, *r, **rp;
+
+  cli_int_tree_mutex_lock();
+  for (rp = &cli_tree_retired; (r = *rp);) {
+    if (r->registry == registry) {
+      *rp = r->next;
+      r->next = done;
+      done = r;
+    } else {
+      rp = &r->next;
+    }
+  }
+  cli_int_tree_mutex_unlock();
+
+  while ((r = done)) {
+    done = r->next;
+    cli_int_destroy_retired(r);
+  }
+}
+
+// Build the name of a command including its parents, e.g. "show ip route"
+char *cli_int_command_name(struct cli_def *cli, struct cli_command *command) {
+  struct cli_command *c;
+  size_t len = 0;
+  char *name;
+  char *p;
+
+  if (!command) return NULL;
+  for (c = command; c; c = c->parent) len += strlen(c->command) + 1;
+  if (!(name = malloc(len))) {
+    fprintf(stderr, "Couldn't allocate memory for command_name: %s", strerror(errno));
+    return NULL;
+  }
+
+  // Filled in from the end, as the parents are found after their children
+  p = name + len - 1;
+  *p = 0;
+  for (c = command; c; c = c->parent) {
+    size_t n = strlen(c->command);
+
+    p -= n;
+    memcpy(p, c->command, n);
+    if (p > name) *--p = ' ';
   }
   return name;
 }
 
 char *cli_command_name(struct cli_def *cli, struct cli_command *command) {
-  return command->full_command_name;
+  char *name = CLI_ATOMIC_LOAD(command->full_command_name);
+
+  if (name) return name;
+
+  // Sessions on other threads may want it at the same time
+  cli_int_tree_mutex_lock();
+  if (!(name = command->full_command_name)) {
+    name = cli_int_command_name(cli, command);
+    CLI_ATOMIC_STORE(command->full_command_name, name);
+  }
+  cli_int_tree_mutex_unlock();
+  return name;
 }
 
 void cli_set_auth_callback(struct cli_def *cli, int (*auth_callback)(const char *, const char *)) {
@@ -305,43 +837,12 @@ void cli_set_promptchar(struct cli_def *cli, const char *promptchar) {
   cli->promptchar = strdup(promptchar);
 }
 
-static int cli_build_shortest(struct cli_def *cli, struct cli_command *commands) {
-  struct cli_command *c, *p;
-  char *cp, *pp;
-  unsigned len;
-
-  for (c = commands; c; c = c->next) {
-    c->unique_len = strlen(c->command);
-    if ((c->mode != MODE_ANY && c->mode != cli->mode) || c->privilege > cli->privilege) continue;
-
-    c->unique_len = 1;
-    for (p = commands; p; p = p->next) {
-      if (c == p) continue;
-      if (c->command_type != p->command_type) continue;
-      if ((p->mode != MODE_ANY && p->mode != cli->mode) || p->privilege > cli->privilege) continue;
-
-      cp = c->command;
-      pp = p->command;
-      len = 1;
-
-      while (*cp && *pp && *cp++ == *pp++) len++;
-
-      if (len > c->unique_len) c->unique_len = len;
-    }
-
-    if (c->children) cli_build_shortest(cli, c->children);
-  }
-
-  return CLI_OK;
-}
-
 int cli_set_privilege(struct cli_def *cli, int priv) {
   int old = cli->privilege;
   cli->privilege = priv;
 
   if (priv != old) {
     cli_set_promptchar(cli, priv == PRIVILEGE_PRIVILEGED ? "# " : "> ");
-    cli_build_shortest(cli, cli->commands);
   }
 
   return old;
@@ -367,119 +868,471 @@ int cli_set_configmode(struct cli_def *cli, int mode, const char *config_desc) {
     } else {
       cli_set_modestring(cli, "(config)");
     }
-
-    cli_build_shortest(cli, cli->commands);
   }
 
   return old;
 }
 
-struct cli_command *cli_register_command_core(struct cli_def *cli, struct cli_command *parent, struct cli_command *c) {
-  struct cli_command *p = NULL;
+/*
+ * Each level of the command tree has an index of its commands sorted by type and name (ignoring case), then by the
+ * order they were registered in.  The commands a word typed by the user could be are then next to each other, and
+ * are found with a binary search instead of comparing the word against every sibling.  Registering only appends, the
+ * index is sorted the next time it's searched.
+ */
+struct cli_command_index {
+  struct cli_command **entries;
+  size_t len;
+  size_t size;
+  int sorted;
+  unsigned next_seq;
+  struct cli_command *tail;  // Last command in the sibling list, where the next one registered goes
+};
 
-  if (!c) return NULL;
+static int cli_int_index_compare(const void *a, const void *b) {
+  const struct cli_command *x = *(struct cli_command *const *)a;
+  const struct cli_command *y = *(struct cli_command *const *)b;
+  int rc;
 
-  c->parent = parent;
+  if (x->command_type != y->command_type) return x->command_type < y->command_type ? -1 : 1;
+  if ((rc = strcasecmp(x->command, y->command))) return rc;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
 
-  /* Go build the 'full command name' now that told it who its parent is.
-   * If this fails, clean it up and return a NULL w/o proceeding.
-   */
-  if (!(c->full_command_name = cli_int_command_name(cli, c))) {
-    cli_free_command(cli, c);
-    return NULL;
+/*
+ * The commands and filters registered on a cli.  Sessions made with cli_init_shared() use the same registry as the
+ * cli they were made from rather than registering everything again, it's freed along with the last of them.
+ */
+struct cli_registry {
+  unsigned refs;
+  struct cli_command *commands;
+  struct cli_command_index *index;          // Sorted index of the top level commands
+  struct cli_static_table *static_tables;  // Storage for commands from cli_register_static_commands()
+  struct cli_compiled_pattern *patterns;   // Compiled regexes not in use, see cli_int_pattern_get()
+  int num_patterns;
+};
+
+// Buildmode's commands belong to the session that entered it, the rest of the top level is in the registry
+static int cli_int_session_level(struct cli_def *cli, int type) {
+  return type == CLI_BUILDMODE_COMMAND && cli->buildmode;
+}
+
+static struct cli_command **cli_int_top_level(struct cli_def *cli, int type) {
+  return cli_int_session_level(cli, type) ? &cli->buildmode->commands : &cli->registry->commands;
+}
+
+static struct cli_command_index **cli_int_index_of(struct cli_def *cli, struct cli_command *parent, int type) {
+  if (parent) return &parent->index;
+  return cli_int_session_level(cli, type) ? &cli->buildmode->index : &cli->registry->index;
+}
+
+static void cli_int_index_free(struct cli_command_index **index) {
+  if (!*index) return;
+  free((*index)->entries);
+  free_z(*index);
+}
+
+// Make room for 'count' more commands in the index of 'parent', creating it if need be
+static struct cli_command_index *cli_int_index_reserve(struct cli_def *cli, struct cli_command *parent, int type,
+                                                       size_t count) {
+  struct cli_command_index **indexp = cli_int_index_of(cli, parent, type);
+  struct cli_command_index *index = *indexp;
+
+  if (!index) {
+    if (!(index = calloc(sizeof(struct cli_command_index), 1))) return NULL;
+    index->sorted = 1;
+    *indexp = index;
   }
-  /*
-   * Figure out we have a chain, or would be the first element on it.
-   * If we'd be the first element, assign as such.
-   * Otherwise find the lead element so we can trace it below.
-   */
 
-  if (parent) {
-    if (!parent->children) {
-      parent->children = c;
-    } else {
-      p = parent->children;
-    }
-  } else {
-    if (!cli->commands) {
-      cli->commands = c;
-    } else {
-      p = cli->commands;
-    }
+  if (index->len + count > index->size) {
+    size_t size = index->size ? index->size : 16;
+    struct cli_command **entries;
+
+    while (size < index->len + count) size *= 2;
+    if (!(entries = realloc(index->entries, size * sizeof(*entries)))) return NULL;
+    index->entries = entries;
+    index->size = size;
   }
+  return index;
+}
 
-  /*
-   * If we have a chain (p is not null), run down to the last element and place this command at the end
-   */
-  for (; p && p->next; p = p->next)
-    ;
+static int cli_int_index_add(struct cli_def *cli, struct cli_command *parent, struct cli_command *c) {
+  struct cli_command_index *index = cli_int_index_reserve(cli, parent, c->command_type, 1);
 
-  if (p) {
-    p->next = c;
-    c->previous = p;
+  if (!index) return CLI_ERROR;
+  c->seq = index->next_seq++;
+  if (index->len && cli_int_index_compare(&index->entries[index->len - 1], &c) > 0) index->sorted = 0;
+  index->entries[index->len++] = c;
+  return CLI_OK;
+}
+
+// Lookups only hold the tree lock for reading, so the first of them to find the index out of order sorts it
+static void cli_int_index_sort(struct cli_command_index *index) {
+  if (CLI_ATOMIC_LOAD(index->sorted)) return;
+  cli_int_tree_mutex_lock();
+  if (!index->sorted) {
+    qsort(index->entries, index->len, sizeof(*index->entries), cli_int_index_compare);
+    CLI_ATOMIC_STORE(index->sorted, 1);
   }
-  return c;
+  cli_int_tree_mutex_unlock();
 }
 
-struct cli_command *cli_register_command(struct cli_def *cli, struct cli_command *parent, const char *command,
-                                         int (*callback)(struct cli_def *cli, const char *, char **, int),
-                                         int privilege, int mode, const char *help) {
-  struct cli_command *c;
+// The position of the first entry of 'type' which doesn't sort before 'name'
+static size_t cli_int_index_lower_bound(struct cli_command_index *index, int type, const char *name) {
+  size_t lo = 0, hi = index->len;
 
-  if (!command) return NULL;
-  if (!(c = calloc(sizeof(struct cli_command), 1))) return NULL;
-  c->command_type = CLI_REGULAR_COMMAND;
-  c->callback = callback;
-  c->next = NULL;
-  if (!(c->command = strdup(command))) {
-    free(c);
-    return NULL;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    struct cli_command *c = index->entries[mid];
+
+    if (c->command_type < type || (c->command_type == type && strcasecmp(c->command, name) < 0))
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return lo;
+}
 
-  c->privilege = privilege;
-  c->mode = mode;
-  if (help && !(c->help = strdup(help))) {
-    free(c->command);
-    free(c);
-    return NULL;
+static void cli_int_index_remove(struct cli_def *cli, struct cli_command *c) {
+  struct cli_command_index *index = *cli_int_index_of(cli, c->parent, c->command_type);
+  size_t i;
+
+  if (!index) return;
+  cli_int_index_sort(index);
+  for (i = cli_int_index_lower_bound(index, c->command_type, c->command); i < index->len; i++) {
+    if (index->entries[i] != c) continue;
+    if (index->tail == c) index->tail = c->previous;
+    index->len--;
+    memmove(index->entries + i, index->entries + i + 1, (index->len - i) * sizeof(*index->entries));
+    return;
   }
+}
 
-  return cli_register_command_core(cli, parent, c);
+/*
+ * Find the commands of 'type' at one level of the tree ('parent' NULL for the top) whose names start with 'word',
+ * ignoring case.  Sets *first to the first of them and returns how many there are.
+ */
+static size_t cli_int_index_match(struct cli_def *cli, struct cli_command *parent, int type, const char *word,
+                                  struct cli_command ***first) {
+  struct cli_command_index *index = *cli_int_index_of(cli, parent, type);
+  size_t word_len = strlen(word);
+  size_t i, n;
+
+  if (!index) return 0;
+  cli_int_index_sort(index);
+  i = cli_int_index_lower_bound(index, type, word);
+  for (n = i; n < index->len; n++) {
+    struct cli_command *c = index->entries[n];
+    if (c->command_type != type || strncasecmp(c->command, word, word_len)) break;
+  }
+  *first = index->entries + i;
+  return n - i;
 }
 
-static void cli_free_command(struct cli_def *cli, struct cli_command *cmd) {
-  struct cli_command *c, *p;
+static int cli_int_visible(struct cli_def *cli, struct cli_command *c) {
+  return (c->mode == MODE_ANY || c->mode == cli->mode) && c->privilege <= cli->privilege;
+}
 
-  for (c = cmd->children; c;) {
-    p = c->next;
-    cli_free_command(cli, c);
-    c = p;
-  }
+// Length of the common prefix of two command names, ignoring case as matching does
+static unsigned cli_int_common_prefix(const char *a, const char *b) {
+  unsigned len = 0;
 
-  free(cmd->command);
-  if (cmd->help) free(cmd->help);
-  if (cmd->optargs) cli_unregister_all_optarg(cmd);
+  while (a[len] && tolower((unsigned char)a[len]) == tolower((unsigned char)b[len])) len++;
+  return len;
+}
+
+/*
+ * Work out how much of the name of the command at 'entry' in the index of 'parent' has to be typed to tell it apart
+ * from the other commands available in the current mode and at the current privilege level.  In sorted order the
+ * visible siblings sharing the longest prefix with it are the nearest ones on either side, so only the entries
+ * between it and them are looked at.  This is done as commands are looked up, changing mode or privilege costs
+ * nothing.
+ *
+ * Filters are the exception.  Longer filter names starting with the whole of this one (which sort straight after it)
+ * are passed over, so that 'inc' is still include rather than being ambiguous with include-any, which takes
+ * 'include-'.  Commands are left as they always were, an abbreviation of 'show' with 'showall' there is ambiguous.
+ */
+static unsigned cli_int_unique_len(struct cli_def *cli, struct cli_command *parent, struct cli_command **entry) {
+  struct cli_command_index *index = *cli_int_index_of(cli, parent, (*entry)->command_type);
+  struct cli_command **end = index->entries + index->len;
+  struct cli_command *c = *entry;
+  struct cli_command **p;
+  unsigned best = 0;
+
+  if (!cli_int_visible(cli, c)) return strlen(c->command);
+
+  for (p = entry; p-- > index->entries && (*p)->command_type == c->command_type;) {
+    unsigned len = cli_int_common_prefix(c->command, (*p)->command);
+    if (!len) break;
+    if (cli_int_visible(cli, *p)) {
+      best = len;
+      break;
+    }
+  }
+
+  // Anything further away shares no more than what has already been found
+  for (p = entry + 1; p < end && (*p)->command_type == c->command_type; p++) {
+    unsigned len = cli_int_common_prefix(c->command, (*p)->command);
+    if (c->command_type == CLI_FILTER_COMMAND && !c->command[len] && (*p)->command[len]) continue;
+    if (len <= best) break;
+    if (cli_int_visible(cli, *p)) {
+      best = len;
+      break;
+    }
+  }
+
+  return best + 1;
+}
+
+static int cli_int_seq_compare(const void *a, const void *b) {
+  const struct cli_command *x = *(struct cli_command *const *)a;
+  const struct cli_command *y = *(struct cli_command *const *)b;
+
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+struct cli_command *cli_register_command_core(struct cli_def *cli, struct cli_command *parent, struct cli_command *c) {
+  struct cli_command_index *index;
+  struct cli_command *p;
+
+  if (!c) return NULL;
+
+  c->parent = parent;
+  if (cli_int_index_add(cli, parent, c) != CLI_OK) {
+    cli_int_destroy_command(c);
+    return NULL;
+  }
+
+  /*
+   * The index keeps track of the last element of the chain so this command can be placed at the end without running
+   * down to it.  If there's no chain yet this is the first element.  The full command name is left until it's needed.
+   */
+  index = *cli_int_index_of(cli, parent, c->command_type);
+  p = index->tail;
+  index->tail = c;
+
+  if (p) {
+    p->next = c;
+    c->previous = p;
+  } else if (parent) {
+    parent->children = c;
+  } else {
+    *cli_int_top_level(cli, c->command_type) = c;
+  }
+  return c;
+}
+
+struct cli_command *cli_register_command(struct cli_def *cli, struct cli_command *parent, const char *command,
+                                         int (*callback)(struct cli_def *cli, const char *, char **, int),
+                                         int privilege, int mode, const char *help) {
+  struct cli_command *c;
+
+  if (!command) return NULL;
+  if (!(c = calloc(sizeof(struct cli_command), 1))) return NULL;
+  c->command_type = CLI_REGULAR_COMMAND;
+  c->callback = callback;
+  c->next = NULL;
+  if (!(c->command = strdup(command))) {
+    free(c);
+    return NULL;
+  }
+
+  c->privilege = privilege;
+  c->mode = mode;
+  if (help && !(c->help = strdup(help))) {
+    free(c->command);
+    free(c);
+    return NULL;
+  }
+
+  cli_int_tree_write(CLI_REGULAR_COMMAND);
+  c = cli_register_command_core(cli, parent, c);
+  cli_int_tree_written(CLI_REGULAR_COMMAND);
+  return c;
+}
+
+int cli_register_commands(struct cli_def *cli, struct cli_command *parent, const struct cli_command_spec *specs,
+                          size_t n) {
+  size_t i, j;
+  int reserved;
+
+  if (!cli || (n && !specs)) return CLI_ERROR;
+
+  // Grow the index once for all of them
+  if (n) {
+    cli_int_tree_write(CLI_REGULAR_COMMAND);
+    reserved = cli_int_index_reserve(cli, parent, CLI_REGULAR_COMMAND, n) != NULL;
+    cli_int_tree_written(CLI_REGULAR_COMMAND);
+    if (!reserved) return CLI_ERROR;
+  }
+
+  for (i = 0; i < n; i++) {
+    const struct cli_command_spec *spec = &specs[i];
+    struct cli_command *c =
+        cli_register_command(cli, parent, spec->command, spec->callback, spec->privilege, spec->mode, spec->help);
+
+    if (!c) return CLI_ERROR;
+    for (j = 0; j < spec->num_optargs; j++) {
+      const struct cli_optarg_spec *o = &spec->optargs[j];
+
+      if (!cli_register_optarg(c, o->name, o->flags, o->privilege, o->mode, o->help, o->get_completions, o->validator,
+                               o->transient_mode))
+        return CLI_ERROR;
+    }
+    if (spec->num_children && cli_register_commands(cli, c, spec->children, spec->num_children) != CLI_OK)
+      return CLI_ERROR;
+  }
+  return CLI_OK;
+}
+
+// Storage for a table given to cli_register_static_commands(), the commands followed by all their optargs
+struct cli_static_table {
+  struct cli_static_table *next;
+  struct cli_command commands[];
+};
+
+static size_t cli_int_static_count(const struct cli_command_spec *specs, size_t n, size_t *optargs) {
+  size_t commands = n;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (!specs[i].command) return 0;
+    *optargs += specs[i].num_optargs;
+    if (specs[i].num_children) {
+      size_t children = cli_int_static_count(specs[i].children, specs[i].num_children, optargs);
+
+      if (!children) return 0;
+      commands += children;
+    }
+  }
+  return commands;
+}
+
+static int cli_int_static_register(struct cli_def *cli, struct cli_command *parent,
+                                   const struct cli_command_spec *specs, size_t n, struct cli_command **next_command,
+                                   struct cli_optarg **next_optarg) {
+  size_t i, j;
+
+  if (!cli_int_index_reserve(cli, parent, CLI_REGULAR_COMMAND, n)) return CLI_ERROR;
+
+  for (i = 0; i < n; i++) {
+    const struct cli_command_spec *spec = &specs[i];
+    struct cli_command *c = (*next_command)++;
+    struct cli_optarg **tail = &c->optargs;
+
+    // The strings stay in the table, CLI_CMD_STATIC stops them or the command itself being freed
+    c->command_type = CLI_REGULAR_COMMAND;
+    c->flags = CLI_CMD_STATIC;
+    c->command = (char *)spec->command;
+    c->help = (char *)spec->help;
+    c->callback = spec->callback;
+    c->privilege = spec->privilege;
+    c->mode = spec->mode;
+
+    for (j = 0; j < spec->num_optargs; j++) {
+      const struct cli_optarg_spec *o = &spec->optargs[j];
+      struct cli_optarg *optarg = (*next_optarg)++;
+
+      optarg->name = (char *)o->name;
+      optarg->help = (char *)o->help;
+      optarg->flags = o->flags | CLI_CMD_STATIC;
+      optarg->privilege = o->privilege;
+      optarg->mode = o->mode;
+      optarg->get_completions = o->get_completions;
+      optarg->validator = o->validator;
+      optarg->transient_mode = o->transient_mode;
+      *tail = optarg;
+      tail = &optarg->next;
+    }
+    if (c->optargs) cli_optarg_build_shortest(c->optargs);
+
+    if (!cli_register_command_core(cli, parent, c)) return CLI_ERROR;
+    if (spec->num_children &&
+        cli_int_static_register(cli, c, spec->children, spec->num_children, next_command, next_optarg) != CLI_OK)
+      return CLI_ERROR;
+  }
+  return CLI_OK;
+}
+
+int cli_register_static_commands(struct cli_def *cli, struct cli_command *parent, const struct cli_command_spec *specs,
+                                 size_t n) {
+  struct cli_static_table *table;
+  struct cli_command *next_command;
+  struct cli_optarg *next_optarg;
+  size_t commands, optargs = 0;
+  int retval;
+
+  if (!cli || !specs || !n) return n ? CLI_ERROR : CLI_OK;
+  if (!(commands = cli_int_static_count(specs, n, &optargs))) return CLI_ERROR;
+
+  // One allocation for the whole table, kept until cli_done() even if some of the commands are unregistered
+  table = calloc(sizeof(struct cli_static_table) + commands * sizeof(struct cli_command) +
+                     optargs * sizeof(struct cli_optarg),
+                 1);
+  if (!table) return CLI_ERROR;
+
+  cli_int_tree_write(CLI_REGULAR_COMMAND);
+  table->next = cli->registry->static_tables;
+  cli->registry->static_tables = table;
+
+  next_command = table->commands;
+  next_optarg = (struct cli_optarg *)(table->commands + commands);
+  retval = cli_int_static_register(cli, parent, specs, n, &next_command, &next_optarg);
+  cli_int_tree_written(CLI_REGULAR_COMMAND);
+  return retval;
+}
+
+// Free a command and everything below it, once it's out of the tree and nothing can be using it
+static void cli_int_destroy_command(struct cli_command *cmd) {
+  struct cli_command *c, *p;
+  struct cli_optarg *o, *n;
+
+  // The children go all at once, there's no point taking them out of the index one by one
+  cli_int_index_free(&cmd->index);
+
+  for (c = cmd->children; c;) {
+    p = c->next;
+    cli_int_destroy_command(c);
+    c = p;
+  }
+
+  if (!(cmd->flags & CLI_CMD_STATIC)) {
+    free(cmd->command);
+    if (cmd->help) free(cmd->help);
+  }
+  for (o = cmd->optargs; o; o = n) {
+    n = o->next;
+    cli_free_optarg(o);
+  }
   if (cmd->full_command_name) free(cmd->full_command_name);
+  if (!(cmd->flags & CLI_CMD_STATIC)) free(cmd);
+}
+
+static void cli_free_command(struct cli_def *cli, struct cli_command *cmd) {
+  struct cli_command **top = cli_int_top_level(cli, cmd->command_type);
+
+  cli_int_index_remove(cli, cmd);
+
   /*
    * Ok, update the pointers of anyone who pointed to us.
    * We have 3 pointers to worry about - parent, previous, and next.
-   * We don't have to worry about children since they've been cleared above.
+   * We don't have to worry about children since they go along with us.
    * If both cli->command points to us we need to update cli->command to point to whatever command is 'next'.
    * Otherwise ensure that any item before/behind us points around us.
    *
    * Important - there is no provision for deleting a discrete subcommand.
    * For example, suppose we define foo, then bar with foo as the parent, then baz with bar as the parent.  We cannot
    * delete 'bar' and have a new chain of foo -> baz.
-   * The above freeing of children prevents this in the first place.
+   * Freeing the children along with the command prevents this in the first place.
    */
 
-  if (cmd == cli->commands) {
-    cli->commands = cmd->next;
+  if (cmd == *top) {
+    *top = cmd->next;
     if (cmd->next) {
       cmd->next->parent = NULL;
       cmd->next->previous = NULL;
     }
   } else {
+    if (cmd->parent && cmd->parent->children == cmd) cmd->parent->children = cmd->next;
     if (cmd->previous) {
       cmd->previous->next = cmd->next;
     }
@@ -487,23 +1340,29 @@ static void cli_free_command(struct cli_def *cli, struct cli_command *cmd) {
       cmd->next->previous = cmd->previous;
     }
   }
-  free(cmd);
+
+  // Another session may have found the command and be about to run it
+  if (cmd->command_type == CLI_BUILDMODE_COMMAND)
+    cli_int_destroy_command(cmd);
+  else
+    cli_int_retire(cli->registry, cmd, NULL);
 }
 
 int cli_int_unregister_command_core(struct cli_def *cli, const char *command, int command_type) {
-  struct cli_command *c, *p = NULL;
+  struct cli_command **c;
+  size_t n;
 
   if (!command) return -1;
-  if (!cli->commands) return CLI_OK;
 
-  for (c = cli->commands; c;) {
-    p = c->next;
-    if (strcmp(c->command, command) == 0 && c->command_type == command_type) {
-      cli_free_command(cli, c);
-      return CLI_OK;
+  // The index puts names differing only in case together, in the order they were registered
+  cli_int_tree_write(command_type);
+  for (n = cli_int_index_match(cli, NULL, command_type, command, &c); n; n--, c++) {
+    if (strcmp((*c)->command, command) == 0) {
+      cli_free_command(cli, *c);
+      break;
     }
-    c = p;
   }
+  cli_int_tree_written(command_type);
 
   return CLI_OK;
 }
@@ -549,7 +1408,9 @@ int cli_disable(struct cli_def *cli, UNUSED(const char *command), UNUSED(char *a
 
 int cli_help(struct cli_def *cli, UNUSED(const char *command), UNUSED(char *argv[]), UNUSED(int argc)) {
   cli_error(cli, "\nCommands available:");
-  cli_show_help(cli, cli->commands);
+  cli_int_tree_read();
+  cli_show_help(cli, cli->registry->commands);
+  cli_int_tree_unlock();
   return CLI_OK;
 }
 
@@ -593,19 +1454,10 @@ int cli_int_configure_terminal(struct cli_def *cli, UNUSED(const char *command),
   return CLI_OK;
 }
 
-struct cli_def *cli_init() {
-  struct cli_def *cli;
+// The commands and filters every cli starts with
+static int cli_int_register_builtins(struct cli_def *cli) {
   struct cli_command *c;
 
-  if (!(cli = calloc(sizeof(struct cli_def), 1))) return 0;
-
-  cli->buf_size = 1024;
-  if (!(cli->buffer = calloc(cli->buf_size, 1))) {
-    cli_done(cli);
-    return 0;
-  }
-  cli->telnet_protocol = 1;
-
   cli_register_command(cli, 0, "help", cli_help, PRIVILEGE_UNPRIVILEGED, MODE_ANY, "Show available commands");
   cli_register_command(cli, 0, "quit", cli_quit, PRIVILEGE_UNPRIVILEGED, MODE_ANY, "Disconnect");
   cli_register_command(cli, 0, "logout", cli_quit, PRIVILEGE_UNPRIVILEGED, MODE_ANY, "Disconnect");
@@ -616,29 +1468,20 @@ struct cli_def *cli_init() {
   cli_register_command(cli, 0, "disable", cli_disable, PRIVILEGE_PRIVILEGED, MODE_EXEC, "Turn off privileged commands");
 
   c = cli_register_command(cli, 0, "configure", 0, PRIVILEGE_PRIVILEGED, MODE_EXEC, "Enter configuration mode");
-  if (!c) {
-    cli_done(cli);
-    return 0;
-  }
+  if (!c) return CLI_ERROR;
   cli_register_command(cli, c, "terminal", cli_int_configure_terminal, PRIVILEGE_PRIVILEGED, MODE_EXEC,
                        "Conlfigure from the terminal");
 
   // And now the built in filters
   c = cli_register_filter(cli, "begin", cli_range_filter_init, cli_range_filter, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                           "Begin with lines that match");
-  if (!c) {
-    cli_done(cli);
-    return 0;
-  }
+  if (!c) return CLI_ERROR;
   cli_register_optarg(c, "range_start", CLI_CMD_ARGUMENT | CLI_CMD_REMAINDER_OF_LINE, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                       "Begin showing lines that match", NULL, NULL, NULL);
 
   c = cli_register_filter(cli, "between", cli_range_filter_init, cli_range_filter, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                           "Between lines that match");
-  if (!c) {
-    cli_done(cli);
-    return 0;
-  }
+  if (!c) return CLI_ERROR;
   cli_register_optarg(c, "range_start", CLI_CMD_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                       "Begin showing lines that match", NULL, NULL, NULL);
   cli_register_optarg(c, "range_end", CLI_CMD_ARGUMENT | CLI_CMD_REMAINDER_OF_LINE, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
@@ -648,29 +1491,40 @@ struct cli_def *cli_init() {
                       "Count of lines");
 
   c = cli_register_filter(cli, "exclude", cli_match_filter_init, cli_match_filter, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
-                          "Exclude lines that match");
-  if (!c) {
-    cli_done(cli);
-    return 0;
-  }
+                          "Exclude lines that match (options: -v, -i, -e)");
+  if (!c) return CLI_ERROR;
+  cli_register_optarg(c, "search_flags", CLI_CMD_HYPHENATED_OPTION, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
+                      "Search flags (-[ive]", NULL, cli_search_flags_validator, NULL);
   cli_register_optarg(c, "search_pattern", CLI_CMD_ARGUMENT | CLI_CMD_REMAINDER_OF_LINE, PRIVILEGE_UNPRIVILEGED,
                       MODE_ANY, "Search pattern", NULL, NULL, NULL);
 
+  c = cli_register_filter(cli, "exclude-any", cli_multi_filter_init, cli_multi_filter, PRIVILEGE_UNPRIVILEGED,
+                          MODE_ANY, "Exclude lines matching any pattern (options: -v, -i, -e)");
+  if (!c) return CLI_ERROR;
+  cli_register_optarg(c, "search_flags", CLI_CMD_HYPHENATED_OPTION, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
+                      "Search flags (-[ive]", NULL, cli_search_flags_validator, NULL);
+  cli_register_optarg(c, "search_pattern", CLI_CMD_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
+                      "Search patterns, separated by spaces", NULL, NULL, NULL);
+
   c = cli_register_filter(cli, "include", cli_match_filter_init, cli_match_filter, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
-                          "Include lines that match");
-  if (!c) {
-    cli_done(cli);
-    return 0;
-  }
+                          "Include lines that match (options: -v, -i, -e)");
+  if (!c) return CLI_ERROR;
+  cli_register_optarg(c, "search_flags", CLI_CMD_HYPHENATED_OPTION, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
+                      "Search flags (-[ive]", NULL, cli_search_flags_validator, NULL);
   cli_register_optarg(c, "search_pattern", CLI_CMD_ARGUMENT | CLI_CMD_REMAINDER_OF_LINE, PRIVILEGE_UNPRIVILEGED,
                       MODE_ANY, "Search pattern", NULL, NULL, NULL);
 
+  c = cli_register_filter(cli, "include-any", cli_multi_filter_init, cli_multi_filter, PRIVILEGE_UNPRIVILEGED,
+                          MODE_ANY, "Include lines matching any pattern (options: -v, -i, -e)");
+  if (!c) return CLI_ERROR;
+  cli_register_optarg(c, "search_flags", CLI_CMD_HYPHENATED_OPTION, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
+                      "Search flags (-[ive]", NULL, cli_search_flags_validator, NULL);
+  cli_register_optarg(c, "search_pattern", CLI_CMD_ARGUMENT, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
+                      "Search patterns, separated by spaces", NULL, NULL, NULL);
+
   c = cli_register_filter(cli, "grep", cli_match_filter_init, cli_match_filter, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                           "Include lines that match regex (options: -v, -i, -e)");
-  if (!c) {
-    cli_done(cli);
-    return 0;
-  }
+  if (!c) return CLI_ERROR;
   cli_register_optarg(c, "search_flags", CLI_CMD_HYPHENATED_OPTION, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                       "Search flags (-[ivx]", NULL, cli_search_flags_validator, NULL);
   cli_register_optarg(c, "search_pattern", CLI_CMD_ARGUMENT | CLI_CMD_REMAINDER_OF_LINE, PRIVILEGE_UNPRIVILEGED,
@@ -678,14 +1532,41 @@ struct cli_def *cli_init() {
 
   c = cli_register_filter(cli, "egrep", cli_match_filter_init, cli_match_filter, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                           "Include lines that match extended regex");
-  if (!c) {
-    cli_done(cli);
-    return 0;
-  }
+  if (!c) return CLI_ERROR;
   cli_register_optarg(c, "search_flags", CLI_CMD_HYPHENATED_OPTION, PRIVILEGE_UNPRIVILEGED, MODE_ANY,
                       "Search flags (-[ivx]", NULL, cli_search_flags_validator, NULL);
   cli_register_optarg(c, "search_pattern", CLI_CMD_ARGUMENT | CLI_CMD_REMAINDER_OF_LINE, PRIVILEGE_UNPRIVILEGED,
                       MODE_ANY, "Search pattern", NULL, NULL, NULL);
+  return CLI_OK;
+}
+
+static struct cli_def *cli_int_init(struct cli_registry *registry) {
+  struct cli_def *cli;
+
+  if (!(cli = calloc(sizeof(struct cli_def), 1))) return 0;
+
+  cli->buf_size = 1024;
+  if (!(cli->buffer = calloc(cli->buf_size, 1))) {
+    cli_done(cli);
+    return 0;
+  }
+  cli->telnet_protocol = 1;
+
+  if (registry) {
+    cli_int_tree_mutex_lock();
+    registry->refs++;
+    cli_int_tree_mutex_unlock();
+    cli->registry = registry;
+  } else if (!(cli->registry = calloc(sizeof(struct cli_registry), 1))) {
+    cli_done(cli);
+    return 0;
+  } else {
+    cli->registry->refs = 1;
+    if (cli_int_register_builtins(cli) != CLI_OK) {
+      cli_done(cli);
+      return 0;
+    }
+  }
 
   cli->privilege = cli->mode = -1;
   cli_set_privilege(cli, PRIVILEGE_UNPRIVILEGED);
@@ -700,30 +1581,73 @@ struct cli_def *cli_init() {
   return cli;
 }
 
+struct cli_def *cli_init() {
+  return cli_int_init(NULL);
+}
+
+struct cli_def *cli_init_shared(struct cli_def *cli) {
+  return cli ? cli_int_init(cli->registry) : NULL;
+}
+
 void cli_unregister_tree(struct cli_def *cli, struct cli_command *command, int command_type) {
   struct cli_command *c, *p = NULL;
 
-  if (!command) command = cli->commands;
+  cli_int_tree_write(command_type);
+  if (!command) command = cli->registry->commands;
+
+  // Emptying the top level, the whole index goes rather than one command at a time
+  if (command == cli->registry->commands && command_type == CLI_ANY_COMMAND) cli_int_index_free(&cli->registry->index);
 
   for (c = command; c;) {
+    struct cli_command **top = cli_int_top_level(cli, c->command_type);
+
     p = c->next;
     if (c->command_type == command_type || command_type == CLI_ANY_COMMAND) {
-      if (c == cli->commands) cli->commands = c->next;
+      if (c == *top) *top = c->next;
       // Unregister all child commands
       cli_free_command(cli, c);
     }
     c = p;
   }
+  cli_int_tree_written(command_type);
 }
 
 void cli_unregister_all(struct cli_def *cli, struct cli_command *command) {
   cli_unregister_tree(cli, command, CLI_REGULAR_COMMAND);
 }
 
+// Let go of the commands, freeing them if no other session is using them
+static void cli_int_registry_release(struct cli_def *cli) {
+  struct cli_registry *registry = cli->registry;
+  int refs;
+
+  if (!registry) return;
+  cli_int_tree_mutex_lock();
+  refs = --registry->refs;
+  cli_int_tree_mutex_unlock();
+  if (refs) {
+    cli->registry = NULL;
+    return;
+  }
+
+  cli_unregister_tree(cli, registry->commands, CLI_ANY_COMMAND);
+  cli_int_retired_flush(registry);
+  while (registry->static_tables) {
+    struct cli_static_table *table = registry->static_tables;
+
+    registry->static_tables = table->next;
+    free(table);
+  }
+  cli_int_index_free(&registry->index);
+  cli_int_patterns_free(registry);
+  free_z(cli->registry);
+}
+
 int cli_done(struct cli_def *cli) {
   if (!cli) return CLI_OK;
   struct unp *u = cli->users, *n;
 
+  if (cli->stream) cli_int_stream_free(cli);
   cli_free_history(cli);
 
   // Free all users
@@ -736,7 +1660,10 @@ int cli_done(struct cli_def *cli) {
   }
 
   if (cli->buildmode) cli_int_free_buildmode(cli);
-  cli_unregister_tree(cli, cli->commands, CLI_ANY_COMMAND);
+  cli_int_registry_release(cli);
+  cli_int_arena_free(cli);
+  cli_int_cache_free(cli);
+  cli_set_filter_threads(cli, 0);
   free_z(cli->promptchar);
   free_z(cli->modestring);
   free_z(cli->banner);
@@ -771,28 +1698,134 @@ void cli_free_history(struct cli_def *cli) {
   }
 }
 
-static char *cli_int_return_newword(const char *start, const char *end) {
-  int len = end - start;
-  char *to = NULL;
-  char *newword = NULL;
+/*
+ * Everything made for a command line while it's parsed and run (the pipeline, its words and the optargs found) comes
+ * from a per-session arena.  Nothing is freed on its own, the arena is wound back to the pipeline once the command is
+ * finished with.  The oldest block is kept from one command to the next, so most command lines don't need any
+ * allocations at all.
+ */
+#define CLI_ARENA_BLOCK_SIZE 4096
+#define CLI_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct cli_arena_block {
+  struct cli_arena_block *next;  // The block before this one
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+// Zeroed memory lasting until the arena is wound back past it
+static void *cli_int_arena_alloc(struct cli_def *cli, size_t size) {
+  struct cli_arena_block *block = cli->arena;
+  void *p;
+
+  // Keep everything aligned for pointers, the strictest of anything kept here
+  size = CLI_ALIGN(size);
+  if (!block || block->size - block->used < size) {
+    size_t block_size = size > CLI_ARENA_BLOCK_SIZE ? size : CLI_ARENA_BLOCK_SIZE;
+
+    if (!(block = malloc(sizeof(struct cli_arena_block) + block_size))) return NULL;
+    block->next = cli->arena;
+    block->size = block_size;
+    block->used = 0;
+    cli->arena = block;
+  }
+
+  p = block->data + block->used;
+  block->used += size;
+  return memset(p, 0, size);
+}
+
+static char *cli_int_arena_strdup(struct cli_def *cli, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = cli_int_arena_alloc(cli, len);
+
+  return copy ? memcpy(copy, str, len) : NULL;
+}
+
+// Wind the arena back to 'mark', freeing everything allocated since
+static void cli_int_arena_release(struct cli_def *cli, void *mark) {
+  struct cli_arena_block *block;
+
+  while ((block = cli->arena)) {
+    if ((char *)mark >= block->data && (char *)mark < block->data + block->size) {
+      block->used = (char *)mark - block->data;
+      return;
+    }
+    if (!block->next) {
+      block->used = 0;
+      return;
+    }
+    cli->arena = block->next;
+    free(block);
+  }
+}
+
+static void cli_int_arena_free(struct cli_def *cli) {
+  struct cli_arena_block *block;
+
+  while ((block = cli->arena)) {
+    cli->arena = block->next;
+    free(block);
+  }
+}
 
-  // allocate space (including terminal NULL, then go through and deal with escaping characters as we copy them
+/*
+ * The words of a command line are split out of a copy of the line, in place: each is unescaped towards the start of
+ * the buffer and terminated there, so there's nothing to allocate per word.  A word is never moved past where it
+ * started, but its terminator can land on the character which ended it, so that's only written once the parser has
+ * moved on (see 'pending' below).
+ */
+static char *cli_int_return_newword(char **out, const char *start, const char *end) {
+  char *newword = *out;
+  char *to = newword;
 
-  if (!(newword = calloc(len + 1, 1))) return 0;
-  to = newword;
+  // Strip out escapes as the word is moved down
   while (start != end) {
     if (*start == '\\')
       start++;
     else
       *to++ = *start++;
   }
+  *out = to;
   return newword;
 }
 
-static int cli_parse_line(const char *line, char *words[], int max_words) {
+// The first character from 'p' which could end a word or need unescaping, or 'end' if there isn't one
+static const char *cli_int_skip_plain(const char *p, const char *end) {
+#ifdef __SSE2__
+  // Quotes, pipes, escapes, spaces, tabs to carriage returns, and anything over 0x7f in case isspace() thinks it is one
+  const __m128i space = _mm_set1_epi8(' '), dquote = _mm_set1_epi8('"'), squote = _mm_set1_epi8('\'');
+  const __m128i pipe = _mm_set1_epi8('|'), escape = _mm_set1_epi8('\\');
+  // '\t' to '\r' are moved to the bottom of the signed range, where one compare picks them out
+  const __m128i ctrl_shift = _mm_set1_epi8(128 - '\t'), ctrl_limit = _mm_set1_epi8(-128 + '\r' - '\t' + 1);
+
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, dquote)),
+                               _mm_or_si128(_mm_cmpeq_epi8(v, squote), _mm_cmpeq_epi8(v, pipe)));
+    int mask;
+
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, escape));
+    hit = _mm_or_si128(hit, _mm_cmplt_epi8(_mm_add_epi8(v, ctrl_shift), ctrl_limit));
+    if ((mask = _mm_movemask_epi8(hit) | _mm_movemask_epi8(v))) return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; p++) {
+    unsigned char c = *p;
+
+    if (c == ' ' || c == '"' || c == '\'' || c == '|' || c == '\\' || (c >= '\t' && c <= '\r') || c > 0x7f) break;
+  }
+  return p;
+}
+
+static int cli_parse_line(char *line, char *words[], int max_words) {
   int nwords = 0;
-  const char *p = line;
-  const char *word_start = 0;
+  char *p = line;
+  char *end = line + strlen(line);
+  char *word_start = 0;
+  char *out = line;
+  char *pending = NULL;  // Where the last word's terminator goes
   int inquote = 0;
 
   while (*p) {
@@ -819,7 +1852,9 @@ static int cli_parse_line(const char *line, char *words[], int max_words) {
     if (!*p || *p == inquote || (word_start && !inquote && (isspace(*p) || *p == '|'))) {
       // if we have a word start, extract from there to this character dealing with escapes
       if (word_start) {
-        if (!(words[nwords++] = cli_int_return_newword(word_start, p))) return 0;
+        if (pending) *pending = '\0';
+        words[nwords++] = cli_int_return_newword(&out, word_start, p);
+        pending = out++;
       }
 
       // now figure out how to proceed
@@ -833,22 +1868,27 @@ static int cli_parse_line(const char *line, char *words[], int max_words) {
       word_start = 0;
     } else if (!inquote && (*p == '"' || *p == '\'')) {
       if (word_start && word_start != p) {
-        if (!(words[nwords++] = cli_int_return_newword(word_start, p))) return 0;
+        if (pending) *pending = '\0';
+        words[nwords++] = cli_int_return_newword(&out, word_start, p);
+        pending = out++;
       }
       inquote = *p++;
       word_start = p;
     } else {
       if (!word_start) {
         if (*p == '|') {
-          if (!(words[nwords++] = strdup("|"))) return 0;
+          words[nwords++] = PIPE_WORD;
         } else if (!isspace(*p))
           word_start = p;
+        p++;
+      } else {
+        // Nothing in the middle of a word needs looking at until one of the characters above
+        p = (char *)cli_int_skip_plain(p + 1, end);
       }
-
-      p++;
     }
   }
 
+  if (pending) *pending = '\0';
   return nwords;
 }
 
@@ -876,41 +1916,458 @@ static char *join_words(int argc, char **argv) {
   return p;
 }
 
-int cli_run_command(struct cli_def *cli, const char *command) {
-  int rc = CLI_ERROR;
+/*
+ * Lines which are run over and over (by monitoring scripts, say) can skip finding their commands and parsing their
+ * optargs each time, see cli_set_command_cache().  Once a line has been validated a copy of its pipeline is kept,
+ * along with the mode and privilege it was found in and the generation of the command tree.  Any change to the
+ * commands moves the generation on, so nothing found before then is used again.
+ */
+struct cli_cached_line {
+  struct cli_cached_line *hash_next;
+  struct cli_cached_line *newer, *older;
+  unsigned int hash;
+  int mode;
+  int transient_mode;
+  int privilege;
+  unsigned long generation;
+  size_t size;  // Of the copy of the pipeline
   struct cli_pipeline *pipeline;
+  char line[];
+};
 
-  // Split command into pipeline stages
-  pipeline = cli_int_generate_pipeline(cli, command);
+struct cli_command_cache {
+  unsigned int max_entries;
+  unsigned int num_entries;
+  unsigned int mask;  // One less than the number of buckets
+  struct cli_cached_line **buckets;
+  struct cli_cached_line *newest, *oldest;
+};
 
-  // cli_int_validate_pipeline will deal with buildmode command setup, and return CLI_BUILDMODE_START if found.
-  if (pipeline) rc = cli_int_validate_pipeline(cli, pipeline);
+// Lay out 'size' bytes at *used in 'buf', or just count them if 'buf' is NULL
+static void *cli_int_layout(char *buf, size_t *used, size_t size) {
+  void *p = buf ? buf + *used : NULL;
 
-  if (rc == CLI_OK) {
-    rc = cli_int_execute_pipeline(cli, pipeline);
-  }
-  cli_int_free_pipeline(pipeline);
-  return rc;
+  *used += CLI_ALIGN(size);
+  return p;
 }
 
-void cli_get_completions(struct cli_def *cli, const char *command, char lastchar, struct cli_comphelp *comphelp) {
-  struct cli_command *c = NULL;
-  struct cli_command *n = NULL;
+static char *cli_int_layout_str(char *buf, size_t *used, const char *str) {
+  size_t len;
+  char *p;
 
-  int i;
-  int command_type;
-  struct cli_pipeline *pipeline = NULL;
-  struct cli_pipeline_stage *stage;
-  char *delim_start = DELIM_NONE;
-  char *delim_end = DELIM_NONE;
+  if (!str) return NULL;
+  len = strlen(str) + 1;
+  p = cli_int_layout(buf, used, len);
+  return p ? memcpy(p, str, len) : NULL;
+}
 
-  if (!(pipeline = cli_int_generate_pipeline(cli, command))) goto out;
+/*
+ * Copy a validated pipeline, with its words and the optargs found, into the single block at 'buf' and return its size.
+ * With 'buf' NULL only the size is worked out.  The pipeline itself comes first, so an arena copy is released through
+ * cli_int_free_pipeline() as usual.
+ */
+static size_t cli_int_copy_pipeline(const struct cli_pipeline *pipeline, char *buf) {
+  size_t used = 0;
+  struct cli_pipeline *copy = cli_int_layout(buf, &used, sizeof(struct cli_pipeline));
+  struct cli_pipeline_stage *stages = cli_int_layout(buf, &used, pipeline->num_stages * sizeof(*stages));
+  char **words = cli_int_layout(buf, &used, (pipeline->num_words + 1) * sizeof(char *));
+  char *cmdline = cli_int_layout_str(buf, &used, pipeline->cmdline);
+  int i;
 
-  stage = &pipeline->stage[pipeline->num_stages - 1];
+  for (i = 0; i < pipeline->num_words; i++) {
+    char *word = cli_int_layout_str(buf, &used, pipeline->words[i]);
 
-  // Check to see if either *no* input, or if the lastchar is a tab.
-  if ((!stage->words[0] || (command[strlen(command) - 1] == ' ')) && (stage->words[stage->num_words - 1]))
-    stage->num_words++;
+    if (buf) words[i] = word;
+  }
+  if (buf) {
+    *copy = *pipeline;
+    copy->cmdline = cmdline;
+    copy->words = words;
+    copy->stage = stages;
+    copy->current_stage = NULL;
+    words[i] = NULL;
+  }
+
+  for (i = 0; i < pipeline->num_stages; i++) {
+    const struct cli_pipeline_stage *stage = &pipeline->stage[i];
+    struct cli_optarg_pair *pair, **tail = NULL;
+
+    if (buf) {
+      stages[i] = *stage;
+      stages[i].words = words + (stage->words - pipeline->words);
+      stages[i].error_word = NULL;
+      tail = &stages[i].found_optargs;
+    }
+    for (pair = stage->found_optargs; pair; pair = pair->next) {
+      struct cli_optarg_pair *pair_copy = cli_int_layout(buf, &used, sizeof(struct cli_optarg_pair));
+      char *name = cli_int_layout_str(buf, &used, pair->name);
+      char *value = cli_int_layout_str(buf, &used, pair->value);
+
+      if (!buf) continue;
+      pair_copy->name = name;
+      pair_copy->value = value;
+      *tail = pair_copy;
+      tail = &pair_copy->next;
+    }
+    if (buf) *tail = NULL;
+  }
+  return used;
+}
+
+// FNV-1a
+static unsigned int cli_int_hash_line(const char *line) {
+  unsigned int hash = 2166136261u;
+
+  while (*line) hash = (hash ^ (unsigned char)*line++) * 16777619u;
+  return hash;
+}
+
+static void cli_int_cache_unlink(struct cli_command_cache *cache, struct cli_cached_line *entry) {
+  struct cli_cached_line **bucket = &cache->buckets[entry->hash & cache->mask];
+
+  while (*bucket != entry) bucket = &(*bucket)->hash_next;
+  *bucket = entry->hash_next;
+
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    cache->newest = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+  cache->num_entries--;
+}
+
+static void cli_int_cache_link(struct cli_command_cache *cache, struct cli_cached_line *entry) {
+  struct cli_cached_line **bucket = &cache->buckets[entry->hash & cache->mask];
+
+  entry->hash_next = *bucket;
+  *bucket = entry;
+
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest)
+    cache->newest->newer = entry;
+  else
+    cache->oldest = entry;
+  cache->newest = entry;
+  cache->num_entries++;
+}
+
+static void cli_int_cache_free(struct cli_def *cli) {
+  struct cli_command_cache *cache = cli->command_cache;
+
+  if (!cache) return;
+  while (cache->oldest) {
+    struct cli_cached_line *entry = cache->oldest;
+
+    cli_int_cache_unlink(cache, entry);
+    free(entry);
+  }
+  free(cache->buckets);
+  free_z(cli->command_cache);
+}
+
+int cli_set_command_cache(struct cli_def *cli, unsigned int entries) {
+  struct cli_command_cache *cache;
+  unsigned int buckets = 1;
+
+  cli_int_cache_free(cli);
+  if (!entries) return CLI_OK;
+
+  while (buckets < entries) buckets <<= 1;
+  if (!(cache = calloc(1, sizeof(struct cli_command_cache)))) return CLI_ERROR;
+  if (!(cache->buckets = calloc(buckets, sizeof(struct cli_cached_line *)))) {
+    free(cache);
+    return CLI_ERROR;
+  }
+  cache->max_entries = entries;
+  cache->mask = buckets - 1;
+  cli->command_cache = cache;
+  return CLI_OK;
+}
+
+// An arena copy of the pipeline kept for 'command', or NULL if there isn't one which can still be used
+static struct cli_pipeline *cli_int_cache_lookup(struct cli_def *cli, const char *command, unsigned long generation) {
+  struct cli_command_cache *cache = cli->command_cache;
+  struct cli_cached_line *entry;
+  unsigned int hash;
+  char *buf;
+
+  while (*command && isspace(*command)) command++;
+  hash = cli_int_hash_line(command);
+  for (entry = cache->buckets[hash & cache->mask]; entry; entry = entry->hash_next) {
+    if (entry->hash == hash && entry->mode == cli->mode && entry->transient_mode == cli->transient_mode &&
+        entry->privilege == cli->privilege && !strcmp(entry->line, command))
+      break;
+  }
+  if (!entry) return NULL;
+
+  cli_int_cache_unlink(cache, entry);
+  if (entry->generation != generation) {
+    free(entry);
+    return NULL;
+  }
+  cli_int_cache_link(cache, entry);
+
+  if (!(buf = cli_int_arena_alloc(cli, entry->size))) return NULL;
+  cli_int_copy_pipeline(entry->pipeline, buf);
+  return (struct cli_pipeline *)buf;
+}
+
+// Keep a copy of the pipeline validated for 'command', found at 'generation' of the commands
+static void cli_int_cache_add(struct cli_def *cli, const char *command, struct cli_pipeline *pipeline,
+                              unsigned long generation) {
+  struct cli_command_cache *cache = cli->command_cache;
+  struct cli_cached_line *entry;
+  size_t line_size, size;
+
+  while (*command && isspace(*command)) command++;
+  line_size = CLI_ALIGN(sizeof(struct cli_cached_line) + strlen(command) + 1);
+  size = cli_int_copy_pipeline(pipeline, NULL);
+  if (!(entry = malloc(line_size + size))) return;
+
+  strcpy(entry->line, command);
+  entry->hash = cli_int_hash_line(command);
+  entry->mode = cli->mode;
+  entry->transient_mode = cli->transient_mode;
+  entry->privilege = cli->privilege;
+  entry->generation = generation;
+  entry->size = size;
+  entry->pipeline = (struct cli_pipeline *)((char *)entry + line_size);
+  cli_int_copy_pipeline(pipeline, (char *)entry->pipeline);
+
+  if (cache->num_entries == cache->max_entries) {
+    struct cli_cached_line *oldest = cache->oldest;
+
+    cli_int_cache_unlink(cache, oldest);
+    free(oldest);
+  }
+  cli_int_cache_link(cache, entry);
+}
+
+int cli_run_command(struct cli_def *cli, const char *command) {
+  int rc = CLI_ERROR;
+  struct cli_pipeline *pipeline = NULL;
+  int use_cache = cli->command_cache && !cli->buildmode && command;
+  unsigned long generation = 0;
+
+  // The commands found are run after the tree lock has been let go, so mustn't be freed until they're finished with
+  cli_int_pin(cli);
+
+  if (use_cache) {
+    generation = cli_int_tree_generation();
+    if ((pipeline = cli_int_cache_lookup(cli, command, generation))) rc = CLI_OK;
+  }
+
+  if (!pipeline) {
+    int mode = cli->mode, transient_mode = cli->transient_mode, privilege = cli->privilege;
+
+    // Split command into pipeline stages
+    pipeline = cli_int_generate_pipeline(cli, command);
+
+    // cli_int_validate_pipeline will deal with buildmode command setup, and return CLI_BUILDMODE_START if found.
+    if (pipeline) rc = cli_int_validate_pipeline(cli, pipeline);
+
+    // Lines which changed the mode while they were being found would need to do that again, so aren't kept
+    if (use_cache && rc == CLI_OK && mode == cli->mode && transient_mode == cli->transient_mode &&
+        privilege == cli->privilege && !cli->buildmode)
+      cli_int_cache_add(cli, command, pipeline, generation);
+  }
+
+  if (rc == CLI_OK) {
+    rc = cli_int_execute_pipeline(cli, pipeline);
+  }
+  cli_int_free_pipeline(cli, pipeline);
+  cli_int_unpin(cli);
+  return rc;
+}
+
+/*
+ * A prepared command is a line whose commands have been found once, with words like $1 standing for values given each
+ * time it's run.  What was found is used again as long as nothing could have changed it, and only the optargs of the
+ * stages with parameters are parsed again.  Otherwise the commands are found from scratch, just as running the line
+ * with the values in it would.
+ */
+struct cli_prepared {
+  int resolved;  // Whether what was found can be used again at all
+  int mode;
+  int transient_mode;
+  int privilege;
+  unsigned long generation;
+  int num_params;
+  size_t size;  // Of the copy of the pipeline
+  struct cli_pipeline *pipeline;
+  int params[];  // For each word, the parameter it is or 0
+};
+
+// The number of the parameter 'word' is ($1 is 1), or 0 if it isn't one
+static int cli_int_param_number(const char *word) {
+  int n = 0;
+
+  if (!word || word[0] != '$' || word[1] < '1' || word[1] > '9') return 0;
+  for (word++; *word; word++) {
+    if (!isdigit((unsigned char)*word) || n > CLI_MAX_LINE_WORDS) return 0;
+    n = n * 10 + *word - '0';
+  }
+  return n;
+}
+
+// Whether 'value' is a parameter standing in for any value while a line is prepared
+static int cli_int_preparing_param(struct cli_def *cli, const char *value) {
+  return cli->pipeline && cli->pipeline->preparing && cli_int_param_number(value);
+}
+
+struct cli_prepared *cli_prepare(struct cli_def *cli, const char *command) {
+  struct cli_pipeline *pipeline;
+  struct cli_prepared *prepared = NULL;
+  int rc = CLI_ERROR, i;
+  int mode = cli->mode, transient_mode = cli->transient_mode, disallow_buildmode = cli->disallow_buildmode;
+  char *modestring = cli->modestring ? strdup(cli->modestring) : NULL;
+  unsigned long generation;
+  size_t params_size, size;
+
+  cli_int_pin(cli);
+  generation = cli_int_tree_generation();
+  if ((pipeline = cli_int_generate_pipeline(cli, command))) {
+    pipeline->preparing = 1;
+    cli->disallow_buildmode = 1;
+    rc = cli_int_validate_pipeline(cli, pipeline);
+    cli->disallow_buildmode = disallow_buildmode;
+    pipeline->preparing = 0;
+  }
+
+  if (rc == CLI_OK) {
+    params_size = CLI_ALIGN(sizeof(struct cli_prepared) + (pipeline->num_words + 1) * sizeof(int));
+    size = cli_int_copy_pipeline(pipeline, NULL);
+    if ((prepared = calloc(1, params_size + size))) {
+      // Finding the commands mustn't change the mode, a line which would needs to be found again each time it's run
+      prepared->resolved = cli->mode == mode && cli->transient_mode == transient_mode && !cli->buildmode;
+      prepared->mode = mode;
+      prepared->transient_mode = transient_mode;
+      prepared->privilege = cli->privilege;
+      prepared->generation = generation;
+      for (i = 0; i < pipeline->num_words; i++) {
+        prepared->params[i] = cli_int_param_number(pipeline->words[i]);
+        if (prepared->params[i] > prepared->num_params) prepared->num_params = prepared->params[i];
+      }
+      prepared->size = size;
+      prepared->pipeline = (struct cli_pipeline *)((char *)prepared + params_size);
+      cli_int_copy_pipeline(pipeline, (char *)prepared->pipeline);
+    }
+  }
+
+  if (cli->mode != mode) {
+    free(cli->modestring);
+    cli->modestring = modestring;
+    cli->mode = mode;
+  } else {
+    free(modestring);
+  }
+  cli->transient_mode = transient_mode;
+  cli_int_free_pipeline(cli, pipeline);
+  cli_int_unpin(cli);
+  return prepared;
+}
+
+// Find the commands for a prepared pipeline now its values are in place, using what cli_prepare() found if it can
+static int cli_int_validate_prepared(struct cli_def *cli, struct cli_prepared *prepared,
+                                     struct cli_pipeline *pipeline) {
+  int i, j, rc = CLI_OK;
+  int current = prepared->resolved && !cli->buildmode && cli->mode == prepared->mode &&
+                cli->transient_mode == prepared->transient_mode && cli->privilege == prepared->privilege;
+
+  if (current) {
+    cli_int_tree_read();
+    current = cli_tree_generation == prepared->generation;
+    cli->pipeline = pipeline;
+    for (i = 0; current && rc == CLI_OK && i < pipeline->num_stages; i++) {
+      struct cli_pipeline_stage *stage = &pipeline->stage[i];
+      int *params = prepared->params + (stage->words - pipeline->words);
+
+      for (j = 0; j < stage->num_words && !params[j]; j++)
+        ;
+      if (j == stage->num_words) continue;
+
+      pipeline->current_stage = stage;
+      stage->found_optargs = NULL;
+      stage->first_unmatched = stage->first_optarg;
+      cli_int_parse_optargs(cli, stage, stage->command, '\0', NULL);
+      stage->found_optargs = cli->found_optargs;
+      rc = stage->status;
+    }
+    cli->pipeline = NULL;
+    cli_int_tree_unlock();
+    if (current) return rc;
+  }
+
+  if (cli->buildmode && pipeline->num_stages > 1) {
+    cli_error(cli, "\nPipelines are not allowed in buildmode");
+    return CLI_ERROR;
+  }
+  for (i = 0; i < pipeline->num_stages; i++) {
+    pipeline->stage[i].command = NULL;
+    pipeline->stage[i].found_optargs = NULL;
+  }
+  return cli_int_validate_pipeline(cli, pipeline);
+}
+
+int cli_execute_prepared(struct cli_def *cli, struct cli_prepared *prepared, int argc, const char *argv[]) {
+  int rc = CLI_ERROR, i;
+  struct cli_pipeline *pipeline;
+
+  if (!prepared) return CLI_ERROR;
+  for (i = 0; i < prepared->num_params; i++) {
+    if (i >= argc || !argv[i]) {
+      cli_error(cli, "No value given for $%d", i + 1);
+      return CLI_ERROR;
+    }
+  }
+
+  cli_int_pin(cli);
+  if ((pipeline = cli_int_arena_alloc(cli, prepared->size))) {
+    cli_int_copy_pipeline(prepared->pipeline, (char *)pipeline);
+    rc = CLI_OK;
+
+    // Each value is a single word as it is, whatever is in it
+    for (i = 0; rc == CLI_OK && i < pipeline->num_words; i++) {
+      if (prepared->params[i] && !(pipeline->words[i] = cli_int_arena_strdup(cli, argv[prepared->params[i] - 1])))
+        rc = CLI_ERROR;
+    }
+    if (rc == CLI_OK) rc = cli_int_validate_prepared(cli, prepared, pipeline);
+    if (rc == CLI_OK) rc = cli_int_execute_pipeline(cli, pipeline);
+  }
+  cli_int_free_pipeline(cli, pipeline);
+  cli_int_unpin(cli);
+  return rc;
+}
+
+void cli_free_prepared(struct cli_prepared *prepared) {
+  free(prepared);
+}
+
+void cli_get_completions(struct cli_def *cli, const char *command, char lastchar, struct cli_comphelp *comphelp) {
+  struct cli_command *c = NULL;
+  struct cli_command *parent = NULL;
+
+  int i;
+  int command_type;
+  struct cli_pipeline *pipeline = NULL;
+  struct cli_pipeline_stage *stage;
+  char *delim_start = DELIM_NONE;
+  char *delim_end = DELIM_NONE;
+
+  if (!(pipeline = cli_int_generate_pipeline(cli, command))) return;
+
+  // Hold the commands still while working through them, and through the completions offered by their optargs
+  cli_int_tree_read();
+  stage = &pipeline->stage[pipeline->num_stages - 1];
+
+  // Check to see if either *no* input, or if the lastchar is a tab.
+  if ((!stage->words[0] || (command[strlen(command) - 1] == ' ')) &&
+      (!stage->num_words || stage->words[stage->num_words - 1]))
+    stage->num_words++;
 
   if (cli->buildmode)
     command_type = CLI_BUILDMODE_COMMAND;
@@ -919,62 +2376,88 @@ void cli_get_completions(struct cli_def *cli, const char *command, char lastchar
   else
     command_type = CLI_FILTER_COMMAND;
 
-  for (c = cli->commands, i = 0; c && i < stage->num_words; c = n) {
-    char *strptr = NULL;
-    char *nameptr = NULL;
-    n = c->next;
+  for (i = 0; i < stage->num_words; i++) {
+    struct cli_command **match;
+    struct cli_command **candidates = NULL;
+    size_t num_matches = cli_int_index_match(cli, parent, command_type, stage->words[i] ? stage->words[i] : "", &match);
+    size_t m, num_candidates = 0;
 
-    if (c->command_type != command_type) continue;
-    if (cli->privilege < c->privilege) continue;
-    if (c->mode != cli->mode && c->mode != MODE_ANY) continue;
-    if (stage->words[i] && strncasecmp(c->command, stage->words[i], strlen(stage->words[i]))) continue;
-
-    // Special case for 'buildmode' - skip if the argument for this command was seen, unless MULTIPLE flag is set
-    if (cli->buildmode) {
-      struct cli_optarg *optarg;
-      for (optarg = cli->buildmode->command->optargs; optarg; optarg = optarg->next) {
-        if (!strcmp(optarg->name, c->command)) break;
+    // Every completion of the last word is listed, so they're collected to be put back in the order registered
+    if (i == stage->num_words - 1 && num_matches && !(candidates = malloc(num_matches * sizeof(*candidates)))) {
+      c = NULL;
+      break;
+    }
+
+    for (c = NULL, m = 0; m < num_matches; m++) {
+      c = match[m];
+      if (cli->privilege < c->privilege) continue;
+      if (c->mode != cli->mode && c->mode != MODE_ANY) continue;
+
+      // Special case for 'buildmode' - skip if the argument for this command was seen, unless MULTIPLE flag is set
+      if (cli->buildmode) {
+        struct cli_optarg *optarg;
+        for (optarg = cli->buildmode->command->optargs; optarg; optarg = optarg->next) {
+          if (!strcmp(optarg->name, c->command)) break;
+        }
+        if (optarg && cli_find_optarg_value(cli, optarg->name, NULL) && !(optarg->flags & (CLI_CMD_OPTION_MULTIPLE)))
+          continue;
       }
-      if (optarg && cli_find_optarg_value(cli, optarg->name, NULL) && !(optarg->flags & (CLI_CMD_OPTION_MULTIPLE)))
+
+      if (candidates) {
+        candidates[num_candidates++] = c;
+        continue;
+      }
+      if (stage->words[i] && (strlen(stage->words[i]) < cli_int_unique_len(cli, parent, match + m)) &&
+          strcmp(stage->words[i], c->command))
         continue;
+      break;
     }
-    if (i < stage->num_words - 1) {
-      if (stage->words[i] && (strlen(stage->words[i]) < c->unique_len) && strcmp(stage->words[i], c->command)) continue;
 
-      n = c->children;
+    if (!candidates) {
+      if (m == num_matches) {
+        c = NULL;
+        break;
+      }
 
       // If we have no more children, we've matched the *command* - remember this
       if (!c->children) break;
 
-      i++;
+      parent = c;
       continue;
     }
 
-    if (lastchar == '?') {
-      delim_start = DELIM_NONE;
-      delim_end = DELIM_NONE;
+    c = NULL;
+    qsort(candidates, num_candidates, sizeof(*candidates), cli_int_seq_compare);
+    for (m = 0; m < num_candidates; m++) {
+      char *strptr = NULL;
+      char *nameptr = NULL;
 
-      // Note that buildmode commands need to see if that command is some optinal value
+      if (lastchar == '?') {
+        delim_start = DELIM_NONE;
+        delim_end = DELIM_NONE;
 
-      if (command_type == CLI_BUILDMODE_COMMAND) {
-        if (c->flags & (CLI_CMD_OPTIONAL_FLAG | CLI_CMD_OPTIONAL_ARGUMENT)) {
-          delim_start = DELIM_OPT_START;
-          delim_end = DELIM_OPT_END;
+        // Note that buildmode commands need to see if that command is some optinal value
+
+        if (command_type == CLI_BUILDMODE_COMMAND) {
+          if (candidates[m]->flags & (CLI_CMD_OPTIONAL_FLAG | CLI_CMD_OPTIONAL_ARGUMENT)) {
+            delim_start = DELIM_OPT_START;
+            delim_end = DELIM_OPT_END;
+          }
         }
-      }
-      if (asprintf(&nameptr, "%s%s%s", delim_start, c->command, delim_end) != -1) {
-        if (asprintf(&strptr, "  %s", nameptr) != -1) {
-          cli_int_wrap_help_line(strptr, c->help, comphelp);
-          free_z(strptr);
+        if (asprintf(&nameptr, "%s%s%s", delim_start, candidates[m]->command, delim_end) != -1) {
+          if (asprintf(&strptr, "  %s", nameptr) != -1) {
+            cli_int_wrap_help_line(cli, strptr, candidates[m]->help, comphelp);
+            free_z(strptr);
+          }
+          free(nameptr);
         }
-        free(nameptr);
+      } else {
+        cli_add_comphelp_entry(comphelp, candidates[m]->command);
       }
-    } else {
-      cli_add_comphelp_entry(comphelp, c->command);
     }
+    free(candidates);
   }
 
-out:
   if (c) {
     // Advance past first word of stage
     i++;
@@ -991,23 +2474,24 @@ out:
       cli_reprompt(cli);
     }
   }
+  cli_int_tree_unlock();
 
-  cli_int_free_pipeline(pipeline);
+  cli_int_free_pipeline(cli, pipeline);
 }
 
-static void cli_clear_line(int sockfd, char *cmd, int l, int cursor) {
+static void cli_clear_line(struct cli_def *cli, char *cmd, int l, int cursor) {
   // Use cmd as our buffer, and overwrite contents as needed.
   // Backspace to beginning
   memset((char *)cmd, '\b', cursor);
-  _write(sockfd, cmd, cursor);
+  cli_int_write(cli, cmd, cursor);
 
   // Overwrite existing cmd with spaces
   memset((char *)cmd, ' ', l);
-  _write(sockfd, cmd, l);
+  cli_int_write(cli, cmd, l);
 
   // ..and backspace again to beginning
   memset((char *)cmd, '\b', l);
-  _write(sockfd, cmd, l);
+  cli_int_write(cli, cmd, l);
 
   // Null cmd buffer
   memset((char *)cmd, 0, l);
@@ -1034,44 +2518,139 @@ void cli_regular_interval(struct cli_def *cli, int seconds) {
 
 // returns 0 on fail/error, 1 if password checks out
 static int pass_matches(const char *pass, const char *attempt) {
-  int des;
+  int des, rc;
+#ifdef __linux__
+  struct crypt_data *data = NULL;
+#endif
   if ((des = !strncasecmp(pass, DES_PREFIX, sizeof(DES_PREFIX) - 1))) pass += sizeof(DES_PREFIX) - 1;
 
 #ifndef WIN32
   // TODO(dparrish): Find a small crypt(3) function for use on windows
-  if (des || !strncmp(pass, MD5_PREFIX, sizeof(MD5_PREFIX) - 1)) attempt = crypt(attempt, pass);
+  if (des || !strncmp(pass, MD5_PREFIX, sizeof(MD5_PREFIX) - 1)) {
+#ifdef __linux__
+    // crypt() works in a static buffer, sessions on other threads may be logging in too
+    if (!(data = calloc(sizeof(struct crypt_data), 1))) return 0;
+    attempt = crypt_r(attempt, pass, data);
+#else
+    attempt = crypt(attempt, pass);
+#endif
+  }
 #endif
   if (!attempt) {
     // silent return here...
-    return 0;
+    rc = 0;
+  } else {
+    rc = !strcmp(pass, attempt);
   }
-  return !strcmp(pass, attempt);
+#ifdef __linux__
+  free(data);
+#endif
+  return rc;
 }
 
 #define CTRL(c) (c - '@')
 
-static int show_prompt(struct cli_def *cli, int sockfd) {
+static int show_prompt(struct cli_def *cli) {
   int len = 0;
 
-  if (cli->hostname) len += write(sockfd, cli->hostname, strlen(cli->hostname));
+  if (cli->hostname) len += cli_int_write(cli, cli->hostname, strlen(cli->hostname));
 
-  if (cli->modestring) len += write(sockfd, cli->modestring, strlen(cli->modestring));
+  if (cli->modestring) len += cli_int_write(cli, cli->modestring, strlen(cli->modestring));
   if (cli->buildmode) {
-    len += write(sockfd, "[", 1);
-    len += write(sockfd, cli->buildmode->cname, strlen(cli->buildmode->cname));
-    len += write(sockfd, "...", 3);
-    if (cli->buildmode->mode_text) len += write(sockfd, cli->buildmode->mode_text, strlen(cli->buildmode->mode_text));
-    len += write(sockfd, "]", 1);
+    len += cli_int_write(cli, "[", 1);
+    len += cli_int_write(cli, cli->buildmode->cname, strlen(cli->buildmode->cname));
+    len += cli_int_write(cli, "...", 3);
+    if (cli->buildmode->mode_text)
+      len += cli_int_write(cli, cli->buildmode->mode_text, strlen(cli->buildmode->mode_text));
+    len += cli_int_write(cli, "]", 1);
   }
-  return len + write(sockfd, cli->promptchar, strlen(cli->promptchar));
+  return len + cli_int_write(cli, cli->promptchar, strlen(cli->promptchar));
 }
 
-int cli_loop(struct cli_def *cli, int sockfd) {
-  int n, l, oldl = 0, is_telnet_option = 0, skip = 0, esc = 0, cursor = 0;
-  char *cmd = NULL, *oldcmd = 0;
-  char *username = NULL, *password = NULL;
+static void cli_int_session_new_line(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+
+  cli->showprompt = 1;
+  sess->in_history = 0;
+  sess->lastchar = '\0';
+  sess->in_command = 0;
+  sess->cancelled = 0;
+
+  if (sess->restore) {
+    sess->l = sess->cursor = sess->oldl;
+    sess->cmd[sess->l] = 0;
+    sess->restore = 0;
+    sess->oldl = 0;
+  } else {
+    memset(sess->cmd, 0, CLI_MAX_LINE_LENGTH);
+    sess->l = 0;
+    sess->cursor = 0;
+  }
+}
+
+static void cli_int_session_end(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+
+  if (!sess) return;
+  if (cli->stream) cli_int_stream_free(cli);
+  cli_int_flush(cli);
+  if (cli->client) fclose(cli->client);
+  cli->client = 0;
+#if defined(CLI_CLIENT_FOPENCOOKIE) || defined(CLI_CLIENT_FUNOPEN)
+  // The client stream doesn't own the socket
+  if (sess->sockfd >= 0) close(sess->sockfd);
+#endif
+
+  cli_free_history(cli);
+  free_z(sess->username);
+  free_z(sess->password);
+  free_z(sess->cmd);
+  free_z(sess->out);
+  free_z(sess->pending);
+  free_z(sess->held);
+  free_z(cli->session);
+}
+
+/*
+ * cli->client is public and applications print to it directly, so for a session it writes into the session output
+ * buffer along with everything else.  Otherwise direct writes would overtake buffered cli_print() output.
+ */
+#if defined(CLI_CLIENT_FOPENCOOKIE)
+static ssize_t cli_int_client_stream_write(void *cookie, const char *buf, size_t size) {
+  struct cli_def *cli = cookie;
+
+  if (!cli->session || cli_int_write_direct(cli, buf, size) < 0) return -1;
+  return size;
+}
+
+static FILE *cli_int_client_stream(struct cli_def *cli) {
+  cookie_io_functions_t io = {NULL, cli_int_client_stream_write, NULL, NULL};
+  return fopencookie(cli, "w", io);
+}
+#elif defined(CLI_CLIENT_FUNOPEN)
+static int cli_int_client_stream_write(void *cookie, const char *buf, int size) {
+  struct cli_def *cli = cookie;
+
+  if (!cli->session || cli_int_write_direct(cli, buf, size) < 0) return -1;
+  return size;
+}
+
+static FILE *cli_int_client_stream(struct cli_def *cli) {
+  return funopen(cli, NULL, cli_int_client_stream_write, NULL, NULL);
+}
+#endif
+
+static int cli_int_session_start(struct cli_def *cli, int sockfd) {
+  struct cli_session *sess;
+
+  if (!(sess = calloc(sizeof(struct cli_session), 1))) return CLI_ERROR;
+  if (!(sess->cmd = malloc(CLI_MAX_LINE_LENGTH))) {
+    free(sess);
+    return CLI_ERROR;
+  }
+  sess->sockfd = sockfd;
+  cli->session = sess;
 
-  cli_build_shortest(cli, cli->commands);
   cli->state = STATE_LOGIN;
 
   cli_free_history(cli);
@@ -1080,36 +2659,39 @@ int cli_loop(struct cli_def *cli, int sockfd) {
         "\xFF\xFB\x03"
         "\xFF\xFB\x01"
         "\xFF\xFD\x03"
-        "\xFF\xFD\x01";
-    _write(sockfd, negotiate, strlen(negotiate));
+        "\xFF\xFD\x01"
+        "\xFF\xFD\x1F";
+    cli_int_write(cli, negotiate, strlen(negotiate));
   }
 
-  if ((cmd = malloc(CLI_MAX_LINE_LENGTH)) == NULL) return CLI_ERROR;
-
-#ifdef WIN32
-  /*
-   * OMG, HACK
-   */
-  if (!(cli->client = fdopen(_open_osfhandle(sockfd, 0), "w+"))) return CLI_ERROR;
-  cli->client->_file = sockfd;
-#else
-  if (!(cli->client = fdopen(sockfd, "w+"))) {
-    free(cmd);
+#if defined(CLI_CLIENT_FOPENCOOKIE) || defined(CLI_CLIENT_FUNOPEN)
+  if (!(cli->client = cli_int_client_stream(cli))) {
+    sess->sockfd = -1;  // Don't close the caller's socket
+    cli_int_session_end(cli);
     return CLI_ERROR;
   }
+  setbuf(cli->client, NULL);
+#else
+  if (sockfd >= 0) {
+#ifdef WIN32
+    /*
+     * OMG, HACK
+     */
+    if (!(cli->client = fdopen(_open_osfhandle(sockfd, 0), "w+"))) {
+      cli_int_session_end(cli);
+      return CLI_ERROR;
+    }
+    cli->client->_file = sockfd;
+#else
+    if (!(cli->client = fdopen(sockfd, "w+"))) {
+      cli_int_session_end(cli);
+      return CLI_ERROR;
+    }
 #endif
 
-#ifndef LIBCLI_USE_POLL
-  /* Do a range check *early*, and punt if we were passed a file descriptor
-   * that is out of the valid range
-   */
-  if (sockfd >= FD_SETSIZE) {
-    fprintf(stderr, "CLI_LOOP() called with sockfd > FD_SETSIZE - aborting\n");
-    cli_error(cli, "CLI_LOOP() called with sockfd > FD_SETSIZE - exiting cli_loop\n");
-    return CLI_ERROR;
+    setbuf(cli->client, NULL);
   }
 #endif
-  setbuf(cli->client, NULL);
   if (cli->banner) cli_error(cli, "%s", cli->banner);
 
   // Set the last action now so we don't time immediately
@@ -1123,992 +2705,3269 @@ int cli_loop(struct cli_def *cli, int sockfd) {
   // No auth required?
   if (!cli->users && !cli->auth_callback) cli->state = STATE_NORMAL;
 
-  while (1) {
-    signed int in_history = 0;
-    unsigned char lastchar = '\0';
-    unsigned char c = '\0';
-    struct timeval tm;
+  cli_int_session_new_line(cli);
+  return CLI_OK;
+}
 
-    cli->showprompt = 1;
+// Show the prompt (and any partially entered line) if something asked for it
+static void cli_int_session_prompt(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
 
-    if (oldcmd) {
-      l = cursor = oldl;
-      oldcmd[l] = 0;
-      cli->showprompt = 1;
-      oldcmd = NULL;
-      oldl = 0;
-    } else {
-      memset(cmd, 0, CLI_MAX_LINE_LENGTH);
-      l = 0;
-      cursor = 0;
-    }
+  if (!cli->showprompt) return;
+  if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) cli_int_write(cli, "\r\n", 2);
 
-    memcpy(&tm, &cli->timeout_tm, sizeof(tm));
+  switch (cli->state) {
+    case STATE_LOGIN:
+      cli_int_write(cli, "Username: ", strlen("Username: "));
+      break;
 
-    while (1) {
-      int sr;
+    case STATE_PASSWORD:
+      cli_int_write(cli, "Password: ", strlen("Password: "));
+      break;
 
-      /*
-       * Ensure our transient mode is reset to the starting mode on *each* loop traversal transient mode is valid only
-       * while a command is being evaluated/executed.  Also explicitly set the disallow_buildmode flag based on whether
-       * or not cli->buildmode is NULL or not.  The cli->buildmode flag can be changed during process, but the
-       * enable/disable needs to be set before any processing is entered.
-       */
-      cli->transient_mode = cli->mode;
-      cli->disallow_buildmode = (cli->buildmode) ? 1 : 0;
+    case STATE_NORMAL:
+    case STATE_ENABLE:
+      show_prompt(cli);
+      cli_int_write(cli, sess->cmd, sess->l);
+      cli_int_write_repeat(cli, '\b', sess->l - sess->cursor);
+      break;
 
-      if (cli->showprompt) {
-        if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) _write(sockfd, "\r\n", 2);
+    case STATE_ENABLE_PASSWORD:
+      cli_int_write(cli, "Password: ", strlen("Password: "));
+      break;
+  }
 
-        switch (cli->state) {
-          case STATE_LOGIN:
-            _write(sockfd, "Username: ", strlen("Username: "));
-            break;
+  cli->showprompt = 0;
 
-          case STATE_PASSWORD:
-            _write(sockfd, "Password: ", strlen("Password: "));
-            break;
+  // The prompt means the last command has finished, send its output now
+  cli_int_flush(cli);
+}
 
-          case STATE_NORMAL:
-          case STATE_ENABLE:
-            show_prompt(cli, sockfd);
-            _write(sockfd, cmd, l);
-            if (cursor < l) {
-              int n = l - cursor;
-              while (n--) _write(sockfd, "\b", 1);
-            }
-            break;
+/*
+ * Run the regular callback if it is due, returns CLI_QUIT if the session should be closed.  Not while a command is
+ * still running (streaming its output or stopped at --More--), as anything the callback prints would land in the
+ * middle of the command's output without going through its filters.
+ */
+static int cli_int_session_regular(struct cli_def *cli) {
+  if (cli->session && cli->session->in_command) return CLI_OK;
+  if (cli->regular_callback) {
+    if (time(NULL) - cli->last_regular >= cli->timeout_tm.tv_sec) {
+      if (cli->regular_callback(cli) != CLI_OK) return CLI_QUIT;
+      time(&cli->last_regular);
+    }
+  }
+  return CLI_OK;
+}
 
-          case STATE_ENABLE_PASSWORD:
-            _write(sockfd, "Password: ", strlen("Password: "));
-            break;
+/*
+ * Check for an idle session, returns CLI_QUIT if the session should be closed.  A session still running a command
+ * isn't idle however long it takes, the clock starts again when the command finishes.
+ */
+static int cli_int_session_idle(struct cli_def *cli) {
+  if (cli->session && cli->session->in_command) return CLI_OK;
+  if (cli->idle_timeout) {
+    if (time(NULL) - cli->last_action >= cli->idle_timeout) {
+      if (cli->idle_timeout_callback) {
+        // Call the callback and continue on if successful
+        if (cli->idle_timeout_callback(cli) == CLI_OK) {
+          // Reset the idle timeout counter
+          time(&cli->last_action);
+          return CLI_OK;
         }
-
-        cli->showprompt = 0;
       }
+      // Otherwise, close the session
+      return CLI_QUIT;
+    }
+  }
+  return CLI_OK;
+}
 
-      if (cli->regular_callback) {
-        if (time(NULL) - cli->last_regular >= cli->timeout_tm.tv_sec) {
-          if (cli->regular_callback(cli) != CLI_OK) {
-            l = -1;
-            break;
-          }
-          time(&cli->last_regular);
-        }
-      }
+// A complete line has been entered, act on it based on the session state
+static int cli_int_session_line(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+  char *cmd = sess->cmd;
+  int l = sess->l;
 
-      if ((sr = cli_socket_wait(sockfd, &tm)) < 0) {
-        if (errno == EINTR) continue;
-        perror(CLI_SOCKET_WAIT_PERROR);
-        l = -1;
-        break;
-      }
+  if (cli->state == STATE_LOGIN) {
+    if (l == 0) goto new_line;
 
-      if (sr == 0) {
-        if (cli->idle_timeout) {
-          if (time(NULL) - cli->last_action >= cli->idle_timeout) {
-            if (cli->idle_timeout_callback) {
-              // Call the callback and continue on if successful
-              if (cli->idle_timeout_callback(cli) == CLI_OK) {
-                // Reset the idle timeout counter
-                time(&cli->last_action);
-                continue;
-              }
-            }
-            // Otherwise, break out of the main loop
-            l = -1;
-            break;
-          }
-        }
+    // Require login
+    free_z(sess->username);
+    if (!(sess->username = strdup(cmd))) return CLI_QUIT;
+    cli->state = STATE_PASSWORD;
+    cli->showprompt = 1;
+  } else if (cli->state == STATE_PASSWORD) {
+    // Require password
+    int allowed = 0;
+
+    free_z(sess->password);
+    if (!(sess->password = strdup(cmd))) return CLI_QUIT;
+    if (cli->auth_callback) {
+      if (cli->auth_callback(sess->username, sess->password) == CLI_OK) allowed++;
+    }
 
-        memcpy(&tm, &cli->timeout_tm, sizeof(tm));
-        continue;
+    if (!allowed) {
+      struct unp *u;
+      for (u = cli->users; u; u = u->next) {
+        if (!strcmp(u->username, sess->username) && pass_matches(u->password, sess->password)) {
+          allowed++;
+          break;
+        }
       }
+    }
 
-      if ((n = read(sockfd, &c, 1)) < 0) {
-        if (errno == EINTR) continue;
+    if (allowed) {
+      cli_error(cli, " ");
+      cli->state = STATE_NORMAL;
+    } else {
+      cli_error(cli, "\n\nAccess denied");
+      free_z(sess->username);
+      free_z(sess->password);
+      cli->state = STATE_LOGIN;
+    }
 
-        perror("read");
-        l = -1;
-        break;
-      }
+    cli->showprompt = 1;
+  } else if (cli->state == STATE_ENABLE_PASSWORD) {
+    int allowed = 0;
+    if (cli->enable_password) {
+      // Check stored static enable password
+      if (pass_matches(cli->enable_password, cmd)) allowed++;
+    }
 
-      if (cli->idle_timeout) time(&cli->last_action);
+    if (!allowed && cli->enable_callback) {
+      // Check callback
+      if (cli->enable_callback(cmd)) allowed++;
+    }
 
-      if (n == 0) {
-        l = -1;
+    if (allowed) {
+      cli->state = STATE_ENABLE;
+      cli_set_privilege(cli, PRIVILEGE_PRIVILEGED);
+    } else {
+      cli_error(cli, "\n\nAccess denied");
+      cli->state = STATE_NORMAL;
+    }
+  } else {
+    int rc;
+    if (l == 0) goto new_line;
+    if (cmd[l - 1] != '?' && strcasecmp(cmd, "history") != 0) cli_add_history(cli, cmd);
+
+    sess->in_command = 1;
+    sess->cancelled = 0;
+    sess->page_rows = 0;
+    rc = cli_run_command(cli, cmd);
+    switch (rc) {
+      case CLI_BUILDMODE_ERROR:
+        // Unable to enter buildmode successfully
+        cli_print(cli, "Failure entering build mode for '%s'", cli->buildmode->cname);
+        cli_int_free_buildmode(cli);
+        goto new_line;
+      case CLI_BUILDMODE_CANCEL:
+        // Called if user enters 'cancel'
+        cli_print(cli, "Canceling build mode for '%s'", cli->buildmode->cname);
+        cli_int_free_buildmode(cli);
         break;
-      }
-
-      if (skip) {
-        skip--;
-        continue;
-      }
-
-      if (c == 255 && !is_telnet_option) {
-        is_telnet_option++;
-        continue;
-      }
+      case CLI_BUILDMODE_EXIT:
+        // Called when user enters exit - rebuild *entire* command line.
+        // Recall all located optargs
+        cli->found_optargs = cli->buildmode->found_optargs;
+        rc = cli_int_execute_buildmode(cli);
+        break;
+      case CLI_QUIT:
+        break;
+      case CLI_BUILDMODE_START:
+      case CLI_BUILDMODE_EXTEND:
+      default:
+        break;
+    }
 
-      if (is_telnet_option) {
-        if (c >= 251 && c <= 254) {
-          is_telnet_option = c;
-          continue;
-        }
+    // Process is done if we get a CLI_QUIT,
+    if (rc == CLI_QUIT) return CLI_QUIT;
 
-        if (c != 255) {
-          is_telnet_option = 0;
-          continue;
-        }
+    if (cli->stream || sess->more) {
+      // The rest waits for the command to finish its output, see cli_int_session_pump()
+      if (sess->async) return CLI_OK;
 
-        is_telnet_option = 0;
+      while (cli->stream) {
+        cli_int_stream_run(cli);
+        cli_int_flush(cli);
       }
+    }
+  }
 
-      // Handle ANSI arrows
-      if (esc) {
-        if (esc == '[') {
-          // Remap to readline control codes
-          switch (c) {
-            case 'A':  // Up
-              c = CTRL('P');
-              break;
-
-            case 'B':  // Down
-              c = CTRL('N');
-              break;
-
-            case 'C':  // Right
-              c = CTRL('F');
-              break;
-
-            case 'D':  // Left
-              c = CTRL('B');
-              break;
-
-            default:
-              c = 0;
-          }
+  // Update the last_action time now as the last command run could take a long time to return
+  if (cli->idle_timeout) time(&cli->last_action);
 
-          esc = 0;
-        } else {
-          esc = (c == '[') ? c : 0;
-          continue;
-        }
-      }
+new_line:
+  cli_int_session_new_line(cli);
+  return CLI_OK;
+}
 
-      if (c == 0) continue;
-      if (c == '\n') continue;
+// Answer the client's option negotiation, refusing any option which hasn't been asked for
+static void cli_int_telnet_option(struct cli_def *cli, unsigned char verb, unsigned char option) {
+  unsigned char reply[3] = {TELNET_IAC, 0, 0};
 
-      if (c == '\r') {
-        if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) _write(sockfd, "\r\n", 2);
-        break;
-      }
+  if (!cli->telnet_protocol) return;
+  if (verb == TELNET_DO && option != TELOPT_ECHO && option != TELOPT_SGA)
+    reply[1] = TELNET_WONT;
+  else if (verb == TELNET_WILL && option != TELOPT_ECHO && option != TELOPT_SGA && option != TELOPT_NAWS)
+    reply[1] = TELNET_DONT;
+  else
+    return;  // Agreeing to something asked for, or a refusal, neither of which is answered
+  reply[2] = option;
+  cli_int_write(cli, reply, sizeof(reply));
+}
 
-      if (c == 27) {
-        esc = 1;
-        continue;
-      }
+// Act on a complete subnegotiation, only the window size (RFC 1073) is used
+static void cli_int_telnet_subnegotiation(struct cli_def *cli) {
+  struct cli_telnet *t = &cli->session->telnet;
 
-      if (c == CTRL('C')) {
-        _write(sockfd, "\a", 1);
-        continue;
-      }
+  if (t->sb_len == 5 && t->sb[0] == TELOPT_NAWS) {
+    if (t->sb[1] || t->sb[2]) cli->term_width = t->sb[1] << 8 | t->sb[2];
+    if (t->sb[3] || t->sb[4]) cli->term_height = t->sb[3] << 8 | t->sb[4];
+  }
+}
 
-      // Back word, backspace/delete
-      if (c == CTRL('W') || c == CTRL('H') || c == 0x7f) {
-        int back = 0;
+/*
+ * Take the telnet commands out of 'len' bytes of input as it is read, before anything else looks at it.  The data is
+ * written to 'out', which may be the same as 'in', and its length returned.  Interrupt process and break become
+ * Ctrl-C.  Runs of data between commands are moved in one go, so input without an IAC in it is hardly touched.
+ */
+static size_t cli_int_telnet_input(struct cli_def *cli, const unsigned char *in, size_t len, unsigned char *out) {
+  struct cli_telnet *t = &cli->session->telnet;
+  const unsigned char *end = in + len;
+  unsigned char *o = out;
+
+  while (in < end) {
+    unsigned char c;
+
+    if (t->state == TELNET_STATE_DATA) {
+      const unsigned char *iac = memchr(in, TELNET_IAC, end - in);
+      size_t n = (iac ? iac : end) - in;
+
+      if (o != in) memmove(o, in, n);
+      o += n;
+      in += n;
+      if (!iac) break;
+      in++;
+      t->state = TELNET_STATE_IAC;
+      continue;
+    }
 
-        if (c == CTRL('W')) {
-          // Word
-          int nc = cursor;
+    c = *in++;
+    switch (t->state) {
+      case TELNET_STATE_IAC:
+        t->state = TELNET_STATE_DATA;
+        if (c == TELNET_IAC) {
+          *o++ = c;
+        } else if (c == TELNET_IP || c == TELNET_BRK) {
+          *o++ = CTRL('C');
+        } else if (c == TELNET_SB) {
+          t->state = TELNET_STATE_SB;
+          t->sb_len = 0;
+        } else if (c >= TELNET_WILL && c <= TELNET_DONT) {
+          t->state = TELNET_STATE_OPTION;
+          t->verb = c;
+        }
+        // Anything else (NOP, GA, AYT...) is ignored
+        break;
 
-          if (l == 0 || cursor == 0) continue;
+      case TELNET_STATE_OPTION:
+        t->state = TELNET_STATE_DATA;
+        cli_int_telnet_option(cli, t->verb, c);
+        break;
 
-          while (nc && cmd[nc - 1] == ' ') {
-            nc--;
-            back++;
-          }
+      case TELNET_STATE_SB:
+        if (c == TELNET_IAC)
+          t->state = TELNET_STATE_SB_IAC;
+        else if (t->sb_len < sizeof(t->sb))
+          t->sb[t->sb_len++] = c;
+        break;
 
-          while (nc && cmd[nc - 1] != ' ') {
-            nc--;
-            back++;
-          }
+      case TELNET_STATE_SB_IAC:
+        if (c == TELNET_IAC) {
+          t->state = TELNET_STATE_SB;
+          if (t->sb_len < sizeof(t->sb)) t->sb[t->sb_len++] = c;
+        } else if (c == TELNET_SE) {
+          t->state = TELNET_STATE_DATA;
+          cli_int_telnet_subnegotiation(cli);
         } else {
-          // Char
-          if (l == 0 || cursor == 0) {
-            _write(sockfd, "\a", 1);
-            continue;
-          }
-
-          back = 1;
+          // The subnegotiation was never finished, treat this as any other command
+          t->state = TELNET_STATE_IAC;
+          in--;
         }
+        break;
+    }
+  }
+  return o - out;
+}
 
-        if (back) {
-          while (back--) {
-            if (l == cursor) {
-              cmd[--cursor] = 0;
-              if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) _write(sockfd, "\b \b", 3);
-            } else {
-              int i;
-              if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
-                // Back up one space, then write current buffer followed by a space
-                _write(sockfd, "\b", 1);
-                _write(sockfd, cmd + cursor, l - cursor);
-                _write(sockfd, " ", 1);
-
-                // Move everything one char left
-                memmove(cmd + cursor - 1, cmd + cursor, l - cursor);
-
-                // Set former last char to null
-                cmd[l - 1] = 0;
-
-                // And reposition cursor
-                for (i = l; i >= cursor; i--) _write(sockfd, "\b", 1);
-              }
-              cursor--;
-            }
-            l--;
-          }
+/*
+ * Feed a single byte of input into the session's line editor.  Completed lines are acted upon immediately.
+ * Returns CLI_OK to keep going, or CLI_QUIT when the session is finished.
+ */
+static int cli_int_session_input(struct cli_def *cli, unsigned char c) {
+  struct cli_session *sess = cli->session;
+  char *cmd = sess->cmd;
 
-          continue;
-        }
-      }
+  /*
+   * Ensure our transient mode is reset to the starting mode on *each* loop traversal transient mode is valid only
+   * while a command is being evaluated/executed.  Also explicitly set the disallow_buildmode flag based on whether
+   * or not cli->buildmode is NULL or not.  The cli->buildmode flag can be changed during process, but the
+   * enable/disable needs to be set before any processing is entered.
+   */
+  cli->transient_mode = cli->mode;
+  cli->disallow_buildmode = (cli->buildmode) ? 1 : 0;
+
+  if (sess->more) {
+    cli_int_pager_key(cli, c);
+    return CLI_OK;
+  }
 
-      // Redraw
-      if (c == CTRL('L')) {
-        int i;
-        int cursorback = l - cursor;
+  // Handle ANSI arrows
+  if (sess->esc) {
+    if (sess->esc == '[') {
+      // Remap to readline control codes
+      switch (c) {
+        case 'A':  // Up
+          c = CTRL('P');
+          break;
 
-        if (cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD) continue;
+        case 'B':  // Down
+          c = CTRL('N');
+          break;
 
-        _write(sockfd, "\r\n", 2);
-        show_prompt(cli, sockfd);
-        _write(sockfd, cmd, l);
+        case 'C':  // Right
+          c = CTRL('F');
+          break;
 
-        for (i = 0; i < cursorback; i++) _write(sockfd, "\b", 1);
+        case 'D':  // Left
+          c = CTRL('B');
+          break;
 
-        continue;
+        default:
+          c = 0;
       }
 
-      // Clear line
-      if (c == CTRL('U')) {
-        if (cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD)
-          memset(cmd, 0, l);
-        else
-          cli_clear_line(sockfd, cmd, l, cursor);
+      sess->esc = 0;
+    } else {
+      sess->esc = (c == '[') ? c : 0;
+      return CLI_OK;
+    }
+  }
 
-        l = cursor = 0;
-        continue;
-      }
+  if (c == 0) return CLI_OK;
+  if (c == '\n') return CLI_OK;
 
-      // Kill to EOL
-      if (c == CTRL('K')) {
-        if (cursor == l) continue;
+  if (c == '\r') {
+    if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) cli_int_write(cli, "\r\n", 2);
+    return cli_int_session_line(cli);
+  }
 
-        if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
-          int cptr;
-          for (cptr = cursor; cptr < l; cptr++) _write(sockfd, " ", 1);
+  if (c == 27) {
+    sess->esc = 1;
+    return CLI_OK;
+  }
 
-          for (cptr = cursor; cptr < l; cptr++) _write(sockfd, "\b", 1);
-        }
+  if (c == CTRL('C')) {
+    cli_int_write(cli, "\a", 1);
+    return CLI_OK;
+  }
 
-        memset(cmd + cursor, 0, l - cursor);
-        l = cursor;
-        continue;
-      }
+  // Back word, backspace/delete
+  if (c == CTRL('W') || c == CTRL('H') || c == 0x7f) {
+    int back = 0;
 
-      // EOT
-      if (c == CTRL('D')) {
-        if (cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD) break;
+    if (c == CTRL('W')) {
+      // Word
+      int nc = sess->cursor;
 
-        if (l) continue;
+      if (sess->l == 0 || sess->cursor == 0) return CLI_OK;
 
-        l = -1;
-        break;
+      while (nc && cmd[nc - 1] == ' ') {
+        nc--;
+        back++;
       }
 
-      // Disable
-      if (c == CTRL('Z')) {
-        if (cli->mode != MODE_EXEC) {
-          if (cli->buildmode) cli_int_free_buildmode(cli);
-          cli_clear_line(sockfd, cmd, l, cursor);
-          cli_set_configmode(cli, MODE_EXEC, NULL);
-          l = cursor = 0;
-          cli->showprompt = 1;
-        }
-
-        continue;
+      while (nc && cmd[nc - 1] != ' ') {
+        nc--;
+        back++;
+      }
+    } else {
+      // Char
+      if (sess->l == 0 || sess->cursor == 0) {
+        cli_int_write(cli, "\a", 1);
+        return CLI_OK;
       }
 
-      // TAB completion
-      if (c == CTRL('I')) {
-        struct cli_comphelp comphelp = {0};
-
-        if (cli->state == STATE_LOGIN || cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD) continue;
-        if (cursor != l) continue;
-
-        cli_get_completions(cli, cmd, c, &comphelp);
-        if (comphelp.num_entries == 0) {
-          _write(sockfd, "\a", 1);
-        } else if (lastchar == CTRL('I')) {
-          // Double tab
-          int i;
-          for (i = 0; i < comphelp.num_entries; i++) {
-            if (i % 4 == 0)
-              _write(sockfd, "\r\n", 2);
-            else
-              _write(sockfd, " ", 1);
-            _write(sockfd, comphelp.entries[i], strlen(comphelp.entries[i]));
-          }
-          _write(sockfd, "\r\n", 2);
-          cli->showprompt = 1;
-        } else if (comphelp.num_entries == 1) {
-          // Single completion - show *unless* the optional/required 'prefix' is present
-          if (comphelp.entries[0][0] != '[' && comphelp.entries[0][0] != '<') {
-            for (; l > 0; l--, cursor--) {
-              if (cmd[l - 1] == ' ' || cmd[l - 1] == '|' || (comphelp.comma_separated && cmd[l - 1] == ',')) break;
-              _write(sockfd, "\b", 1);
-            }
-            strcpy((cmd + l), comphelp.entries[0]);
-            l += strlen(comphelp.entries[0]);
-            cmd[l++] = ' ';
-            cursor = l;
-            _write(sockfd, comphelp.entries[0], strlen(comphelp.entries[0]));
-            _write(sockfd, " ", 1);
-            // And now forget the tab, since we just found a single match
-            lastchar = '\0';
-          } else {
-            // Yes, we had a match, but it wasn't required - remember the tab in case the user double tabs....
-            lastchar = CTRL('I');
-          }
-        } else if (comphelp.num_entries > 1) {
-          /*
-           * More than one completion.
-           * Show as many characters as we can until the completions start to differ.
-           */
-          lastchar = c;
-          int i, j, k = 0;
-          char *tptr = comphelp.entries[0];
-
-          /*
-           * Quickly try to see where our entries differ.
-           * Corner cases:
-           * - If all entries are optional, don't show *any* options unless user has provided a letter.
-           * - If any entry starts with '<' then don't fill in anything.
-           */
-
-          // Skip a leading '['
-          k = strlen(tptr);
-          if (*tptr == '[')
-            tptr++;
-          else if (*tptr == '<')
-            k = 0;
-
-          for (i = 1; k != 0 && i < comphelp.num_entries; i++) {
-            char *wptr = comphelp.entries[i];
-
-            if (*wptr == '[')
-              wptr++;
-            else if (*wptr == '<')
-              k = 0;
-
-            for (j = 0; (j < k) && (j < (int)strlen(wptr)); j++) {
-              if (strncmp(tptr + j, wptr + j, 1)) break;
-            }
-            k = j;
-          }
+      back = 1;
+    }
 
-          // Try to show minimum match string if we have a non-zero k and the first letter of the last word is not '['.
-          if (k && comphelp.entries[comphelp.num_entries - 1][0] != '[') {
-            for (; l > 0; l--, cursor--) {
-              if (cmd[l - 1] == ' ' || cmd[l - 1] == '|' || (comphelp.comma_separated && cmd[l - 1] == ',')) break;
-              _write(sockfd, "\b", 1);
-            }
-            strncpy(cmd + l, tptr, k);
-            l += k;
-            cursor = l;
-            _write(sockfd, tptr, k);
+    if (back) {
+      while (back--) {
+        if (sess->l == sess->cursor) {
+          cmd[--sess->cursor] = 0;
+          if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) cli_int_write(cli, "\b \b", 3);
+        } else {
+          if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
+            // Back up one space, then write current buffer followed by a space
+            cli_int_write(cli, "\b", 1);
+            cli_int_write(cli, cmd + sess->cursor, sess->l - sess->cursor);
+            cli_int_write(cli, " ", 1);
+
+            // Move everything one char left
+            memmove(cmd + sess->cursor - 1, cmd + sess->cursor, sess->l - sess->cursor);
 
-          } else {
-            _write(sockfd, "\a", 1);
+            // Set former last char to null
+            cmd[sess->l - 1] = 0;
+
+            // And reposition cursor
+            cli_int_write_repeat(cli, '\b', sess->l - sess->cursor + 1);
           }
+          sess->cursor--;
         }
-        cli_free_comphelp(&comphelp);
-        continue;
+        sess->l--;
       }
 
-      // '?' at end of line - generate applicable 'help' messages
-      if (c == '?' && cursor == l) {
-        struct cli_comphelp comphelp = {0};
-        int i;
-        int show_cr = 1;
-
-        if (cli->state == STATE_LOGIN || cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD) continue;
-        if (cursor != l) continue;
-
-        cli_get_completions(cli, cmd, c, &comphelp);
-        if (comphelp.num_entries == 0) {
-          _write(sockfd, "\a", 1);
-        } else if (comphelp.num_entries > 0) {
-          cli->showprompt = 1;
-          _write(sockfd, "\r\n", 2);
-          for (i = 0; i < (int)comphelp.num_entries; i++) {
-            if (comphelp.entries[i][2] != '[') show_cr = 0;
-            cli_error(cli, "%s", comphelp.entries[i]);
-          }
-          if (show_cr) cli_error(cli, "  <cr>");
-        }
+      return CLI_OK;
+    }
+  }
 
-        cli_free_comphelp(&comphelp);
+  // Redraw
+  if (c == CTRL('L')) {
+    int cursorback = sess->l - sess->cursor;
 
-        if (comphelp.num_entries >= 0) continue;
-      }
+    if (cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD) return CLI_OK;
 
-      // History
-      if (c == CTRL('P') || c == CTRL('N')) {
-        int history_found = 0;
-
-        if (cli->state == STATE_LOGIN || cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD) continue;
-
-        if (c == CTRL('P')) {
-          // Up
-          in_history--;
-          if (in_history < 0) {
-            for (in_history = MAX_HISTORY - 1; in_history >= 0; in_history--) {
-              if (cli->history[in_history]) {
-                history_found = 1;
-                break;
-              }
-            }
-          } else {
-            if (cli->history[in_history]) history_found = 1;
-          }
-        } else {
-          // Down
-          in_history++;
-          if (in_history >= MAX_HISTORY || !cli->history[in_history]) {
-            int i = 0;
-            for (i = 0; i < MAX_HISTORY; i++) {
-              if (cli->history[i]) {
-                in_history = i;
-                history_found = 1;
-                break;
-              }
-            }
-          } else {
-            if (cli->history[in_history]) history_found = 1;
-          }
-        }
-        if (history_found && cli->history[in_history]) {
-          // Show history item
-          cli_clear_line(sockfd, cmd, l, cursor);
-          memset(cmd, 0, CLI_MAX_LINE_LENGTH);
-          strncpy(cmd, cli->history[in_history], CLI_MAX_LINE_LENGTH - 1);
-          l = cursor = strlen(cmd);
-          _write(sockfd, cmd, l);
-        }
+    cli_int_write(cli, "\r\n", 2);
+    show_prompt(cli);
+    cli_int_write(cli, cmd, sess->l);
 
-        continue;
-      }
+    cli_int_write_repeat(cli, '\b', cursorback);
 
-      // Left/right cursor motion
-      if (c == CTRL('B') || c == CTRL('F')) {
-        if (c == CTRL('B')) {
-          // Left
-          if (cursor) {
-            if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) _write(sockfd, "\b", 1);
+    return CLI_OK;
+  }
 
-            cursor--;
-          }
-        } else {
-          // Right
-          if (cursor < l) {
-            if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) _write(sockfd, &cmd[cursor], 1);
+  // Clear line
+  if (c == CTRL('U')) {
+    if (cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD)
+      memset(cmd, 0, sess->l);
+    else
+      cli_clear_line(cli, cmd, sess->l, sess->cursor);
 
-            cursor++;
-          }
-        }
+    sess->l = sess->cursor = 0;
+    return CLI_OK;
+  }
 
-        continue;
-      }
+  // Kill to EOL
+  if (c == CTRL('K')) {
+    if (sess->cursor == sess->l) return CLI_OK;
 
-      if (c == CTRL('A')) {
-        // Start of line
-        if (cursor) {
-          if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
-            _write(sockfd, "\r", 1);
-            show_prompt(cli, sockfd);
-          }
+    if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
+      cli_int_write_repeat(cli, ' ', sess->l - sess->cursor);
+      cli_int_write_repeat(cli, '\b', sess->l - sess->cursor);
+    }
 
-          cursor = 0;
-        }
+    memset(cmd + sess->cursor, 0, sess->l - sess->cursor);
+    sess->l = sess->cursor;
+    return CLI_OK;
+  }
 
-        continue;
-      }
+  // EOT
+  if (c == CTRL('D')) {
+    if (cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD) return cli_int_session_line(cli);
 
-      if (c == CTRL('E')) {
-        // End of line
-        if (cursor < l) {
-          if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD)
-            _write(sockfd, &cmd[cursor], l - cursor);
+    if (sess->l) return CLI_OK;
 
-          cursor = l;
-        }
+    return CLI_QUIT;
+  }
 
-        continue;
-      }
+  // Disable
+  if (c == CTRL('Z')) {
+    if (cli->mode != MODE_EXEC) {
+      if (cli->buildmode) cli_int_free_buildmode(cli);
+      cli_clear_line(cli, cmd, sess->l, sess->cursor);
+      cli_set_configmode(cli, MODE_EXEC, NULL);
+      sess->l = sess->cursor = 0;
+      cli->showprompt = 1;
+    }
 
-      if (cursor == l) {
-        // Normal character typed.
-        // Append to end of line if not at end-of-buffer.
-        if (l < CLI_MAX_LINE_LENGTH - 1) {
-          cmd[cursor] = c;
-          l++;
-          cursor++;
-        } else {
-          // End-of-buffer, ensure null terminated
-          cmd[cursor] = 0;
-          _write(sockfd, "\a", 1);
-          continue;
+    return CLI_OK;
+  }
+
+  // TAB completion
+  if (c == CTRL('I')) {
+    struct cli_comphelp comphelp = {0};
+
+    if (cli->state == STATE_LOGIN || cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD)
+      return CLI_OK;
+    if (sess->cursor != sess->l) return CLI_OK;
+
+    cli_get_completions(cli, cmd, c, &comphelp);
+    if (comphelp.num_entries == 0) {
+      cli_int_write(cli, "\a", 1);
+    } else if (sess->lastchar == CTRL('I')) {
+      // Double tab
+      int i;
+      for (i = 0; i < comphelp.num_entries; i++) {
+        if (i % 4 == 0)
+          cli_int_write(cli, "\r\n", 2);
+        else
+          cli_int_write(cli, " ", 1);
+        cli_int_write(cli, comphelp.entries[i], strlen(comphelp.entries[i]));
+      }
+      cli_int_write(cli, "\r\n", 2);
+      cli->showprompt = 1;
+    } else if (comphelp.num_entries == 1) {
+      // Single completion - show *unless* the optional/required 'prefix' is present
+      if (comphelp.entries[0][0] != '[' && comphelp.entries[0][0] != '<') {
+        for (; sess->l > 0; sess->l--, sess->cursor--) {
+          if (cmd[sess->l - 1] == ' ' || cmd[sess->l - 1] == '|' ||
+              (comphelp.comma_separated && cmd[sess->l - 1] == ','))
+            break;
+          cli_int_write(cli, "\b", 1);
         }
+        strcpy((cmd + sess->l), comphelp.entries[0]);
+        sess->l += strlen(comphelp.entries[0]);
+        cmd[sess->l++] = ' ';
+        sess->cursor = sess->l;
+        cli_int_write(cli, comphelp.entries[0], strlen(comphelp.entries[0]));
+        cli_int_write(cli, " ", 1);
+        // And now forget the tab, since we just found a single match
+        sess->lastchar = '\0';
       } else {
-        // Middle of text
-        int i;
-        // Move everything one character to the right
-        memmove(cmd + cursor + 1, cmd + cursor, l - cursor);
+        // Yes, we had a match, but it wasn't required - remember the tab in case the user double tabs....
+        sess->lastchar = CTRL('I');
+      }
+    } else if (comphelp.num_entries > 1) {
+      /*
+       * More than one completion.
+       * Show as many characters as we can until the completions start to differ.
+       */
+      sess->lastchar = c;
+      int i, j, k = 0;
+      char *tptr = comphelp.entries[0];
 
-        // Insert new character
-        cmd[cursor] = c;
+      /*
+       * Quickly try to see where our entries differ.
+       * Corner cases:
+       * - If all entries are optional, don't show *any* options unless user has provided a letter.
+       * - If any entry starts with '<' then don't fill in anything.
+       */
 
-        // IMPORTANT - if at end of buffer, set last char to NULL and don't change length, otherwise bump length by 1
-        if (l == CLI_MAX_LINE_LENGTH - 1) {
-          cmd[l] = 0;
-        } else {
-          l++;
-        }
+      // Skip a leading '['
+      k = strlen(tptr);
+      if (*tptr == '[')
+        tptr++;
+      else if (*tptr == '<')
+        k = 0;
 
-        // Write buffer, then backspace to where we were
-        _write(sockfd, cmd + cursor, l - cursor);
+      for (i = 1; k != 0 && i < comphelp.num_entries; i++) {
+        char *wptr = comphelp.entries[i];
 
-        for (i = 0; i < (l - cursor); i++) _write(sockfd, "\b", 1);
-        cursor++;
-      }
+        if (*wptr == '[')
+          wptr++;
+        else if (*wptr == '<')
+          k = 0;
 
-      if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
-        if (c == '?' && cursor == l) {
-          _write(sockfd, "\r\n", 2);
-          oldcmd = cmd;
-          oldl = cursor = l - 1;
-          break;
+        for (j = 0; (j < k) && (j < (int)strlen(wptr)); j++) {
+          if (strncmp(tptr + j, wptr + j, 1)) break;
         }
-        _write(sockfd, &c, 1);
+        k = j;
       }
 
-      oldcmd = 0;
-      oldl = 0;
-      lastchar = c;
+      // Try to show minimum match string if we have a non-zero k and the first letter of the last word is not '['.
+      if (k && comphelp.entries[comphelp.num_entries - 1][0] != '[') {
+        for (; sess->l > 0; sess->l--, sess->cursor--) {
+          if (cmd[sess->l - 1] == ' ' || cmd[sess->l - 1] == '|' ||
+              (comphelp.comma_separated && cmd[sess->l - 1] == ','))
+            break;
+          cli_int_write(cli, "\b", 1);
+        }
+        strncpy(cmd + sess->l, tptr, k);
+        sess->l += k;
+        sess->cursor = sess->l;
+        cli_int_write(cli, tptr, k);
+
+      } else {
+        cli_int_write(cli, "\a", 1);
+      }
     }
+    cli_free_comphelp(&comphelp);
+    return CLI_OK;
+  }
 
-    if (l < 0) break;
+  // '?' at end of line - generate applicable 'help' messages
+  if (c == '?' && sess->cursor == sess->l) {
+    struct cli_comphelp comphelp = {0};
+    int i;
+    int show_cr = 1;
 
-    if (cli->state == STATE_LOGIN) {
-      if (l == 0) continue;
+    if (cli->state == STATE_LOGIN || cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD)
+      return CLI_OK;
+    if (sess->cursor != sess->l) return CLI_OK;
 
-      // Require login
-      free_z(username);
-      if (!(username = strdup(cmd))) return 0;
-      cli->state = STATE_PASSWORD;
+    cli_get_completions(cli, cmd, c, &comphelp);
+    if (comphelp.num_entries == 0) {
+      cli_int_write(cli, "\a", 1);
+    } else if (comphelp.num_entries > 0) {
       cli->showprompt = 1;
-    } else if (cli->state == STATE_PASSWORD) {
-      // Require password
-      int allowed = 0;
-
-      free_z(password);
-      if (!(password = strdup(cmd))) return 0;
-      if (cli->auth_callback) {
-        if (cli->auth_callback(username, password) == CLI_OK) allowed++;
+      cli_int_write(cli, "\r\n", 2);
+      for (i = 0; i < (int)comphelp.num_entries; i++) {
+        if (comphelp.entries[i][2] != '[') show_cr = 0;
+        cli_error(cli, "%s", comphelp.entries[i]);
       }
+      if (show_cr) cli_error(cli, "  <cr>");
+    }
+
+    cli_free_comphelp(&comphelp);
+
+    if (comphelp.num_entries >= 0) return CLI_OK;
+  }
+
+  // History
+  if (c == CTRL('P') || c == CTRL('N')) {
+    int history_found = 0;
 
-      if (!allowed) {
-        struct unp *u;
-        for (u = cli->users; u; u = u->next) {
-          if (!strcmp(u->username, username) && pass_matches(u->password, password)) {
-            allowed++;
+    if (cli->state == STATE_LOGIN || cli->state == STATE_PASSWORD || cli->state == STATE_ENABLE_PASSWORD)
+      return CLI_OK;
+
+    if (c == CTRL('P')) {
+      // Up
+      sess->in_history--;
+      if (sess->in_history < 0) {
+        for (sess->in_history = MAX_HISTORY - 1; sess->in_history >= 0; sess->in_history--) {
+          if (cli->history[sess->in_history]) {
+            history_found = 1;
             break;
           }
         }
+      } else {
+        if (cli->history[sess->in_history]) history_found = 1;
       }
-
-      if (allowed) {
-        cli_error(cli, " ");
-        cli->state = STATE_NORMAL;
+    } else {
+      // Down
+      sess->in_history++;
+      if (sess->in_history >= MAX_HISTORY || !cli->history[sess->in_history]) {
+        int i = 0;
+        for (i = 0; i < MAX_HISTORY; i++) {
+          if (cli->history[i]) {
+            sess->in_history = i;
+            history_found = 1;
+            break;
+          }
+        }
       } else {
-        cli_error(cli, "\n\nAccess denied");
-        free_z(username);
-        free_z(password);
-        cli->state = STATE_LOGIN;
+        if (cli->history[sess->in_history]) history_found = 1;
       }
+    }
+    if (history_found && cli->history[sess->in_history]) {
+      // Show history item
+      cli_clear_line(cli, cmd, sess->l, sess->cursor);
+      memset(cmd, 0, CLI_MAX_LINE_LENGTH);
+      strncpy(cmd, cli->history[sess->in_history], CLI_MAX_LINE_LENGTH - 1);
+      sess->l = sess->cursor = strlen(cmd);
+      cli_int_write(cli, cmd, sess->l);
+    }
 
-      cli->showprompt = 1;
-    } else if (cli->state == STATE_ENABLE_PASSWORD) {
-      int allowed = 0;
-      if (cli->enable_password) {
-        // Check stored static enable password
-        if (pass_matches(cli->enable_password, cmd)) allowed++;
-      }
+    return CLI_OK;
+  }
 
-      if (!allowed && cli->enable_callback) {
-        // Check callback
-        if (cli->enable_callback(cmd)) allowed++;
-      }
+  // Left/right cursor motion
+  if (c == CTRL('B') || c == CTRL('F')) {
+    if (c == CTRL('B')) {
+      // Left
+      if (sess->cursor) {
+        if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) cli_int_write(cli, "\b", 1);
 
-      if (allowed) {
-        cli->state = STATE_ENABLE;
-        cli_set_privilege(cli, PRIVILEGE_PRIVILEGED);
-      } else {
-        cli_error(cli, "\n\nAccess denied");
-        cli->state = STATE_NORMAL;
+        sess->cursor--;
       }
     } else {
-      int rc;
-      if (l == 0) continue;
-      if (cmd[l - 1] != '?' && strcasecmp(cmd, "history") != 0) cli_add_history(cli, cmd);
-
-      rc = cli_run_command(cli, cmd);
-      switch (rc) {
-        case CLI_BUILDMODE_ERROR:
-          // Unable to enter buildmode successfully
-          cli_print(cli, "Failure entering build mode for '%s'", cli->buildmode->cname);
-          cli_int_free_buildmode(cli);
-          continue;
-        case CLI_BUILDMODE_CANCEL:
-          // Called if user enters 'cancel'
-          cli_print(cli, "Canceling build mode for '%s'", cli->buildmode->cname);
-          cli_int_free_buildmode(cli);
-          break;
-        case CLI_BUILDMODE_EXIT:
-          // Called when user enters exit - rebuild *entire* command line.
-          // Recall all located optargs
-          cli->found_optargs = cli->buildmode->found_optargs;
-          rc = cli_int_execute_buildmode(cli);
-          break;
-        case CLI_QUIT:
-          break;
-        case CLI_BUILDMODE_START:
-        case CLI_BUILDMODE_EXTEND:
-        default:
-          break;
-      }
+      // Right
+      if (sess->cursor < sess->l) {
+        if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD)
+          cli_int_write(cli, &cmd[sess->cursor], 1);
 
-      // Process is done if we get a CLI_QUIT,
-      if (rc == CLI_QUIT) break;
+        sess->cursor++;
+      }
     }
 
-    // Update the last_action time now as the last command run could take a long time to return
-    if (cli->idle_timeout) time(&cli->last_action);
+    return CLI_OK;
   }
 
-  cli_free_history(cli);
-  free_z(username);
-  free_z(password);
-  free_z(cmd);
+  if (c == CTRL('A')) {
+    // Start of line
+    if (sess->cursor) {
+      if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
+        cli_int_write(cli, "\r", 1);
+        show_prompt(cli);
+      }
 
-  fclose(cli->client);
-  cli->client = 0;
-  return CLI_OK;
-}
+      sess->cursor = 0;
+    }
 
-int cli_file(struct cli_def *cli, FILE *fh, int privilege, int mode) {
-  int oldpriv = cli_set_privilege(cli, privilege);
-  int oldmode = cli_set_configmode(cli, mode, NULL);
-  char buf[CLI_MAX_LINE_LENGTH];
+    return CLI_OK;
+  }
 
-  while (1) {
-    char *p;
-    char *cmd;
-    char *end;
+  if (c == CTRL('E')) {
+    // End of line
+    if (sess->cursor < sess->l) {
+      if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD)
+        cli_int_write(cli, &cmd[sess->cursor], sess->l - sess->cursor);
 
-    // End of file
-    if (fgets(buf, CLI_MAX_LINE_LENGTH - 1, fh) == NULL) break;
+      sess->cursor = sess->l;
+    }
 
-    if ((p = strpbrk(buf, "#\r\n"))) *p = 0;
+    return CLI_OK;
+  }
 
-    cmd = buf;
-    while (isspace(*cmd)) cmd++;
+  if (sess->cursor == sess->l) {
+    // Normal character typed.
+    // Append to end of line if not at end-of-buffer.
+    if (sess->l < CLI_MAX_LINE_LENGTH - 1) {
+      cmd[sess->cursor] = c;
+      sess->l++;
+      sess->cursor++;
+    } else {
+      // End-of-buffer, ensure null terminated
+      cmd[sess->cursor] = 0;
+      cli_int_write(cli, "\a", 1);
+      return CLI_OK;
+    }
+  } else {
+    // Middle of text
+    // Move everything one character to the right
+    memmove(cmd + sess->cursor + 1, cmd + sess->cursor, sess->l - sess->cursor);
+
+    // Insert new character
+    cmd[sess->cursor] = c;
+
+    // IMPORTANT - if at end of buffer, set last char to NULL and don't change length, otherwise bump length by 1
+    if (sess->l == CLI_MAX_LINE_LENGTH - 1) {
+      cmd[sess->l] = 0;
+    } else {
+      sess->l++;
+    }
+
+    // Write buffer, then backspace to where we were
+    cli_int_write(cli, cmd + sess->cursor, sess->l - sess->cursor);
+
+    cli_int_write_repeat(cli, '\b', sess->l - sess->cursor);
+    sess->cursor++;
+  }
+
+  if (cli->state != STATE_PASSWORD && cli->state != STATE_ENABLE_PASSWORD) {
+    if (c == '?' && sess->cursor == sess->l) {
+      cli_int_write(cli, "\r\n", 2);
+      sess->restore = 1;
+      sess->oldl = sess->cursor = sess->l - 1;
+      return cli_int_session_line(cli);
+    }
+    cli_int_write(cli, &c, 1);
+  }
+
+  sess->lastchar = c;
+  return CLI_OK;
+}
+
+// Make room for 'count' more bytes of pending input, returns a pointer to where they should go
+static unsigned char *cli_int_session_pending_reserve(struct cli_def *cli, size_t count) {
+  struct cli_session *sess = cli->session;
+
+  if (sess->pending_len + count > sess->pending_size) {
+    size_t size = sess->pending_len + count;
+    unsigned char *pending = realloc(sess->pending, size);
+
+    if (!pending) return NULL;
+    sess->pending = pending;
+    sess->pending_size = size;
+  }
+  return sess->pending + sess->pending_len;
+}
+
+/*
+ * Add 'count' bytes written after the end of the pending input.  An interrupt (Ctrl-C, which telnet IP and BRK have
+ * been turned into) cancels the running command, and any input typed ahead of it and output not sent yet are thrown
+ * away.
+ */
+static void cli_int_session_pending_add(struct cli_def *cli, size_t count) {
+  struct cli_session *sess = cli->session;
+  unsigned char *p = sess->pending + sess->pending_len;
+  unsigned char *intr;
+  size_t end = 0;
+
+  sess->pending_len += count;
+  while ((intr = memchr(p, CTRL('C'), sess->pending + sess->pending_len - p))) {
+    p = intr + 1;
+    end = p - sess->pending;
+  }
+  if (!end) return;
+
+  if (sess->sockfd >= 0) sess->out_len = sess->retry_len = 0;
+  if (sess->more) cli_int_pager_clear(cli);
+  sess->cancelled = 1;
+  sess->held_len = 0;
+  memmove(sess->pending, sess->pending + end, sess->pending_len - end);
+  sess->pending_len -= end;
+}
+
+// Move input which arrived along with the command line being run to the pending input
+static void cli_int_session_take_rest(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+  unsigned char *p;
+
+  if (!sess->feed_rest) return;
+  if ((p = cli_int_session_pending_reserve(cli, sess->feed_rest_len))) {
+    memcpy(p, sess->feed_rest, sess->feed_rest_len);
+    cli_int_session_pending_add(cli, sess->feed_rest_len);
+  }
+  sess->feed_rest = NULL;
+}
+
+// Read any input waiting while a command is running, without blocking
+static void cli_int_session_poll_input(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+  unsigned char *p;
+  ssize_t n;
+
+  // Input which arrived along with the command line comes first
+  cli_int_session_take_rest(cli);
+
+  if (sess->sockfd < 0 || sess->cancelled) return;
+  gettimeofday(&sess->last_poll, NULL);
+  if (!(p = cli_int_session_pending_reserve(cli, CLI_READ_BUFFER_SIZE))) return;
+
+#ifdef MSG_DONTWAIT
+  n = recv(sess->sockfd, p, CLI_READ_BUFFER_SIZE, MSG_DONTWAIT);
+#else
+  {
+    struct timeval tm = {0, 0};
+    if (cli_socket_wait(sess->sockfd, &tm) <= 0) return;
+    n = read(sess->sockfd, p, CLI_READ_BUFFER_SIZE);
+  }
+#endif
+
+  // Errors and end of file are left for the session to find when the command has finished
+  if (n > 0) cli_int_session_pending_add(cli, cli_int_telnet_input(cli, p, n, p));
+}
+
+int cli_is_cancelled(struct cli_def *cli) {
+  struct cli_session *sess;
+  struct timeval now;
+
+  if (!cli || !(sess = cli->session)) return 0;
+
+  // Callbacks may ask for every line they print, so don't go looking for input more than every 50ms
+  if (sess->in_command && !sess->cancelled) {
+    gettimeofday(&now, NULL);
+    if ((now.tv_sec - sess->last_poll.tv_sec) * 1000000 + (now.tv_usec - sess->last_poll.tv_usec) >= 50000)
+      cli_int_session_poll_input(cli);
+  }
+  return sess->cancelled;
+}
+
+/*
+ * Run a buffer of input through the line editor, returns CLI_QUIT as soon as the session should be closed.  Whatever
+ * is left once a command has been run is kept as pending input, see cli_int_session_feed_pending().
+ */
+static int cli_int_session_feed_input(struct cli_def *cli, const unsigned char *bytes, size_t len) {
+  size_t i;
+
+  if (cli->idle_timeout) time(&cli->last_action);
+
+  for (i = 0; i < len; i++) {
+    if (cli->session->in_command && !cli->session->more) {
+      // A command is still running, keep the rest of the input until it has finished
+      unsigned char *p = cli_int_session_pending_reserve(cli, len - i);
+
+      if (p) {
+        memcpy(p, bytes + i, len - i);
+        cli_int_session_pending_add(cli, len - i);
+      }
+      break;
+    }
+
+    cli->session->feed_rest = bytes + i + 1;
+    cli->session->feed_rest_len = len - i - 1;
+    if (cli_int_session_input(cli, bytes[i]) != CLI_OK) {
+      cli->session->feed_rest = NULL;
+      cli_int_flush(cli);
+      return CLI_QUIT;
+    }
+    cli_int_session_prompt(cli);
+
+    // A command which ran has moved the rest of the input to the pending buffer while looking for an interrupt
+    if (!cli->session->feed_rest) break;
+    cli->session->feed_rest = NULL;
+  }
+
+  // Everything echoed or redrawn for this input goes out in a single write
+  cli_int_flush(cli);
+  return CLI_OK;
+}
+
+static int cli_int_session_feed(struct cli_def *cli, const unsigned char *bytes, size_t len) {
+  if (cli_int_session_feed_input(cli, bytes, len) != CLI_OK) return CLI_QUIT;
+  return cli_int_session_feed_pending(cli);
+}
+
+/*
+ * Process input which arrived while a command was running, once it has finished.  Each command run from it puts the
+ * rest back as pending input, so this carries on until there's none left or a command is still running.
+ */
+static int cli_int_session_feed_pending(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+
+  while (sess->pending_len && !sess->in_command) {
+    unsigned char *pending = sess->pending;
+    size_t pending_len = sess->pending_len;
+    int rc;
+
+    sess->pending = NULL;
+    sess->pending_len = sess->pending_size = 0;
+    rc = cli_int_session_feed_input(cli, pending, pending_len);
+    free(pending);
+    if (rc != CLI_OK) return CLI_QUIT;
+  }
+  return CLI_OK;
+}
+
+static int cli_int_term_width(struct cli_def *cli) {
+  return cli->term_width > 0 ? cli->term_width : 80;
+}
+
+static int cli_int_term_height(struct cli_def *cli) {
+  return cli->term_height > 1 ? cli->term_height : 24;
+}
+
+// Keep output which didn't fit on the screen until the user asks for more
+static void cli_int_pager_keep(struct cli_def *cli, const char *buf, size_t len) {
+  struct cli_session *sess = cli->session;
+
+  if (sess->held_len + len > sess->held_size) {
+    size_t size = sess->held_size ? sess->held_size : 256;
+    char *held;
+
+    while (size < sess->held_len + len) size *= 2;
+    if (!(held = realloc(sess->held, size))) return;
+    sess->held = held;
+    sess->held_size = size;
+  }
+  memcpy(sess->held + sess->held_len, buf, len);
+  sess->held_len += len;
+}
+
+// Keep a line of output which didn't fit on the screen, see cli_int_pager_key()
+static void cli_int_pager_hold(struct cli_def *cli, const char *line, size_t len) {
+  cli_int_pager_keep(cli, line, len);
+  cli_int_pager_keep(cli, "\n", 1);
+}
+
+// Take --More-- off the screen
+static void cli_int_pager_clear(struct cli_def *cli) {
+  cli_int_write(cli, "\r" CLI_MORE_BLANK "\r", strlen(CLI_MORE_PROMPT) + 2);
+  cli->session->more = 0;
+}
+
+// Use input which is waiting as answers to --More--
+static void cli_int_pager_pending(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+  size_t i = 0;
+
+  while (sess->more && i < sess->pending_len) cli_int_pager_key(cli, sess->pending[i++]);
+  if (!i) return;
+  memmove(sess->pending, sess->pending + i, sess->pending_len - i);
+  sess->pending_len -= i;
+}
+
+// Block until the user answers --More--, for sessions which aren't driven by an event loop
+static void cli_int_pager_wait(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+
+  cli_int_flush(cli);
+  cli_int_session_take_rest(cli);
+  while (sess->more) {
+    unsigned char *p;
+    ssize_t n = 0;
+
+    cli_int_pager_pending(cli);
+    if (!sess->more) break;
+
+    if ((p = cli_int_session_pending_reserve(cli, CLI_READ_BUFFER_SIZE)))
+      n = read(sess->sockfd, p, CLI_READ_BUFFER_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      // The client has gone, the session will notice once the command has finished
+      sess->more = 0;
+      sess->cancelled = 1;
+      break;
+    }
+
+    // An interrupt cancels the command and clears --More--
+    cli_int_session_pending_add(cli, cli_int_telnet_input(cli, p, n, p));
+  }
+}
+
+// Act on a key pressed at --More--: space shows the next page, enter the next line and q stops the command
+static void cli_int_pager_key(struct cli_def *cli, unsigned char c) {
+  struct cli_session *sess = cli->session;
+  char *held = sess->held;
+  size_t held_len = sess->held_len;
+  char *p;
+
+  switch (c) {
+    case ' ':
+      sess->page_rows = 0;
+      break;
+
+    case '\r':
+      sess->page_rows = cli_int_term_height(cli) - 2;
+      break;
+
+    case 'q':
+    case 'Q':
+    case CTRL('C'):
+      cli_int_pager_clear(cli);
+      sess->cancelled = 1;
+      sess->held_len = 0;
+      return;
+
+    default:
+      return;
+  }
+
+  // Show what was held back, which may fill the screen again
+  cli_int_pager_clear(cli);
+  sess->held = NULL;
+  sess->held_len = sess->held_size = 0;
+  for (p = held; held_len;) {
+    char *next = memchr(p, '\n', held_len);
+
+    // Direct output which didn't end in a line break
+    if (!next) {
+      cli_int_write_direct(cli, p, held_len);
+      break;
+    }
+    *next = 0;
+    cli_int_page_line(cli, p, next - p);
+    held_len -= next + 1 - p;
+    p = next + 1;
+  }
+  free(held);
+}
+
+// Send a line of command output to the client, stopping at --More-- when the screen is full
+static void cli_int_page_line(struct cli_def *cli, const char *line, size_t len) {
+  struct cli_session *sess = cli->session;
+  size_t width = cli_int_term_width(cli);
+  int rows = len ? (len + width - 1) / width : 1;
+
+  if (!sess->more && sess->page_rows && sess->page_rows + rows >= cli_int_term_height(cli)) {
+    cli_int_write(cli, CLI_MORE_PROMPT, strlen(CLI_MORE_PROMPT));
+    sess->more = 1;
+    if (!sess->async) cli_int_pager_wait(cli);
+  }
+
+  if (sess->cancelled) return;
+  if (sess->more) {
+    cli_int_pager_hold(cli, line, len);
+    return;
+  }
+  cli_int_write_line(cli, line, len);
+  sess->page_rows += rows;
+}
+
+static size_t cli_int_high_water(struct cli_def *cli) {
+  return cli->output_high_water ? cli->output_high_water : CLI_OUTPUT_HIGH_WATER;
+}
+
+/*
+ * Let a command which is streaming its output produce some more of it if there's room, or which is waiting at --More--
+ * carry on if the user has pressed a key.  Once it's finished the line is completed as it would have been for any
+ * other command and input which arrived in the meantime is processed.
+ */
+static int cli_int_session_pump(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+
+  while (sess->in_command) {
+    if (sess->more) cli_int_pager_pending(cli);
+    if (cli->stream && !sess->more && sess->out_len < cli_int_high_water(cli)) cli_int_stream_run(cli);
+    if (cli->stream || sess->more) return CLI_OK;
+
+    if (cli->idle_timeout) time(&cli->last_action);
+    cli_int_session_new_line(cli);
+    cli_int_session_prompt(cli);
+
+    // Input which came in meanwhile may start another command, which is pumped in turn
+    if (cli_int_session_feed_pending(cli) != CLI_OK) return CLI_QUIT;
+  }
+  return CLI_OK;
+}
+
+// Read whatever input is waiting on the session socket and process it
+static int cli_int_session_read(struct cli_def *cli) {
+  struct cli_session *sess = cli->session;
+  ssize_t n;
+
+  if ((n = read(sess->sockfd, sess->in, sizeof(sess->in))) < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return CLI_OK;
+    perror("read");
+    return CLI_ERROR;
+  }
+
+  if (n == 0) return CLI_QUIT;
+  n = cli_int_telnet_input(cli, sess->in, n, sess->in);
+  if (cli_int_session_feed(cli, sess->in, n) != CLI_OK) return CLI_QUIT;
+  return cli_int_session_pump(cli);
+}
+
+// The client can take more output
+static int cli_int_session_writable(struct cli_def *cli) {
+  int rc;
+
+  cli_int_flush(cli);
+  rc = cli_int_session_pump(cli);
+  cli_int_flush(cli);
+  return rc;
+}
+
+int cli_session_start(struct cli_def *cli, int sockfd) {
+  if (!cli || cli->session) return CLI_ERROR;
+  if (cli_int_session_start(cli, sockfd) != CLI_OK) return CLI_ERROR;
+  cli->session->async = 1;
+  cli_int_session_prompt(cli);
+  cli_int_flush(cli);
+  return CLI_OK;
+}
+
+int cli_session_feed(struct cli_def *cli, const char *bytes, size_t len) {
+  struct cli_session *sess;
+
+  if (!cli || !(sess = cli->session)) return CLI_ERROR;
+
+  // The caller's bytes are left alone, telnet commands are taken out of a copy
+  while (len) {
+    size_t n = len < sizeof(sess->in) ? len : sizeof(sess->in);
+
+    memcpy(sess->in, bytes, n);
+    bytes += n;
+    len -= n;
+    if (cli_int_session_feed(cli, sess->in, cli_int_telnet_input(cli, sess->in, n, sess->in)) != CLI_OK)
+      return CLI_QUIT;
+  }
+  return cli_int_session_writable(cli);
+}
+
+int cli_session_writable(struct cli_def *cli) {
+  if (!cli || !cli->session) return CLI_ERROR;
+  return cli_int_session_writable(cli);
+}
+
+int cli_session_tick(struct cli_def *cli) {
+  if (!cli || !cli->session) return CLI_ERROR;
+  if (cli_int_session_regular(cli) != CLI_OK || cli_int_session_idle(cli) != CLI_OK) return CLI_QUIT;
+  cli_int_session_prompt(cli);
+  cli_int_flush(cli);
+  return CLI_OK;
+}
+
+const char *cli_session_output(struct cli_def *cli, size_t *len) {
+  if (!cli || !cli->session || !cli->session->out_len) {
+    if (len) *len = 0;
+    return NULL;
+  }
+  if (len) *len = cli->session->out_len;
+  return cli->session->out;
+}
+
+int cli_session_consume_output(struct cli_def *cli, size_t len) {
+  struct cli_session *sess;
+
+  if (!cli || !(sess = cli->session)) return CLI_ERROR;
+  if (len >= sess->out_len) {
+    sess->out_len = 0;
+  } else {
+    memmove(sess->out, sess->out + len, sess->out_len - len);
+    sess->out_len -= len;
+  }
+
+  // There's room for a streaming command to carry on
+  return cli_int_session_pump(cli);
+}
+
+void cli_session_end(struct cli_def *cli) {
+  if (cli) cli_int_session_end(cli);
+}
+
+int cli_loop(struct cli_def *cli, int sockfd) {
+#ifndef LIBCLI_USE_POLL
+  /* Do a range check *early*, and punt if we were passed a file descriptor
+   * that is out of the valid range
+   */
+  if (sockfd >= FD_SETSIZE) {
+    static const char *toobig = "CLI_LOOP() called with sockfd > FD_SETSIZE - exiting cli_loop\r\n";
+    fprintf(stderr, "CLI_LOOP() called with sockfd > FD_SETSIZE - aborting\n");
+    _write(sockfd, toobig, strlen(toobig));
+    return CLI_ERROR;
+  }
+#endif
+
+  if (cli_int_session_start(cli, sockfd) != CLI_OK) return CLI_ERROR;
+
+  while (1) {
+    struct timeval tm;
+    int sr;
+
+    cli_int_session_prompt(cli);
+    if (cli_int_session_regular(cli) != CLI_OK) break;
+    cli_int_flush(cli);
+
+    memcpy(&tm, &cli->timeout_tm, sizeof(tm));
+    if ((sr = cli_socket_wait(sockfd, &tm)) < 0) {
+      if (errno == EINTR) continue;
+      perror(CLI_SOCKET_WAIT_PERROR);
+      break;
+    }
+
+    if (sr == 0) {
+      if (cli_int_session_idle(cli) != CLI_OK) break;
+      continue;
+    }
+
+    if (cli_int_session_read(cli) != CLI_OK) break;
+  }
+
+  cli_int_session_end(cli);
+  return CLI_OK;
+}
+
+#ifndef WIN32
+/*
+ * Event driven server.  Rather than dedicating a thread or process to every cli_loop(), a single cli_server watches
+ * any number of sessions (and optionally listening sockets) and feeds input into each session's line editor as it
+ * arrives.  epoll is used where available, otherwise poll().
+ *
+ * With cli_server_set_threads() the sessions are run on a pool of worker threads instead.  cli_server_run() still
+ * waits for events, but hands each session with something to do to the pool and stops watching it until a worker
+ * hands it back through the 'wake' pipe, so no session is ever on two threads at once.  Sessions only ever touch their
+ * own cli_def, the commands they share are looked after by the tree lock.
+ */
+#define CLI_SERVER_MAX_EVENTS 64
+
+struct cli_server_conn {
+  int fd;
+  int dead;
+  int want_write;  // Waiting for the socket to take more output
+  struct cli_def *cli;  // NULL for a listening socket
+  struct cli_def *(*session_init)(struct cli_server *server, int sockfd);
+  struct cli_server_conn *next;
+  int busy;                           // Handed to a worker thread, which owns everything below until it's back
+  int readable;                       // What the worker is to do
+  int writable;
+  int rc;                             // What the worker got back from the session
+  struct cli_server_conn *work_next;  // In the queue or the finished list
+};
+
+struct cli_server {
+  int epfd;
+  struct cli_server_conn *conns;
+  time_t last_sweep;
+  int threads;
+  pthread_t *workers;  // While cli_server_run() has the threads running
+  int running;
+  pthread_mutex_t lock;  // Guards the queue, finished and stopping
+  pthread_cond_t work;
+  struct cli_server_conn *queue, *queue_tail;
+  struct cli_server_conn *finished;
+  int stopping;
+  int wake[2];                   // Workers write to this when they finish with a session
+  struct cli_server_conn waker;  // Watches the other end of wake
+};
+
+struct cli_server *cli_server_init(void) {
+  struct cli_server *server;
+
+  if (!(server = calloc(sizeof(struct cli_server), 1))) return NULL;
+#ifdef CLI_SERVER_USE_EPOLL
+  if ((server->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    free(server);
+    return NULL;
+  }
+#else
+  server->epfd = -1;
+#endif
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->work, NULL);
+  server->wake[0] = server->wake[1] = -1;
+  return server;
+}
+
+int cli_server_set_threads(struct cli_server *server, int threads) {
+  if (!server || threads < 0 || server->workers) return CLI_ERROR;
+  server->threads = threads;
+  return CLI_OK;
+}
+
+static int cli_int_server_add_conn(struct cli_server *server, struct cli_server_conn *conn) {
+#ifdef CLI_SERVER_USE_EPOLL
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  // A session's events are taken one at a time when workers are running it, see cli_int_server_update()
+  ev.events = EPOLLIN | (conn->cli && server->threads ? EPOLLONESHOT : 0);
+  ev.data.ptr = conn;
+  if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) return CLI_ERROR;
+#endif
+  conn->next = server->conns;
+  server->conns = conn;
+  return CLI_OK;
+}
+
+// Shut down a session; the conn itself is released by cli_int_server_reap()
+static void cli_int_server_close(struct cli_server *server, struct cli_server_conn *conn) {
+  if (conn->dead) return;
+  conn->dead = 1;
+#ifdef CLI_SERVER_USE_EPOLL
+  epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+#endif
+  if (conn->cli) {
+    // Closes the socket as well
+    cli_int_session_end(conn->cli);
+    cli_done(conn->cli);
+    conn->cli = NULL;
+  } else {
+    close(conn->fd);
+  }
+}
+
+/*
+ * Watch for the socket becoming writable while a session has output it couldn't send yet.  With worker threads epoll
+ * stops reporting a session after each event, so it's watched again whether or not anything has changed.
+ */
+static void cli_int_server_update(struct cli_server *server, struct cli_server_conn *conn) {
+  int want_write;
+
+  if (conn->dead || !conn->cli) return;
+  want_write = conn->cli->session->out_len || conn->cli->stream;
+  if (want_write == conn->want_write && !server->threads) return;
+  conn->want_write = want_write;
+#ifdef CLI_SERVER_USE_EPOLL
+  {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0) | (server->threads ? EPOLLONESHOT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+  }
+#endif
+}
+
+static void cli_int_server_reap(struct cli_server *server) {
+  struct cli_server_conn **p = &server->conns, *conn;
+
+  while ((conn = *p)) {
+    if (conn->dead) {
+      *p = conn->next;
+      free(conn);
+    } else {
+      p = &conn->next;
+    }
+  }
+}
+
+int cli_server_add_session(struct cli_server *server, struct cli_def *cli, int sockfd) {
+  struct cli_server_conn *conn;
+  int flags;
+
+  if (!server || !cli) return CLI_ERROR;
+  if (sockfd < 0) return CLI_ERROR;
+  if (!(conn = calloc(sizeof(struct cli_server_conn), 1))) return CLI_ERROR;
+  conn->fd = sockfd;
+  conn->cli = cli;
+
+  if (cli_int_server_add_conn(server, conn) != CLI_OK) {
+    free(conn);
+    return CLI_ERROR;
+  }
+
+  // A slow client must not hold up every other session
+  flags = fcntl(sockfd, F_GETFL);
+  fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+  if (cli_int_session_start(cli, sockfd) != CLI_OK) {
+    // Leave the socket open for the caller as it was, just forget about it
+    fcntl(sockfd, F_SETFL, flags);
+#ifdef CLI_SERVER_USE_EPOLL
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, sockfd, NULL);
+#endif
+    conn->cli = NULL;
+    conn->dead = 1;
+    cli_int_server_reap(server);
+    return CLI_ERROR;
+  }
+
+  cli->session->async = 1;
+  cli_int_session_prompt(cli);
+  cli_int_flush(cli);
+  cli_int_server_update(server, conn);
+  return CLI_OK;
+}
+
+int cli_server_add_listener(struct cli_server *server, int sockfd,
+                            struct cli_def *(*session_init)(struct cli_server *server, int sockfd)) {
+  struct cli_server_conn *conn;
+
+  if (!server || !session_init) return CLI_ERROR;
+  if (!(conn = calloc(sizeof(struct cli_server_conn), 1))) return CLI_ERROR;
+  conn->fd = sockfd;
+  conn->session_init = session_init;
+
+  if (cli_int_server_add_conn(server, conn) != CLI_OK) {
+    free(conn);
+    return CLI_ERROR;
+  }
+  return CLI_OK;
+}
+
+static void cli_int_server_accept(struct cli_server *server, struct cli_server_conn *listener) {
+  struct cli_def *cli;
+  int fd;
+
+  if ((fd = accept(listener->fd, NULL, 0)) < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+    return;
+  }
+
+  if (!(cli = listener->session_init(server, fd))) {
+    close(fd);
+    return;
+  }
+
+  if (cli_server_add_session(server, cli, fd) != CLI_OK) {
+    cli_done(cli);
+    close(fd);
+  }
+}
+
+static void cli_int_server_readable(struct cli_server *server, struct cli_server_conn *conn) {
+  if (conn->dead) return;
+  if (!conn->cli) {
+    cli_int_server_accept(server, conn);
+    return;
+  }
+
+  if (cli_int_session_read(conn->cli) != CLI_OK) {
+    cli_int_server_close(server, conn);
+    return;
+  }
+  cli_int_server_update(server, conn);
+}
+
+static void cli_int_server_writable(struct cli_server *server, struct cli_server_conn *conn) {
+  if (conn->dead || !conn->cli) return;
+  if (cli_int_session_writable(conn->cli) != CLI_OK) {
+    cli_int_server_close(server, conn);
+    return;
+  }
+  cli_int_server_update(server, conn);
+}
+
+// Run regular callbacks and idle timeouts for every session, at most once a second
+static void cli_int_server_sweep(struct cli_server *server) {
+  struct cli_server_conn *conn;
+  time_t now = time(NULL);
+
+  if (now == server->last_sweep) return;
+  server->last_sweep = now;
+
+  for (conn = server->conns; conn; conn = conn->next) {
+    if (conn->dead || !conn->cli || conn->busy) continue;
+    if (cli_int_session_regular(conn->cli) != CLI_OK || cli_int_session_idle(conn->cli) != CLI_OK) {
+      cli_int_server_close(server, conn);
+      continue;
+    }
+    cli_int_session_prompt(conn->cli);
+    cli_int_flush(conn->cli);
+    cli_int_server_update(server, conn);
+  }
+}
+
+// A worker thread, running sessions from the queue until the server stops
+static void *cli_int_server_worker(void *arg) {
+  struct cli_server *server = arg;
+  struct cli_server_conn *conn;
+
+  pthread_mutex_lock(&server->lock);
+  while (1) {
+    while (!server->queue && !server->stopping) pthread_cond_wait(&server->work, &server->lock);
+    if (!(conn = server->queue)) break;
+    if (!(server->queue = conn->work_next)) server->queue_tail = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    conn->rc = CLI_OK;
+    if (conn->readable) conn->rc = cli_int_session_read(conn->cli);
+    if (conn->rc == CLI_OK && conn->writable) conn->rc = cli_int_session_writable(conn->cli);
+
+    pthread_mutex_lock(&server->lock);
+    conn->work_next = server->finished;
+    server->finished = conn;
+    // Anything already on the list has woken cli_server_run() and not been collected yet
+    if (!conn->work_next) _write(server->wake[1], "", 1);
+  }
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
+
+// Hand a session with something to do to the worker threads
+static void cli_int_server_queue(struct cli_server *server, struct cli_server_conn *conn, int readable, int writable) {
+  conn->busy = 1;
+  conn->readable = readable;
+  conn->writable = writable;
+  conn->work_next = NULL;
+
+  pthread_mutex_lock(&server->lock);
+  if (server->queue_tail)
+    server->queue_tail->work_next = conn;
+  else
+    server->queue = conn;
+  server->queue_tail = conn;
+  pthread_cond_signal(&server->work);
+  pthread_mutex_unlock(&server->lock);
+}
+
+// Take back the sessions the workers have finished with
+static void cli_int_server_collect(struct cli_server *server) {
+  struct cli_server_conn *conn, *next;
+  char buf[64];
+
+  while (read(server->wake[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&server->lock);
+  conn = server->finished;
+  server->finished = NULL;
+  pthread_mutex_unlock(&server->lock);
+
+  for (; conn; conn = next) {
+    next = conn->work_next;
+    conn->busy = 0;
+    if (conn->rc != CLI_OK)
+      cli_int_server_close(server, conn);
+    else
+      cli_int_server_update(server, conn);
+  }
+}
+
+static void cli_int_server_stop_workers(struct cli_server *server) {
+  int i;
+
+  pthread_mutex_lock(&server->lock);
+  server->stopping = 1;
+  pthread_cond_broadcast(&server->work);
+  pthread_mutex_unlock(&server->lock);
+  for (i = 0; i < server->running; i++) pthread_join(server->workers[i], NULL);
+  free_z(server->workers);
+  server->running = 0;
+
+  // Whatever they were in the middle of is handed back as usual
+  cli_int_server_collect(server);
+#ifdef CLI_SERVER_USE_EPOLL
+  epoll_ctl(server->epfd, EPOLL_CTL_DEL, server->wake[0], NULL);
+#endif
+  for (i = 0; i < 2; i++) {
+    close(server->wake[i]);
+    server->wake[i] = -1;
+  }
+}
+
+static int cli_int_server_start_workers(struct cli_server *server) {
+  struct cli_server_conn *conn;
+  int i;
+
+  if (pipe(server->wake) < 0) return CLI_ERROR;
+  for (i = 0; i < 2; i++) {
+    fcntl(server->wake[i], F_SETFL, fcntl(server->wake[i], F_GETFL) | O_NONBLOCK);
+    fcntl(server->wake[i], F_SETFD, FD_CLOEXEC);
+  }
+  server->waker.fd = server->wake[0];
+#ifdef CLI_SERVER_USE_EPOLL
+  {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server->waker;
+    epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->wake[0], &ev);
+  }
+#endif
+
+  server->stopping = 0;
+  if (!(server->workers = calloc(server->threads, sizeof(pthread_t)))) {
+    cli_int_server_stop_workers(server);
+    return CLI_ERROR;
+  }
+  for (; server->running < server->threads; server->running++) {
+    if (pthread_create(&server->workers[server->running], NULL, cli_int_server_worker, server)) {
+      cli_int_server_stop_workers(server);
+      return CLI_ERROR;
+    }
+  }
+
+  // Sessions added before there were workers have been watched for every event, not one at a time
+  for (conn = server->conns; conn; conn = conn->next) cli_int_server_update(server, conn);
+  return CLI_OK;
+}
+
+// Something happened on one of the server's sockets
+static void cli_int_server_event(struct cli_server *server, struct cli_server_conn *conn, int readable, int writable) {
+  if (conn == &server->waker) {
+    cli_int_server_collect(server);
+  } else if (server->workers && conn->cli && !conn->dead) {
+    cli_int_server_queue(server, conn, readable, writable);
+  } else {
+    if (readable) cli_int_server_readable(server, conn);
+    if (writable) cli_int_server_writable(server, conn);
+  }
+}
+
+static int cli_int_server_loop(struct cli_server *server) {
+  while (server->conns) {
+    int i, n;
+#ifdef CLI_SERVER_USE_EPOLL
+    struct epoll_event events[CLI_SERVER_MAX_EVENTS];
+
+    if ((n = epoll_wait(server->epfd, events, CLI_SERVER_MAX_EVENTS, 1000)) < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      return CLI_ERROR;
+    }
+
+    for (i = 0; i < n; i++)
+      cli_int_server_event(server, events[i].data.ptr, events[i].events & ~EPOLLOUT, events[i].events & EPOLLOUT);
+#else
+    struct cli_server_conn *conn, **ready;
+    struct pollfd *pfds;
+    int nfds = 0;
+
+    for (conn = server->conns; conn; conn = conn->next) nfds++;
+    if (server->workers) nfds++;
+    pfds = calloc(nfds, sizeof(struct pollfd));
+    ready = calloc(nfds, sizeof(struct cli_server_conn *));
+    if (!pfds || !ready) {
+      free(pfds);
+      free(ready);
+      return CLI_ERROR;
+    }
+    for (conn = server->conns, i = 0; conn; conn = conn->next) {
+      // Left alone while a worker has it
+      if (conn->busy) continue;
+      pfds[i].fd = conn->fd;
+      pfds[i].events = POLLIN | (conn->want_write ? POLLOUT : 0);
+      ready[i++] = conn;
+    }
+    if (server->workers) {
+      pfds[i].fd = server->waker.fd;
+      pfds[i].events = POLLIN;
+      ready[i++] = &server->waker;
+    }
+    nfds = i;
+
+    if ((n = poll(pfds, nfds, 1000)) < 0) {
+      free(pfds);
+      free(ready);
+      if (errno == EINTR) continue;
+      perror("poll");
+      return CLI_ERROR;
+    }
+
+    for (i = 0; n > 0 && i < nfds; i++) {
+      if (!pfds[i].revents) continue;
+      n--;
+      cli_int_server_event(server, ready[i], pfds[i].revents & ~POLLOUT, pfds[i].revents & POLLOUT);
+    }
+    free(pfds);
+    free(ready);
+#endif
+
+    cli_int_server_sweep(server);
+    cli_int_server_reap(server);
+  }
+
+  return CLI_OK;
+}
+
+int cli_server_run(struct cli_server *server) {
+  int rc;
+
+  if (!server) return CLI_ERROR;
+  if (server->threads && cli_int_server_start_workers(server) != CLI_OK) return CLI_ERROR;
+  rc = cli_int_server_loop(server);
+  if (server->workers) cli_int_server_stop_workers(server);
+  return rc;
+}
+
+int cli_server_done(struct cli_server *server) {
+  struct cli_server_conn *conn;
+
+  if (!server) return CLI_OK;
+  for (conn = server->conns; conn; conn = conn->next) cli_int_server_close(server, conn);
+  cli_int_server_reap(server);
+  if (server->epfd >= 0) close(server->epfd);
+  pthread_cond_destroy(&server->work);
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+  return CLI_OK;
+}
+#endif
+
+int cli_file(struct cli_def *cli, FILE *fh, int privilege, int mode) {
+  int oldpriv = cli_set_privilege(cli, privilege);
+  int oldmode = cli_set_configmode(cli, mode, NULL);
+  char buf[CLI_MAX_LINE_LENGTH];
+
+  while (1) {
+    char *p;
+    char *cmd;
+    char *end;
+
+    // End of file
+    if (fgets(buf, CLI_MAX_LINE_LENGTH - 1, fh) == NULL) break;
+
+    if ((p = strpbrk(buf, "#\r\n"))) *p = 0;
+
+    cmd = buf;
+    while (isspace(*cmd)) cmd++;
 
     if (!*cmd) continue;
 
-    for (p = end = cmd; *p; p++)
-      if (!isspace(*p)) end = p;
+    for (p = end = cmd; *p; p++)
+      if (!isspace(*p)) end = p;
+
+    *++end = 0;
+    if (strcasecmp(cmd, "quit") == 0) break;
+
+    if (cli_run_command(cli, cmd) == CLI_QUIT) break;
+  }
+
+  cli_set_privilege(cli, oldpriv);
+  cli_set_configmode(cli, oldmode, NULL);
+
+  return CLI_OK;
+}
+
+// Make room for 'n' more bytes of text (and a terminating NUL) in cli->buffer
+static int cli_int_buffer_reserve(struct cli_def *cli, size_t n) {
+  size_t size = cli->buf_size ? cli->buf_size : 1024;
+  char *buf;
+
+  if (cli->buf_len + n < cli->buf_size) return CLI_OK;
+  while (size <= cli->buf_len + n) size *= 2;
+  if (!(buf = realloc(cli->buffer, size))) return CLI_ERROR;
+  cli->buffer = buf;
+  cli->buf_size = size;
+  return CLI_OK;
+}
+
+// Append text to cli->buffer, which holds output that has not been split into lines yet
+static int cli_int_buffer_append(struct cli_def *cli, const char *text, size_t n) {
+  if (cli_int_buffer_reserve(cli, n) != CLI_OK) return CLI_ERROR;
+  memcpy(cli->buffer + cli->buf_len, text, n);
+  cli->buf_len += n;
+  cli->buffer[cli->buf_len] = 0;
+  return CLI_OK;
+}
+
+// Send a line of output which has been through the filters to the client; line[len] is always NUL
+static void cli_int_output_line(struct cli_def *cli, const char *line, size_t len) {
+  if (cli->print_callback)
+    cli->print_callback(cli, line);
+  else if (cli->session && cli->pager && cli->session->in_command)
+    cli_int_page_line(cli, line, len);
+  else if (cli->session)
+    cli_int_write_line(cli, line, len);
+  else if (cli->client)
+    fprintf(cli->client, "%s\r\n", line);
+}
+
+// Run a single line of output through the filters and send it to the client; line[len] is always NUL
+static void cli_int_print_line(struct cli_def *cli, int print_mode, const char *line, size_t len) {
+  struct cli_filter *f;
+
+  if (print_mode & PRINT_FILTERED) {
+    for (f = cli->filters; f; f = f->next) {
+      int rc = f->filter_line ? f->filter_line(cli, line, len, f->data) : f->filter(cli, line, f->data);
+      if (rc != CLI_OK) return;
+    }
+  }
+  cli_int_output_line(cli, line, len);
+}
+
+// Print each complete line in cli->buffer, and the remainder too unless PRINT_BUFFERED is set
+static void cli_int_print_lines(struct cli_def *cli, int print_mode) {
+  char *p = cli->buffer;
+  char *end = cli->buffer + cli->buf_len;
+
+#ifdef CLI_USE_THREADS
+  // A big block of output may have most of its filtering done by the filter threads
+  if ((print_mode & PRINT_FILTERED) && cli->filter_pool) p = cli_int_print_parallel(cli, p, end);
+#endif
+
+  while (p) {
+    char *next = memchr(p, '\n', end - p);
+    size_t len;
+
+    if (next) {
+      len = next - p;
+      *next++ = 0;
+    } else if (print_mode & PRINT_BUFFERED) {
+      break;
+    } else {
+      len = end - p;
+    }
+
+    cli_int_print_line(cli, print_mode, p, len);
+    p = next;
+  }
+
+  if (p && p < end) {
+    cli->buf_len = end - p;
+    if (p != cli->buffer) memmove(cli->buffer, p, cli->buf_len + 1);
+  } else {
+    cli->buf_len = 0;
+    *cli->buffer = 0;
+  }
+}
+
+static void _print(struct cli_def *cli, int print_mode, const char *format, va_list ap) {
+  va_list aq;
+  size_t avail;
+  int n;
+
+  if (!cli) return;
+
+  // Nobody wants to see the rest of the output, don't bother formatting it
+  if (cli->session && cli->session->cancelled) return;
+
+  // Format straight into the spare space at the end of the buffer, only growing it if that was too small
+  avail = cli->buf_size - cli->buf_len;
+  va_copy(aq, ap);
+  n = vsnprintf(cli->buffer ? cli->buffer + cli->buf_len : NULL, avail, format, aq);
+  va_end(aq);
+  if (n < 0) return;
+
+  if ((size_t)n >= avail) {
+    if (cli_int_buffer_reserve(cli, n) != CLI_OK) {
+      if (cli->buffer) cli->buffer[cli->buf_len] = 0;
+      return;
+    }
+    vsnprintf(cli->buffer + cli->buf_len, n + 1, format, ap);
+  }
+  cli->buf_len += n;
+  cli_int_print_lines(cli, print_mode);
+}
+
+void cli_write(struct cli_def *cli, const char *buf, size_t len) {
+  if (!cli || !len) return;
+  if (cli->session && cli->session->cancelled) return;
+  if (cli_int_buffer_append(cli, buf, len) != CLI_OK) return;
+  cli_int_print_lines(cli, PRINT_BUFFERED | PRINT_FILTERED);
+}
+
+void cli_set_output_high_water(struct cli_def *cli, size_t bytes) {
+  cli->output_high_water = bytes;
+}
+
+void cli_set_output_limit(struct cli_def *cli, size_t bytes) {
+  cli->output_limit = bytes;
+}
+
+void cli_set_pager(struct cli_def *cli, int enabled) {
+  cli->pager = enabled;
+}
+
+void cli_set_terminal_size(struct cli_def *cli, int width, int height) {
+  cli->term_width = width;
+  cli->term_height = height;
+}
+
+int cli_stream(struct cli_def *cli, int (*callback)(struct cli_def *cli, void *arg), void (*cleanup)(void *arg),
+               void *arg) {
+  struct cli_stream *stream;
+
+  if (!cli || !callback || cli->stream) return CLI_ERROR;
+  if (!(stream = calloc(sizeof(struct cli_stream), 1))) return CLI_ERROR;
+  stream->callback = callback;
+  stream->cleanup = cleanup;
+  stream->arg = arg;
+  cli->stream = stream;
+  return CLI_OK;
+}
+
+void cli_int_stream_free(struct cli_def *cli) {
+  struct cli_stream *stream = cli->stream;
+  struct cli_filter *filters = cli->filters;
+
+  // Let the command's filters finish off (e.g. count) before they are freed
+  cli->filters = stream->filters;
+  cli_int_free_filters(cli);
+  cli->filters = filters;
+
+  if (stream->cleanup) stream->cleanup(stream->arg);
+  free(stream);
+  cli->stream = NULL;
+}
+
+// Call the stream callback until it's finished or there is as much output waiting as the client should get at once
+void cli_int_stream_run(struct cli_def *cli) {
+  struct cli_stream *stream = cli->stream;
+  struct cli_filter *filters = cli->filters;
+  size_t high_water = cli_int_high_water(cli);
+  int rc = CLI_OK;
+
+  cli->filters = stream->filters;
+  while (rc == CLI_OK && (!cli->session || (!cli->session->cancelled && cli->session->out_len < high_water)))
+    rc = stream->callback(cli, stream->arg);
+  stream->filters = cli->filters;
+  cli->filters = filters;
+
+  if (rc != CLI_OK || (cli->session && cli->session->cancelled)) cli_int_stream_free(cli);
+}
+
+void cli_bufprint(struct cli_def *cli, const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  _print(cli, PRINT_BUFFERED | PRINT_FILTERED, format, ap);
+  va_end(ap);
+}
+
+void cli_vabufprint(struct cli_def *cli, const char *format, va_list ap) {
+  _print(cli, PRINT_BUFFERED, format, ap);
+}
+
+void cli_print(struct cli_def *cli, const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  _print(cli, PRINT_FILTERED, format, ap);
+  va_end(ap);
+}
+
+void cli_error(struct cli_def *cli, const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  _print(cli, PRINT_PLAIN, format, ap);
+  va_end(ap);
+}
+
+/*
+ * Substring search for the filters, which see every line of output.  Candidates are found a block at a time by
+ * comparing the first and last bytes of the needle against the haystack at the right distance apart, and only those
+ * are compared in full.  The needle is set up once, when the filter is, including which version to use: AVX2 if the
+ * CPU has it, otherwise SSE2 (or plain C).  Case insensitive searches fold ASCII letters only.
+ */
+struct cli_needle {
+  const char *text;  // Lower case if icase
+  size_t len;
+  int icase;
+  const char *(*find)(const struct cli_needle *needle, const char *haystack, size_t len);
+};
+
+static unsigned char cli_int_fold(unsigned char c) {
+  return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+// Whether the needle is at 'p', which has at least needle->len bytes; needles are short, so this beats memcmp()
+static int cli_int_needle_at(const struct cli_needle *needle, const char *p) {
+  size_t i;
+
+  if (!needle->icase) {
+    for (i = 0; i < needle->len; i++)
+      if (p[i] != needle->text[i]) return 0;
+    return 1;
+  }
+  for (i = 0; i < needle->len; i++)
+    if (cli_int_fold(p[i]) != (unsigned char)needle->text[i]) return 0;
+  return 1;
+}
+
+// memmem() takes longer to get going than a short line takes to search a byte at a time
+#define CLI_NEEDLE_MEMMEM_LEN 64
+
+static const char *cli_int_find_scalar(const struct cli_needle *needle, const char *haystack, size_t len) {
+  const char *end;
+
+  if (!needle->icase && len >= CLI_NEEDLE_MEMMEM_LEN) return memmem(haystack, len, needle->text, needle->len);
+  if (len < needle->len) return NULL;
+  for (end = haystack + len - needle->len; haystack <= end; haystack++) {
+    unsigned char c = needle->icase ? cli_int_fold(*haystack) : (unsigned char)*haystack;
+
+    if (c == (unsigned char)needle->text[0] && cli_int_needle_at(needle, haystack)) return haystack;
+  }
+  return NULL;
+}
+
+#ifdef __SSE2__
+// Fold 'A' to 'Z' in 'v' to lower case, moving them to the bottom of the signed range where one compare finds them
+static __m128i cli_int_fold_sse2(__m128i v) {
+  __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8(128 - 'A')), _mm_set1_epi8(-128 + 26));
+
+  return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static const char *cli_int_find_sse2(const struct cli_needle *needle, const char *haystack, size_t len) {
+  const __m128i first = _mm_set1_epi8(needle->text[0]), last = _mm_set1_epi8(needle->text[needle->len - 1]);
+  size_t i, span = needle->len - 1;
+
+  for (i = 0; i + span + 16 <= len; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+    __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + span));
+    unsigned mask;
+
+    if (needle->icase) {
+      block_first = cli_int_fold_sse2(block_first);
+      block_last = cli_int_fold_sse2(block_last);
+    }
+    mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+    for (; mask; mask &= mask - 1) {
+      const char *p = haystack + i + __builtin_ctz(mask);
+
+      if (cli_int_needle_at(needle, p)) return p;
+    }
+  }
+  return cli_int_find_scalar(needle, haystack + i, len - i);
+}
+#endif
+
+#ifdef CLI_USE_AVX2
+__attribute__((target("avx2"))) static __m256i cli_int_fold_avx2(__m256i v) {
+  __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), _mm256_add_epi8(v, _mm256_set1_epi8(128 - 'A')));
+
+  return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) static const char *cli_int_find_avx2(const struct cli_needle *needle,
+                                                                      const char *haystack, size_t len) {
+  const __m256i first = _mm256_set1_epi8(needle->text[0]), last = _mm256_set1_epi8(needle->text[needle->len - 1]);
+  const char *found = NULL;
+  size_t i, span = needle->len - 1;
+
+  for (i = 0; !found && i + span + 32 <= len; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i *)(haystack + i));
+    __m256i block_last = _mm256_loadu_si256((const __m256i *)(haystack + i + span));
+    unsigned mask;
+
+    if (needle->icase) {
+      block_first = cli_int_fold_avx2(block_first);
+      block_last = cli_int_fold_avx2(block_last);
+    }
+    mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+    for (; mask && !found; mask &= mask - 1) {
+      const char *p = haystack + i + __builtin_ctz(mask);
+
+      if (cli_int_needle_at(needle, p)) found = p;
+    }
+  }
+  // GCC doesn't always do this itself, and without it any SSE code run afterwards is much slower
+  _mm256_zeroupper();
+  if (found) return found;
+#ifdef __SSE2__
+  return cli_int_find_sse2(needle, haystack + i, len - i);
+#else
+  return cli_int_find_scalar(needle, haystack + i, len - i);
+#endif
+}
+#endif
+
+// Set up a search for the 'len' bytes of 'text', which is folded to lower case in place for a case insensitive one
+static void cli_int_needle_init(struct cli_needle *needle, char *text, size_t len, int icase) {
+  size_t i;
+
+  if (icase)
+    for (i = 0; i < len; i++) text[i] = cli_int_fold(text[i]);
+  needle->text = text;
+  needle->len = len;
+  needle->icase = icase;
+  needle->find = cli_int_find_scalar;
+  if (!len) return;
+#ifdef __SSE2__
+  needle->find = cli_int_find_sse2;
+#endif
+#ifdef CLI_USE_AVX2
+  if (__builtin_cpu_supports("avx2")) needle->find = cli_int_find_avx2;
+#endif
+}
+
+/*
+ * Whether the needle is somewhere in the 'len' bytes of 'haystack'; an empty needle is in everything.  Lines too short
+ * for a single block go straight to searching a byte at a time.
+ */
+static int cli_int_needle_find(const struct cli_needle *needle, const char *haystack, size_t len) {
+  if (!needle->len) return 1;
+  if (len < needle->len + 15) return cli_int_find_scalar(needle, haystack, len) != NULL;
+  return needle->find(needle, haystack, len) != NULL;
+}
+
+/*
+ * Searching for several strings at once, for include-any and exclude-any and for runs of include and exclude filters
+ * (see cli_int_fuse_filters()).  An Aho-Corasick automaton takes one step per byte of the line however many strings
+ * there are.  The strings are in groups, and a scan finds which groups had at least one of their strings in the line.
+ *
+ * Bytes which aren't in any of the strings all behave the same, so the transition table only has a column for each
+ * byte which is (the others share column 0); for a case insensitive search both cases of a letter share one too.
+ * Transitions hold the offset of the next state's row rather than its number, with the top bit set if any strings end
+ * there, so a step is a single load.  Most of a line is usually spent in the first state waiting for a byte which
+ * starts one of the strings; if only a few bytes do, those are looked for a block at a time instead.
+ */
+#define CLI_AUTOMATON_FOUND 0x80000000u
+#define CLI_AUTOMATON_MAX_GROUPS 64
+#define CLI_AUTOMATON_MAX_FIRST 8
+
+struct cli_search_string {
+  const char *text;
+  size_t len;
+  int group;
+};
+
+struct cli_automaton {
+  unsigned num_classes;
+  unsigned char classes[256];                    // The column for each byte
+  int num_first;                                 // How many bytes start a string, -1 if too many to look for
+  unsigned char first[CLI_AUTOMATON_MAX_FIRST];  // And which they are
+  uint64_t *found;                               // Groups of the strings ending at each state, by state number
+  uint32_t next[];                               // Of each state for each column, states are num_classes apart
+};
+
+// Build an automaton finding any of the 'num' strings, or NULL if out of memory
+static struct cli_automaton *cli_int_automaton_build(const struct cli_search_string *strings, int num, int icase) {
+  unsigned char classes[256] = {0};
+  unsigned num_classes = 1, num_states = 1, max_states = 1, head = 0, tail = 0, s, c;
+  uint32_t *next = NULL, *fail = NULL, *queue = NULL;
+  uint64_t *found = NULL;
+  struct cli_automaton *automaton = NULL;
+  size_t i, size;
+  int n;
+
+  for (n = 0; n < num; n++) {
+    for (i = 0; i < strings[n].len; i++) {
+      unsigned char b = strings[n].text[i];
+
+      if (icase) b = cli_int_fold(b);
+      if (!classes[b]) classes[b] = num_classes++;
+    }
+    max_states += strings[n].len;
+  }
+  if (icase)
+    for (c = 'A'; c <= 'Z'; c++) classes[c] = classes[c | 0x20];
+  if ((uint64_t)max_states * num_classes >= CLI_AUTOMATON_FOUND) return NULL;
+
+  // Nothing goes back to state 0 in the trie, so 0 is also "no transition" until the failure links are filled in
+  next = calloc((size_t)max_states * num_classes, sizeof(uint32_t));
+  fail = calloc(max_states, sizeof(uint32_t));
+  queue = calloc(max_states, sizeof(uint32_t));
+  found = calloc(max_states, sizeof(uint64_t));
+  if (!next || !fail || !queue || !found) goto out;
+
+  for (n = 0; n < num; n++) {
+    for (s = 0, i = 0; i < strings[n].len; i++) {
+      uint32_t *t = &next[s * num_classes + classes[(unsigned char)strings[n].text[i]]];
+
+      if (!*t) *t = num_states++;
+      s = *t;
+    }
+    found[s] |= (uint64_t)1 << strings[n].group;
+  }
+
+  // Breadth first, so the state a failure link goes to (which is always shallower) is finished with first
+  for (c = 0; c < num_classes; c++)
+    if (next[c]) queue[tail++] = next[c];
+  while (head < tail) {
+    s = queue[head++];
+    found[s] |= found[fail[s]];
+    for (c = 0; c < num_classes; c++) {
+      uint32_t *t = &next[s * num_classes + c];
+
+      if (*t) {
+        fail[*t] = next[fail[s] * num_classes + c];
+        queue[tail++] = *t;
+      } else {
+        *t = next[fail[s] * num_classes + c];
+      }
+    }
+  }
+
+  // The found groups go after the transitions, lined up for a uint64_t
+  size = sizeof(struct cli_automaton) + (size_t)num_states * num_classes * sizeof(uint32_t);
+  size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+  if (!(automaton = malloc(size + num_states * sizeof(uint64_t)))) goto out;
+  automaton->num_classes = num_classes;
+  memcpy(automaton->classes, classes, sizeof(classes));
+  automaton->num_first = 0;
+  for (i = 0; i < 256 && automaton->num_first >= 0; i++) {
+    if (!classes[i] || !next[classes[i]]) continue;
+    if (automaton->num_first == CLI_AUTOMATON_MAX_FIRST)
+      automaton->num_first = -1;
+    else
+      automaton->first[automaton->num_first++] = i;
+  }
+  automaton->found = (uint64_t *)((char *)automaton + size);
+  memcpy(automaton->found, found, num_states * sizeof(uint64_t));
+  for (i = 0; i < (size_t)num_states * num_classes; i++)
+    automaton->next[i] = next[i] * num_classes | (found[next[i]] ? CLI_AUTOMATON_FOUND : 0);
+
+out:
+  free(next);
+  free(fail);
+  free(queue);
+  free(found);
+  return automaton;
+}
+
+// The first byte from 'p' on which starts a string, or 'end'; until then the automaton stays in the first state
+static const unsigned char *cli_int_automaton_skip(const struct cli_automaton *automaton, const unsigned char *p,
+                                                   const unsigned char *end) {
+#ifdef __SSE2__
+  for (; p + 16 <= end; p += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)p), hit = _mm_setzero_si128();
+    unsigned mask;
+    int i;
+
+    for (i = 0; i < automaton->num_first; i++)
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8(automaton->first[i])));
+    if ((mask = _mm_movemask_epi8(hit))) return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; p++)
+    if (automaton->next[automaton->classes[*p]] & ~CLI_AUTOMATON_FOUND) return p;
+  return end;
+}
+
+/*
+ * Whether the line has a string from every group in 'want' and none from any group in 'reject'.  This stops as soon
+ * as the answer is known, which for exclude filters is usually not until the end.
+ */
+static int cli_int_automaton_match(const struct cli_automaton *automaton, uint64_t want, uint64_t reject,
+                                   const char *line, size_t len) {
+  const unsigned char *p = (const unsigned char *)line, *end = p + len;
+  uint64_t seen = automaton->found[0];
+  uint32_t s = 0;
+
+  while (p < end) {
+    uint32_t t;
+
+    if (!s && automaton->num_first >= 0 && (p = cli_int_automaton_skip(automaton, p, end)) == end) break;
+    t = automaton->next[s + automaton->classes[*p++]];
+    s = t & ~CLI_AUTOMATON_FOUND;
+    if (t & CLI_AUTOMATON_FOUND) {
+      seen |= automaton->found[s / automaton->num_classes];
+      if (seen & reject) return 0;
+      if (!reject && (seen & want) == want) return 1;
+    }
+  }
+  return (seen & want) == want && !(seen & reject);
+}
+
+/*
+ * Compiling a regex costs far more than matching a line or two with it, and the same few patterns tend to be used
+ * over and over.  Patterns no longer in use are kept with the registry, most recently used first, to be picked up
+ * by the next filter wanting the same pattern and flags.  A compiled pattern is only ever used by one filter at a
+ * time as glibc's regexec() takes a lock on it.
+ *
+ * Each one also has a literal every match has to contain, if one can be found, so most lines are turned down by a
+ * substring search without running the regex at all; a pattern which is nothing but a literal doesn't need the regex.
+ */
+#define CLI_PATTERN_CACHE_SIZE 32
+
+struct cli_compiled_pattern {
+  struct cli_compiled_pattern *next;
+  int rflags;
+  regex_t re;
+  int whole;                  // The pattern is just the literal
+  struct cli_needle literal;  // Of what every match has to contain, empty if nothing does
+  char pattern[];
+};
+
+/*
+ * Find the longest run of characters which has to appear in every match of 'pattern', writing it to 'literal' (with
+ * room for the pattern) and returning its length.  Anything which isn't plainly understood ends a run, and
+ * alternation, intervals and REG_ICASE give up altogether, so the answer is never wrong, only sometimes unhelpful.
+ */
+static size_t cli_int_pattern_literal(const char *pattern, int rflags, char *literal, int *whole) {
+  int extended = rflags & REG_EXTENDED;
+  size_t best = 0, run = 0;
+  int depth = 0, in_run = 0, plain = 1;
+  const char *p = pattern;
+
+  *whole = 0;
+  if (rflags & REG_ICASE) return 0;
+
+  while (*p) {
+    unsigned char c = *p++;
+    int is_literal = 0, quantifier = 0;
+
+    if (c == '\\') {
+      c = *p++;
+      if (!c) return 0;
+      if (!extended && (c == '|' || c == '{')) return 0;
+      if (!extended && (c == '(' || c == ')'))
+        depth += c == '(' ? 1 : -1;
+      else if (!extended && (c == '+' || c == '?'))
+        quantifier = 1;
+      else
+        is_literal = c < 0x80 && !isalnum(c) && !strchr("<>`'", c);
+    } else if (extended && (c == '|' || c == '{')) {
+      return 0;
+    } else if (extended && (c == '(' || c == ')')) {
+      depth += c == '(' ? 1 : -1;
+    } else if (c == '*' || (extended && (c == '+' || c == '?'))) {
+      quantifier = 1;
+    } else if (c == '[') {
+      // Skip the bracket expression, where a ] first or in [:class:] doesn't end it
+      if (*p == '^') p++;
+      if (*p == ']') p++;
+      while (*p && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+          char delim = p[1];
+
+          for (p += 2; *p && !(*p == delim && p[1] == ']'); p++)
+            ;
+          if (!*p) return 0;
+          p++;
+        }
+        p++;
+      }
+      if (!*p++) return 0;
+    } else {
+      is_literal = c != '.' && c != '^' && c != '$' && c < 0x80;
+    }
+
+    if (quantifier && in_run) {
+      // The character before might not be there at all
+      run--;
+    }
+    if (is_literal && !depth) {
+      literal[best + run++] = c;
+      in_run = 1;
+      continue;
+    }
+
+    plain = 0;
+    if (run > best) {
+      memmove(literal, literal + best, run);
+      best = run;
+    }
+    run = 0;
+    in_run = 0;
+  }
+
+  if (run > best) {
+    memmove(literal, literal + best, run);
+    best = run;
+  }
+  *whole = plain;
+  return best;
+}
+
+static void cli_int_pattern_free(struct cli_compiled_pattern *compiled) {
+  regfree(&compiled->re);
+  free(compiled);
+}
+
+// A compiled 'pattern', from those kept if there is one, or NULL if it can't be compiled
+static struct cli_compiled_pattern *cli_int_pattern_get(struct cli_def *cli, const char *pattern, int rflags) {
+  struct cli_registry *registry = cli->registry;
+  struct cli_compiled_pattern **p, *compiled = NULL;
+  size_t len = strlen(pattern), literal_len;
+  char *literal;
+
+  cli_int_tree_mutex_lock();
+  for (p = &registry->patterns; *p; p = &(*p)->next) {
+    if ((*p)->rflags == rflags && !strcmp((*p)->pattern, pattern)) {
+      compiled = *p;
+      *p = compiled->next;
+      registry->num_patterns--;
+      break;
+    }
+  }
+  cli_int_tree_mutex_unlock();
+  if (compiled) return compiled;
+
+  if (!(compiled = calloc(sizeof(struct cli_compiled_pattern) + 2 * (len + 1), 1))) return NULL;
+  memcpy(compiled->pattern, pattern, len + 1);
+  compiled->rflags = rflags;
+  if (regcomp(&compiled->re, pattern, rflags)) {
+    free(compiled);
+    return NULL;
+  }
+  literal = compiled->pattern + len + 1;
+  literal_len = cli_int_pattern_literal(pattern, rflags, literal, &compiled->whole);
+  cli_int_needle_init(&compiled->literal, literal, literal_len, 0);
+  return compiled;
+}
+
+// Keep a pattern which is finished with for next time, dropping the least recently used if there are too many
+static void cli_int_pattern_put(struct cli_def *cli, struct cli_compiled_pattern *compiled) {
+  struct cli_registry *registry = cli->registry;
+  struct cli_compiled_pattern **p;
+
+  if (!registry) {
+    cli_int_pattern_free(compiled);
+    return;
+  }
+
+  cli_int_tree_mutex_lock();
+  compiled->next = registry->patterns;
+  registry->patterns = compiled;
+  compiled = NULL;
+  if (++registry->num_patterns > CLI_PATTERN_CACHE_SIZE) {
+    for (p = &registry->patterns; (*p)->next; p = &(*p)->next)
+      ;
+    compiled = *p;
+    *p = NULL;
+    registry->num_patterns--;
+  }
+  cli_int_tree_mutex_unlock();
+  if (compiled) cli_int_pattern_free(compiled);
+}
+
+static void cli_int_patterns_free(struct cli_registry *registry) {
+  while (registry->patterns) {
+    struct cli_compiled_pattern *compiled = registry->patterns;
+
+    registry->patterns = compiled->next;
+    cli_int_pattern_free(compiled);
+  }
+  registry->num_patterns = 0;
+}
+
+static int cli_int_pattern_match(struct cli_compiled_pattern *compiled, const char *line, size_t len) {
+  if (!cli_int_needle_find(&compiled->literal, line, len)) return 0;
+  return compiled->whole || !regexec(&compiled->re, line, 0, NULL, 0);
+}
+
+struct cli_match_filter_state {
+  int flags;
+  union {
+    struct cli_needle string;
+    struct cli_compiled_pattern *pattern;
+  } match;
+};
+
+int cli_search_flags_validator(struct cli_def *cli, const char *word, const char *value) {
+  // Valid search flags starts with a hyphen, then any number of i, v, or e characters.
+
+  if ((*value++ == '-') && (*value) && (strspn(value, "vie") == strlen(value))) return CLI_OK;
+  return CLI_ERROR;
+}
+
+// The -v and -i of a search_flags optarg
+static void cli_int_search_flags(const char *search_flags, int *invert, int *icase) {
+  if (!search_flags) return;
+  while (*search_flags) {
+    switch (*search_flags++) {
+      case 'v':
+        *invert = 1;
+        break;
+
+      case 'i':
+        *icase = 1;
+        break;
+
+      case 'e':
+        // Implies next term is search string, so stop processing flags
+        break;
+    }
+  }
+}
+
+int cli_match_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt) {
+  struct cli_match_filter_state *state;
+  // The full name of the filter, the word typed may have been abbreviated
+  const char *name = cli->pipeline->current_stage->command->command;
+  char *search_pattern = cli_get_optarg_value(cli, "search_pattern", NULL);
+  char *search_flags = cli_get_optarg_value(cli, "search_flags", NULL);
+  size_t len = strlen(search_pattern);
+  int invert = 0, icase = 0;
+
+  // The pattern is copied in with the state, as the filter may outlive the command line (see cli_stream())
+  filt->filter = cli_match_filter;
+  filt->filter_line = cli_match_filter_line;
+  filt->data = state = calloc(sizeof(struct cli_match_filter_state) + len + 1, 1);
+  if (!state) return CLI_ERROR;
+
+  cli_int_search_flags(search_flags, &invert, &icase);
+
+  if (!strcmp(name, "include") || !strcmp(name, "exclude")) {
+    cli_int_needle_init(&state->match.string, memcpy(state + 1, search_pattern, len + 1), len, icase);
+    if (!strcmp(name, "exclude")) invert = !invert;
+#ifndef WIN32
+  } else {
+    int rflags = REG_NOSUB;
+    if (!strcmp(name, "grep")) {
+      state->flags = MATCH_REGEX;
+    } else if (!strcmp(name, "egrep")) {
+      state->flags = MATCH_REGEX;
+      rflags |= REG_EXTENDED;
+    }
+    if (icase) rflags |= REG_ICASE;
+    if (!(state->match.pattern = cli_int_pattern_get(cli, search_pattern, rflags))) {
+      cli_int_client_printf(cli, "Invalid pattern \"%s\"\r\n", search_pattern);
+      return CLI_ERROR;
+    }
+  }
+#else
+  } else {
+    // No regex functions in windows, so return an error.
+    return CLI_ERROR;
+  }
+#endif
+  if (invert) state->flags |= MATCH_INVERT;
+
+  return CLI_OK;
+}
+
+int cli_match_filter(struct cli_def *cli, const char *string, void *data) {
+  struct cli_match_filter_state *state = data;
+  int r = CLI_ERROR;
+
+  if (!string) {
+    if ((state->flags & MATCH_REGEX) && state->match.pattern) cli_int_pattern_put(cli, state->match.pattern);
+
+    free(state);
+    return CLI_OK;
+  }
+
+  if (state->flags & MATCH_REGEX) {
+    if (cli_int_pattern_match(state->match.pattern, string, strlen(string))) r = CLI_OK;
+  } else {
+    if (cli_int_needle_find(&state->match.string, string, strlen(string))) r = CLI_OK;
+  }
+
+  if (state->flags & MATCH_INVERT) {
+    if (r == CLI_OK)
+      r = CLI_ERROR;
+    else
+      r = CLI_OK;
+  }
+
+  return r;
+}
+
+int cli_match_filter_line(UNUSED(struct cli_def *cli), const char *line, size_t len, void *data) {
+  struct cli_match_filter_state *state = data;
+  int r = CLI_ERROR;
+
+  if (state->flags & MATCH_REGEX) {
+    if (cli_int_pattern_match(state->match.pattern, line, len)) r = CLI_OK;
+  } else {
+    if (cli_int_needle_find(&state->match.string, line, len)) r = CLI_OK;
+  }
+
+  if (state->flags & MATCH_INVERT) r = (r == CLI_OK) ? CLI_ERROR : CLI_OK;
+
+  return r;
+}
+
+struct cli_range_filter_state {
+  int matched;
+  struct cli_needle from;
+  struct cli_needle to;  // Empty for begin, which carries on to the end
+};
+
+int cli_range_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt) {
+  struct cli_range_filter_state *state;
+  char *from = cli_get_optarg_value(cli, "range_start", NULL);
+  char *to = cli_get_optarg_value(cli, "range_end", NULL);
+
+  size_t from_len, to_len;
+
+  // Do not have to check from/to since we would not have gotten here if we were missing a required argument.
+  // They are copied in with the state though, as the filter may outlive the command line (see cli_stream())
+  from_len = strlen(from) + 1;
+  to_len = to ? strlen(to) + 1 : 0;
+
+  filt->filter = cli_range_filter;
+  filt->filter_line = cli_range_filter_line;
+  filt->data = state = calloc(sizeof(struct cli_range_filter_state) + from_len + to_len, 1);
+  if (state) {
+    char *text = (char *)(state + 1);
+
+    cli_int_needle_init(&state->from, memcpy(text, from, from_len), from_len - 1, 0);
+    if (to) cli_int_needle_init(&state->to, memcpy(text + from_len, to, to_len), to_len - 1, 0);
+    return CLI_OK;
+  } else {
+    return CLI_ERROR;
+  }
+}
+
+int cli_range_filter(struct cli_def *cli, const char *string, void *data) {
+  if (!string) {
+    free(data);
+    return CLI_OK;
+  }
+
+  return cli_range_filter_line(cli, string, strlen(string), data);
+}
+
+int cli_range_filter_line(UNUSED(struct cli_def *cli), const char *line, size_t len, void *data) {
+  struct cli_range_filter_state *state = data;
+  int r = CLI_ERROR;
+
+  if (!state->matched) state->matched = cli_int_needle_find(&state->from, line, len);
+
+  if (state->matched) {
+    r = CLI_OK;
+    if (state->to.text && cli_int_needle_find(&state->to, line, len)) state->matched = 0;
+  }
+
+  return r;
+}
+
+struct cli_multi_filter_state {
+  uint64_t want;    // Groups which must be in a line for it to be shown
+  uint64_t reject;  // And those which mustn't be
+  int icase;
+  int num_strings;
+  struct cli_search_string *strings;  // Kept so the filter can be fused with its neighbours
+  struct cli_automaton *automaton;
+};
+
+// A filter for the 'num' strings, copying them in with the state as the filter may outlive the command line
+static struct cli_multi_filter_state *cli_int_multi_state_new(const struct cli_search_string *strings, int num,
+                                                              int icase, uint64_t want, uint64_t reject) {
+  struct cli_multi_filter_state *state;
+  size_t size = sizeof(struct cli_multi_filter_state) + num * sizeof(struct cli_search_string);
+  char *text;
+  int n;
+
+  for (n = 0; n < num; n++) size += strings[n].len + 1;
+  if (!(state = calloc(size, 1))) return NULL;
+  state->want = want;
+  state->reject = reject;
+  state->icase = icase;
+  state->num_strings = num;
+  state->strings = (struct cli_search_string *)(state + 1);
+  text = (char *)(state->strings + num);
+  for (n = 0; n < num; n++) {
+    state->strings[n] = strings[n];
+    state->strings[n].text = memcpy(text, strings[n].text, strings[n].len);
+    text += strings[n].len + 1;
+  }
+  if (!(state->automaton = cli_int_automaton_build(state->strings, num, icase))) {
+    free(state);
+    return NULL;
+  }
+  return state;
+}
+
+int cli_multi_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt) {
+  struct cli_pipeline_stage *stage = cli->pipeline->current_stage;
+  struct cli_search_string *strings;
+  struct cli_multi_filter_state *state;
+  char *search_pattern = cli_get_optarg_value(cli, "search_pattern", NULL);
+  int invert = 0, icase = 0, num = 0, i;
+
+  cli_int_search_flags(cli_get_optarg_value(cli, "search_flags", NULL), &invert, &icase);
+  if (!strcmp(stage->command->command, "exclude-any")) invert = !invert;
+
+  // The first pattern is the search_pattern optarg, the rest are the words after it
+  if (!(strings = calloc(argc - stage->first_unmatched + 1, sizeof(struct cli_search_string)))) return CLI_ERROR;
+  strings[num].text = search_pattern;
+  strings[num++].len = strlen(search_pattern);
+  for (i = stage->first_unmatched; i < argc; i++) {
+    strings[num].text = argv[i];
+    strings[num++].len = strlen(argv[i]);
+  }
+  state = cli_int_multi_state_new(strings, num, icase, invert ? 0 : 1, invert ? 1 : 0);
+  free(strings);
+  if (!state) return CLI_ERROR;
+
+  filt->filter = cli_multi_filter;
+  filt->filter_line = cli_multi_filter_line;
+  filt->data = state;
+  return CLI_OK;
+}
+
+int cli_multi_filter(struct cli_def *cli, const char *string, void *data) {
+  struct cli_multi_filter_state *state = data;
+
+  if (!string) {
+    free(state->automaton);
+    free(state);
+    return CLI_OK;
+  }
+
+  return cli_multi_filter_line(cli, string, strlen(string), data);
+}
+
+int cli_multi_filter_line(UNUSED(struct cli_def *cli), const char *line, size_t len, void *data) {
+  struct cli_multi_filter_state *state = data;
+
+  return cli_int_automaton_match(state->automaton, state->want, state->reject, line, len) ? CLI_OK : CLI_ERROR;
+}
+
+/*
+ * Add the strings of an include or exclude filter (plain or -any) to 'strings' as 'group', or just count them if
+ * 'strings' is NULL.  Returns 0 for any other filter, which can't be fused.
+ */
+static int cli_int_filter_strings(struct cli_filter *filt, int group, struct cli_search_string *strings, int *icase,
+                                  int *reject) {
+  if (filt->filter == cli_match_filter) {
+    struct cli_match_filter_state *state = filt->data;
+
+    if (state->flags & MATCH_REGEX) return 0;
+    if (strings) {
+      strings->text = state->match.string.text;
+      strings->len = state->match.string.len;
+      strings->group = group;
+    }
+    *icase = state->match.string.icase;
+    *reject = !!(state->flags & MATCH_INVERT);
+    return 1;
+  }
+  if (filt->filter == cli_multi_filter) {
+    struct cli_multi_filter_state *state = filt->data;
+    int n;
+
+    if (strings)
+      for (n = 0; n < state->num_strings; n++) {
+        strings[n] = state->strings[n];
+        strings[n].group = group;
+      }
+    *icase = state->icase;
+    *reject = !!state->reject;
+    return state->num_strings;
+  }
+  return 0;
+}
+
+/*
+ * Replace each run of include and exclude filters on the command line with one searching for all of their strings
+ * at once.  Each filter in the run becomes a group in the automaton, so a line is shown if it has a string from every
+ * include group and none from any exclude group, the same as running the filters one after another.  A run of plain
+ * include and exclude filters is only worth it once there are a few of them, and only if the automaton can skip
+ * through the line to where the strings start, as each of those filters on its own is searched for a block at a time.
+ * That rules out case insensitive ones, which stop at both cases of every letter a string starts with.  Filters are
+ * left as they are if anything goes wrong.
+ */
+#define CLI_FUSE_MIN_STRINGS 4
+
+void cli_int_fuse_filters(struct cli_def *cli) {
+  struct cli_filter *first, *end, *f;
+
+  for (first = cli->filters; first; first = first->next) {
+    struct cli_search_string *strings;
+    struct cli_multi_filter_state *state;
+    uint64_t want = 0, reject = 0;
+    int icase, f_icase, f_reject, groups = 0, num = 0, any = 0, count;
+
+    if (!cli_int_filter_strings(first, 0, NULL, &icase, &f_reject)) continue;
+    for (end = first; end && groups < CLI_AUTOMATON_MAX_GROUPS; end = end->next, groups++) {
+      if (!(count = cli_int_filter_strings(end, 0, NULL, &f_icase, &f_reject)) || f_icase != icase) break;
+      if (end->filter == cli_multi_filter) any = 1;
+      num += count;
+    }
+    if (groups < 2 || (!any && (num < CLI_FUSE_MIN_STRINGS || icase))) continue;
+
+    if (!(strings = calloc(num, sizeof(struct cli_search_string)))) return;
+    for (num = 0, groups = 0, f = first; f != end; f = f->next, groups++) {
+      num += cli_int_filter_strings(f, groups, strings + num, &f_icase, &f_reject);
+      if (f_reject)
+        reject |= (uint64_t)1 << groups;
+      else
+        want |= (uint64_t)1 << groups;
+    }
+    state = cli_int_multi_state_new(strings, num, icase, want, reject);
+    free(strings);
+    if (!state) return;
+    if (!any && state->automaton->num_first < 0) {
+      cli_multi_filter(cli, NULL, state);
+      continue;
+    }
+
+    // The first filter of the run becomes the fused one, and the rest are finished with
+    first->filter(cli, NULL, first->data);
+    first->filter = cli_multi_filter;
+    first->filter_line = cli_multi_filter_line;
+    first->data = state;
+    while (first->next != end) {
+      f = first->next;
+      first->next = f->next;
+      f->filter(cli, NULL, f->data);
+      free_z(f);
+    }
+  }
+}
+
+int cli_count_filter_init(struct cli_def *cli, int argc, UNUSED(char **argv), struct cli_filter *filt) {
+  if (argc > 1) {
+    cli_int_client_printf(cli, "Count filter does not take arguments\r\n");
+
+    return CLI_ERROR;
+  }
+
+  filt->filter = cli_count_filter;
+  filt->filter_line = cli_count_filter_line;
+  if (!(filt->data = calloc(sizeof(int), 1))) return CLI_ERROR;
+
+  return CLI_OK;
+}
+
+int cli_count_filter(struct cli_def *cli, const char *string, void *data) {
+  int *count = data;
+
+  if (!string) {
+    // Print count
+    cli_int_client_printf(cli, "%d\r\n", *count);
+
+    free(count);
+    return CLI_OK;
+  }
+
+  return cli_count_filter_line(cli, string, strlen(string), data);
+}
 
-    *++end = 0;
-    if (strcasecmp(cmd, "quit") == 0) break;
+int cli_count_filter_line(UNUSED(struct cli_def *cli), const char *line, size_t len, void *data) {
+  int *count = data;
+  const char *end = line + len;
 
-    if (cli_run_command(cli, cmd) == CLI_QUIT) break;
-  }
+  while (line < end && isspace((unsigned char)*line)) line++;
 
-  cli_set_privilege(cli, oldpriv);
-  cli_set_configmode(cli, oldmode, NULL);
+  // Only count non-blank lines
+  if (line < end) (*count)++;
 
-  return CLI_OK;
+  return CLI_ERROR;
 }
 
-static void _print(struct cli_def *cli, int print_mode, const char *format, va_list ap) {
-  int n;
-  char *p = NULL;
+/*
+ * Once the filters on a command line are set up (and any include and exclude runs fused) they are compiled into one,
+ * which runs the built in filters by calling them directly rather than going through the list for each line.  A count
+ * takes every line it sees, so nothing after one is run.  Case insensitive searches don't share a lower case copy of
+ * the line, as they fold a block at a time as they go for less than making the copy costs.
+ *
+ * With filter threads (see cli_set_filter_threads()) the include, exclude, grep and egrep filters at the front of a
+ * program can be run over a big block of output a chunk at a time, each thread with its own copy of any regex.  The
+ * rest of the program then sees the lines they let through in order on the session thread, just as it would have.
+ */
+enum cli_filter_step_kind {
+  CLI_STEP_CALL,    // Some other filter, called through its pointers
+  CLI_STEP_MATCH,   // include, exclude, grep or egrep
+  CLI_STEP_MULTI,   // include-any, exclude-any or fused include and exclude filters
+  CLI_STEP_RANGE,   // begin or between
+  CLI_STEP_COUNT,
+};
 
-  if (!cli) return;
+struct cli_filter_step {
+  enum cli_filter_step_kind kind;
+  struct cli_filter *filt;
+  void *data;  // The filter's, or a filter thread's copy of it
+};
 
-  n = vasprintf(&p, format, ap);
-  if (n < 0) return;
-  if (cli->buffer) {
-    int len = strlen(cli->buffer);
-    unsigned size = len + n + 1;
+struct cli_filter_program {
+  struct cli_filter *filters;  // Those compiled, kept to finish them off in order
+  int num_steps;
+  int parallel;                        // Steps at the front which can be run on the filter threads
+  int lanes;                           // Threads the program can be run on at once, including the session thread
+  struct cli_filter_step *lane_steps;  // Copies of the parallel steps for each filter thread
+  struct cli_filter_step steps[];
+};
 
-    if (size > cli->buf_size) {
-      char *buf = realloc(cli->buffer, size);
-      if (!buf) return;
-      cli->buffer = buf;
-      cli->buf_size = size;
-    }
+static int cli_int_program_run(struct cli_def *cli, const struct cli_filter_step *steps, int num, const char *line,
+                               size_t len) {
+  int i, rc = CLI_OK;
 
-    memcpy(cli->buffer + len, p, n);
-    free(p);
-    *(cli->buffer + len + n) = 0;
-    p = cli->buffer;
-  }
-  cli->buffer = p;
-  do {
-    char *next = strchr(p, '\n');
-    struct cli_filter *f = (print_mode & PRINT_FILTERED) ? cli->filters : 0;
-    int print = 1;
+  for (i = 0; i < num && rc == CLI_OK; i++) {
+    const struct cli_filter_step *step = &steps[i];
+    struct cli_filter *filt = step->filt;
 
-    if (next)
-      *next++ = 0;
-    else if (print_mode & PRINT_BUFFERED)
-      break;
+    switch (step->kind) {
+      case CLI_STEP_MATCH:
+        rc = cli_match_filter_line(cli, line, len, step->data);
+        break;
 
-    while (print && f) {
-      print = (f->filter(cli, p, f->data) == CLI_OK);
-      f = f->next;
-    }
-    if (print) {
-      if (cli->print_callback)
-        cli->print_callback(cli, p);
-      else if (cli->client)
-        fprintf(cli->client, "%s\r\n", p);
-    }
+      case CLI_STEP_MULTI:
+        rc = cli_multi_filter_line(cli, line, len, step->data);
+        break;
 
-    p = next;
-  } while (p);
+      case CLI_STEP_RANGE:
+        rc = cli_range_filter_line(cli, line, len, step->data);
+        break;
 
-  if (p && *p) {
-    if (p != cli->buffer) memmove(cli->buffer, p, strlen(p) + 1);
-  } else
-    *cli->buffer = 0;
+      case CLI_STEP_COUNT:
+        rc = cli_count_filter_line(cli, line, len, step->data);
+        break;
+
+      default:
+        rc = filt->filter_line ? filt->filter_line(cli, line, len, step->data) : filt->filter(cli, line, step->data);
+        break;
+    }
+  }
+  return rc;
 }
 
-void cli_bufprint(struct cli_def *cli, const char *format, ...) {
-  va_list ap;
+int cli_program_filter_line(struct cli_def *cli, const char *line, size_t len, void *data) {
+  struct cli_filter_program *program = data;
 
-  va_start(ap, format);
-  _print(cli, PRINT_BUFFERED | PRINT_FILTERED, format, ap);
-  va_end(ap);
+  return cli_int_program_run(cli, program->steps, program->num_steps, line, len);
 }
 
-void cli_vabufprint(struct cli_def *cli, const char *format, va_list ap) {
-  _print(cli, PRINT_BUFFERED, format, ap);
-}
+// Free the filter threads' copies of a program's steps
+static void cli_int_program_lanes_free(struct cli_def *cli, struct cli_filter_program *program) {
+  int i;
 
-void cli_print(struct cli_def *cli, const char *format, ...) {
-  va_list ap;
+  for (i = 0; i < (program->lanes - 1) * program->parallel; i++) {
+    struct cli_filter_step *step = &program->lane_steps[i];
 
-  va_start(ap, format);
-  _print(cli, PRINT_FILTERED, format, ap);
-  va_end(ap);
+    if (!step->filt) break;
+    if (step->data != step->filt->data) cli_match_filter(cli, NULL, step->data);
+  }
+  free_z(program->lane_steps);
+  program->lanes = 1;
+  program->parallel = 0;
 }
 
-void cli_error(struct cli_def *cli, const char *format, ...) {
-  va_list ap;
+#ifdef CLI_USE_THREADS
+/*
+ * Output is only worth handing to the filter threads in blocks of several hundred KB, which are cut at line breaks
+ * into a few chunks for each thread so one slow chunk doesn't hold up the rest.  The session thread takes chunks as
+ * well, and then goes through them in order running the rest of the program and printing.
+ */
+#define CLI_FILTER_PARALLEL_MIN (256 * 1024)
+#define CLI_FILTER_CHUNK_MIN (32 * 1024)
+#define CLI_FILTER_CHUNKS_PER_LANE 4
 
-  va_start(ap, format);
-  _print(cli, PRINT_PLAIN, format, ap);
-  va_end(ap);
-}
+struct cli_filter_kept {
+  const char *line;
+  size_t len;
+};
 
-struct cli_match_filter_state {
-  int flags;
-  union {
-    char *string;
-    regex_t re;
-  } match;
+struct cli_filter_chunk {
+  char *start;
+  char *end;   // Just past the newline ending the last line
+  char *stop;  // Where the chunk was given up on for want of memory, end if it wasn't
+  struct cli_filter_kept *kept;  // Lines let through by the parallel steps
+  size_t num_kept, max_kept;
 };
 
-int cli_search_flags_validator(struct cli_def *cli, const char *word, const char *value) {
-  // Valid search flags starts with a hyphen, then any number of i, v, or e characters.
+struct cli_filter_batch {
+  struct cli_def *cli;
+  struct cli_filter_program *program;
+  struct cli_filter_chunk *chunks;
+  int num_chunks;
+  int next_chunk;  // The next one to be picked up
+  int finished;
+};
 
-  if ((*value++ == '-') && (*value) && (strspn(value, "vie") == strlen(value))) return CLI_OK;
-  return CLI_ERROR;
-}
+struct cli_filter_worker {
+  pthread_t thread;
+  struct cli_filter_pool *pool;
+  int lane;
+};
 
-int cli_match_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt) {
-  struct cli_match_filter_state *state;
-  char *search_pattern = cli_get_optarg_value(cli, "search_pattern", NULL);
-  char *search_flags = cli_get_optarg_value(cli, "search_flags", NULL);
+struct cli_filter_pool {
+  int threads;
+  struct cli_filter_worker *workers;
+  pthread_mutex_t lock;  // Guards batch, its chunk counts and stopping
+  pthread_cond_t work;
+  pthread_cond_t done;  // The last chunk of the batch has been finished
+  struct cli_filter_batch *batch;
+  int stopping;
+};
 
-  filt->filter = cli_match_filter;
-  filt->data = state = calloc(sizeof(struct cli_match_filter_state), 1);
-  if (!state) return CLI_ERROR;
+// Give each filter thread its own copy of the steps it can run, which for a regex means its own compiled pattern
+static void cli_int_program_lanes(struct cli_def *cli, struct cli_filter_program *program) {
+  int lanes = cli->filter_pool->threads + 1;
+  int parallel, i;
 
-  if (!strcmp(cli->pipeline->current_stage->words[0], "include")) {
-    state->match.string = search_pattern;
-  } else if (!strcmp(cli->pipeline->current_stage->words[0], "exclude")) {
-    state->match.string = search_pattern;
-    state->flags = MATCH_INVERT;
-#ifndef WIN32
-  } else {
-    int rflags = REG_NOSUB;
-    if (!strcmp(cli->pipeline->current_stage->words[0], "grep")) {
-      state->flags = MATCH_REGEX;
-    } else if (!strcmp(cli->pipeline->current_stage->words[0], "egrep")) {
-      state->flags = MATCH_REGEX;
-      rflags |= REG_EXTENDED;
+  for (parallel = 0; parallel < program->num_steps; parallel++) {
+    enum cli_filter_step_kind kind = program->steps[parallel].kind;
+
+    if (kind != CLI_STEP_MATCH && kind != CLI_STEP_MULTI) break;
+  }
+  if (!parallel) return;
+  if (!(program->lane_steps = calloc((lanes - 1) * parallel, sizeof(struct cli_filter_step)))) return;
+  program->lanes = lanes;
+  program->parallel = parallel;
+
+  for (i = 0; i < (lanes - 1) * parallel; i++) {
+    struct cli_filter_step *step = &program->lane_steps[i];
+    struct cli_match_filter_state *state, *copy;
+
+    *step = program->steps[i % parallel];
+    state = step->data;
+    if (step->kind != CLI_STEP_MATCH || !(state->flags & MATCH_REGEX)) continue;
+
+    if (!(copy = calloc(sizeof(struct cli_match_filter_state), 1))) break;
+    copy->flags = state->flags;
+    copy->match.pattern = cli_int_pattern_get(cli, state->match.pattern->pattern, state->match.pattern->rflags);
+    if (!copy->match.pattern) {
+      free(copy);
+      break;
     }
-    if (search_flags) {
-      char *p = search_flags++;
-      while (*p) {
-        switch (*p++) {
-          case 'v':
-            state->flags |= MATCH_INVERT;
-            break;
+    step->data = copy;
+  }
 
-          case 'i':
-            rflags |= REG_ICASE;
-            break;
+  // Without a copy for every thread the program is only run on the session thread
+  if (i < (lanes - 1) * parallel) {
+    program->lane_steps[i].filt = NULL;
+    cli_int_program_lanes_free(cli, program);
+  }
+}
 
-          case 'e':
-            // Implies next term is search string, so stop processing flags
-            break;
-        }
-      }
+// Run the parallel steps of a program over a chunk of output, noting the lines they let through
+static void cli_int_filter_chunk(struct cli_filter_batch *batch, struct cli_filter_chunk *chunk, int lane) {
+  struct cli_filter_program *program = batch->program;
+  const struct cli_filter_step *steps = lane ? &program->lane_steps[(lane - 1) * program->parallel] : program->steps;
+  char *p = chunk->start;
+
+  while (p < chunk->end) {
+    char *next = memchr(p, '\n', chunk->end - p);
+    size_t len = next - p;
+
+    if (chunk->num_kept == chunk->max_kept) {
+      size_t max = chunk->max_kept ? chunk->max_kept * 2 : 256;
+      struct cli_filter_kept *kept = realloc(chunk->kept, max * sizeof(struct cli_filter_kept));
+
+      if (!kept) break;
+      chunk->kept = kept;
+      chunk->max_kept = max;
     }
-    if (regcomp(&state->match.re, search_pattern, rflags)) {
-      if (cli->client) fprintf(cli->client, "Invalid pattern \"%s\"\r\n", search_pattern);
-      return CLI_ERROR;
+
+    *next = 0;
+    if (cli_int_program_run(batch->cli, steps, program->parallel, p, len) == CLI_OK) {
+      chunk->kept[chunk->num_kept].line = p;
+      chunk->kept[chunk->num_kept++].len = len;
     }
+    p = next + 1;
   }
-#else
-  } else {
-    // No regex functions in windows, so return an error.
-    return CLI_ERROR;
-  }
-#endif
-
-  return CLI_OK;
+  chunk->stop = p;
 }
 
-int cli_match_filter(UNUSED(struct cli_def *cli), const char *string, void *data) {
-  struct cli_match_filter_state *state = data;
-  int r = CLI_ERROR;
+static void *cli_int_filter_worker(void *arg) {
+  struct cli_filter_worker *worker = arg;
+  struct cli_filter_pool *pool = worker->pool;
 
-  if (!string) {
-    if (state->flags & MATCH_REGEX) regfree(&state->match.re);
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stopping) {
+    struct cli_filter_batch *batch = pool->batch;
+    struct cli_filter_chunk *chunk;
 
-    free(state);
-    return CLI_OK;
+    if (!batch || batch->next_chunk == batch->num_chunks) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+      continue;
+    }
+    chunk = &batch->chunks[batch->next_chunk++];
+    pthread_mutex_unlock(&pool->lock);
+
+    cli_int_filter_chunk(batch, chunk, worker->lane);
+
+    pthread_mutex_lock(&pool->lock);
+    if (++batch->finished == batch->num_chunks) pthread_cond_signal(&pool->done);
   }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
 
-  if (state->flags & MATCH_REGEX) {
-    if (!regexec(&state->match.re, string, 0, NULL, 0)) r = CLI_OK;
-  } else {
-    if (strstr(string, state->match.string)) r = CLI_OK;
+/*
+ * Print the complete lines from 'p' with the help of the filter threads, if there are enough of them and the command
+ * line's filters can be run that way.  Returns where the caller should carry on printing from.
+ */
+static char *cli_int_print_parallel(struct cli_def *cli, char *p, char *end) {
+  struct cli_filter_pool *pool = cli->filter_pool;
+  struct cli_filter_program *program;
+  struct cli_filter_batch batch;
+  char *last;
+  size_t size, chunk_size;
+  int i, num;
+
+  if (end - p < CLI_FILTER_PARALLEL_MIN || !cli->filters || cli->filters->next) return p;
+  if (cli->filters->filter != cli_program_filter) return p;
+  program = cli->filters->data;
+  if (!program->parallel || program->lanes != pool->threads + 1) return p;
+  if (!(last = memrchr(p, '\n', end - p)) || ++last - p < CLI_FILTER_PARALLEL_MIN) return p;
+
+  size = last - p;
+  num = program->lanes * CLI_FILTER_CHUNKS_PER_LANE;
+  if ((chunk_size = size / num) < CLI_FILTER_CHUNK_MIN) {
+    chunk_size = CLI_FILTER_CHUNK_MIN;
+    num = (size + chunk_size - 1) / chunk_size;
   }
 
-  if (state->flags & MATCH_INVERT) {
-    if (r == CLI_OK)
-      r = CLI_ERROR;
+  memset(&batch, 0, sizeof(batch));
+  if (!(batch.chunks = calloc(num, sizeof(struct cli_filter_chunk)))) return p;
+  batch.cli = cli;
+  batch.program = program;
+  for (i = 0; i < num && p < last; i++) {
+    struct cli_filter_chunk *chunk = &batch.chunks[i];
+
+    chunk->start = p;
+    if (i < num - 1 && chunk_size < (size_t)(last - p))
+      p = (char *)memchr(p + chunk_size, '\n', last - p - chunk_size) + 1;
     else
-      r = CLI_OK;
+      p = last;
+    chunk->end = p;
+  }
+  batch.num_chunks = i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->batch = &batch;
+  pthread_cond_broadcast(&pool->work);
+  while (batch.next_chunk < batch.num_chunks) {
+    struct cli_filter_chunk *chunk = &batch.chunks[batch.next_chunk++];
+
+    pthread_mutex_unlock(&pool->lock);
+    cli_int_filter_chunk(&batch, chunk, 0);
+    pthread_mutex_lock(&pool->lock);
+    batch.finished++;
   }
+  while (batch.finished < batch.num_chunks) pthread_cond_wait(&pool->done, &pool->lock);
+  pool->batch = NULL;
+  pthread_mutex_unlock(&pool->lock);
 
-  return r;
-}
+  for (i = 0; i < batch.num_chunks; i++) {
+    struct cli_filter_chunk *chunk = &batch.chunks[i];
+    size_t n;
 
-struct cli_range_filter_state {
-  int matched;
-  char *from;
-  char *to;
-};
+    for (n = 0; n < chunk->num_kept; n++) {
+      struct cli_filter_kept *kept = &chunk->kept[n];
 
-int cli_range_filter_init(struct cli_def *cli, int argc, char **argv, struct cli_filter *filt) {
-  struct cli_range_filter_state *state;
-  char *from = cli_get_optarg_value(cli, "range_start", NULL);
-  char *to = cli_get_optarg_value(cli, "range_end", NULL);
+      if (cli_int_program_run(cli, program->steps + program->parallel, program->num_steps - program->parallel,
+                              kept->line, kept->len) == CLI_OK)
+        cli_int_output_line(cli, kept->line, kept->len);
+    }
 
-  // Do not have to check from/to since we would not have gotten here if we were missing a required argument.
-  // Note that since those pointers are not NULL, we don't have to strdup them or free them - just use the pointer
-  //    from the command line processing and continue
+    // Whatever a thread couldn't keep track of is filtered here instead
+    for (p = chunk->stop; p < chunk->end; p++) {
+      char *next = memchr(p, '\n', chunk->end - p);
 
-  filt->filter = cli_range_filter;
-  filt->data = state = calloc(sizeof(struct cli_range_filter_state), 1);
-  if (state) {
-    state->from = from;
-    state->to = to;
-    return CLI_OK;
-  } else {
-    return CLI_ERROR;
+      *next = 0;
+      cli_int_print_line(cli, PRINT_FILTERED, p, next - p);
+      p = next;
+    }
+    free(chunk->kept);
   }
+  free(batch.chunks);
+  return last;
 }
+#endif
 
-int cli_range_filter(UNUSED(struct cli_def *cli), const char *string, void *data) {
-  struct cli_range_filter_state *state = data;
-  int r = CLI_ERROR;
+int cli_program_filter(struct cli_def *cli, const char *string, void *data) {
+  struct cli_filter_program *program = data;
 
-  if (!string) {
-    free_z(state);
-    return CLI_OK;
-  }
+  if (string) return cli_program_filter_line(cli, string, strlen(string), data);
 
-  if (!state->matched) state->matched = !!strstr(string, state->from);
+  // Finish off the filters compiled in, in the order they were on the command line (a count prints here)
+  cli_int_program_lanes_free(cli, program);
+  while (program->filters) {
+    struct cli_filter *filt = program->filters;
 
-  if (state->matched) {
-    r = CLI_OK;
-    if (state->to && strstr(string, state->to)) state->matched = 0;
+    program->filters = filt->next;
+    if (filt->filter) filt->filter(cli, NULL, filt->data);
+    free_z(filt);
   }
-
-  return r;
+  free(program);
+  return CLI_OK;
 }
 
-int cli_count_filter_init(struct cli_def *cli, int argc, UNUSED(char **argv), struct cli_filter *filt) {
-  if (argc > 1) {
-    if (cli->client) fprintf(cli->client, "Count filter does not take arguments\r\n");
+/*
+ * Compile the filters of the command line into one, leaving them as they are if out of memory or if there's just one
+ * which won't be run on filter threads.
+ */
+void cli_int_compile_filters(struct cli_def *cli) {
+  struct cli_filter_program *program;
+  struct cli_filter *filt, *compiled;
+  int num = 0;
 
-    return CLI_ERROR;
+  for (filt = cli->filters; filt; filt = filt->next) num++;
+  if (!num || (num == 1 && !cli->filter_pool)) return;
+
+  if (!(compiled = calloc(sizeof(struct cli_filter), 1))) return;
+  if (!(program = calloc(sizeof(struct cli_filter_program) + num * sizeof(struct cli_filter_step), 1))) {
+    free(compiled);
+    return;
   }
 
-  filt->filter = cli_count_filter;
-  if (!(filt->data = calloc(sizeof(int), 1))) return CLI_ERROR;
+  for (filt = cli->filters; filt; filt = filt->next) {
+    struct cli_filter_step *step = &program->steps[program->num_steps++];
+
+    step->filt = filt;
+    step->data = filt->data;
+    if (filt->filter == cli_match_filter) {
+      step->kind = CLI_STEP_MATCH;
+    } else if (filt->filter == cli_multi_filter) {
+      step->kind = CLI_STEP_MULTI;
+    } else if (filt->filter == cli_range_filter) {
+      step->kind = CLI_STEP_RANGE;
+    } else if (filt->filter == cli_count_filter) {
+      step->kind = CLI_STEP_COUNT;
+      break;
+    } else {
+      step->kind = CLI_STEP_CALL;
+    }
+  }
 
-  return CLI_OK;
+  program->lanes = 1;
+#ifdef CLI_USE_THREADS
+  if (cli->filter_pool) cli_int_program_lanes(cli, program);
+#endif
+  program->filters = cli->filters;
+  compiled->filter = cli_program_filter;
+  compiled->filter_line = cli_program_filter_line;
+  compiled->data = program;
+  cli->filters = compiled;
 }
 
-int cli_count_filter(struct cli_def *cli, const char *string, void *data) {
-  int *count = data;
-
-  if (!string) {
-    // Print count
-    if (cli->client) fprintf(cli->client, "%d\r\n", *count);
+#ifdef CLI_USE_THREADS
+static void cli_int_filter_pool_free(struct cli_filter_pool *pool) {
+  int i;
 
-    free(count);
-    return CLI_OK;
-  }
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->threads; i++) pthread_join(pool->workers[i].thread, NULL);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
+#endif
 
-  while (isspace(*string)) string++;
+int cli_set_filter_threads(struct cli_def *cli, int threads) {
+#ifdef CLI_USE_THREADS
+  struct cli_filter_pool *pool;
 
-  // Only count non-blank lines
-  if (*string) (*count)++;
+  if (!cli || threads < 0) return CLI_ERROR;
+  if (cli->filter_pool) cli_int_filter_pool_free(cli->filter_pool);
+  cli->filter_pool = NULL;
+  if (!threads) return CLI_OK;
 
-  return CLI_ERROR;
+  if (!(pool = calloc(sizeof(struct cli_filter_pool), 1))) return CLI_ERROR;
+  if (!(pool->workers = calloc(threads, sizeof(struct cli_filter_worker)))) {
+    free(pool);
+    return CLI_ERROR;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (; pool->threads < threads; pool->threads++) {
+    struct cli_filter_worker *worker = &pool->workers[pool->threads];
+
+    worker->pool = pool;
+    worker->lane = pool->threads + 1;
+    if (pthread_create(&worker->thread, NULL, cli_int_filter_worker, worker)) {
+      cli_int_filter_pool_free(pool);
+      return CLI_ERROR;
+    }
+  }
+  cli->filter_pool = pool;
+  return CLI_OK;
+#else
+  return cli && !threads ? CLI_OK : CLI_ERROR;
+#endif
 }
 
 void cli_print_callback(struct cli_def *cli, void (*callback)(struct cli_def *, const char *)) {
@@ -2164,7 +6023,10 @@ struct cli_command *cli_register_filter(struct cli_def *cli, const char *command
   }
 
   // Filters are all registered at the top level.
-  return cli_register_command_core(cli, NULL, c);
+  cli_int_tree_write(CLI_FILTER_COMMAND);
+  c = cli_register_command_core(cli, NULL, c);
+  cli_int_tree_written(CLI_FILTER_COMMAND);
+  return c;
 }
 
 int cli_unregister_filter(struct cli_def *cli, const char *command) {
@@ -2221,6 +6083,8 @@ static void cli_optarg_build_shortest(struct cli_optarg *optarg) {
 }
 
 void cli_free_optarg(struct cli_optarg *optarg) {
+  // Optargs from cli_register_static_commands() are released along with their table
+  if (optarg->flags & CLI_CMD_STATIC) return;
   free_z(optarg->help);
   free_z(optarg->name);
   free_z(optarg);
@@ -2230,7 +6094,8 @@ int cli_optarg_addhelp(struct cli_optarg *optarg, const char *helpname, const ch
   char *tstr;
 
   // put a vertical tab (\v), the new helpname, a horizontal tab (\t), and then the new help text
-  if ((!optarg) || (asprintf(&tstr, "%s\v%s\t%s", optarg->help, helpname, helptext) == -1)) {
+  if ((!optarg) || (optarg->flags & CLI_CMD_STATIC) ||
+      (asprintf(&tstr, "%s\v%s\t%s", optarg->help, helpname, helptext) == -1)) {
     return CLI_ERROR;
   } else {
     free(optarg->help);
@@ -2250,6 +6115,7 @@ struct cli_optarg *cli_register_optarg(struct cli_command *cmd, const char *name
   struct cli_optarg *ptr = NULL;
   int retval = CLI_ERROR;
 
+  cli_int_tree_write(cmd->command_type);
   // Name must not already exist with this priv/mode
   for (ptr = cmd->optargs, lastopt = NULL; ptr; lastopt = ptr, ptr = ptr->next) {
     if (!strcmp(name, ptr->name) && ptr->mode == mode && ptr->privilege == privilege) {
@@ -2275,46 +6141,62 @@ struct cli_optarg *cli_register_optarg(struct cli_command *cmd, const char *name
   retval = CLI_OK;
 
 CLEANUP:
+  cli_int_tree_written(cmd->command_type);
   if (retval != CLI_OK) {
-    cli_free_optarg(optarg);
+    if (optarg) cli_free_optarg(optarg);
     optarg = NULL;
   }
   return optarg;
 }
 
+// Free an optarg taken off a command, waiting for any session which might be looking at it unless it's buildmode's
+static void cli_int_retire_optarg(struct cli_command *cmd, struct cli_optarg *optarg) {
+  if (optarg->flags & CLI_CMD_STATIC) return;
+  if (cmd->command_type == CLI_BUILDMODE_COMMAND)
+    cli_free_optarg(optarg);
+  else
+    cli_int_retire(NULL, NULL, optarg);
+}
+
 int cli_unregister_optarg(struct cli_command *cmd, const char *name) {
   struct cli_optarg *ptr;
   struct cli_optarg *lastptr;
   int retval = CLI_ERROR;
+
+  cli_int_tree_write(cmd->command_type);
   // Iterate looking for this option name, stopping at end or if name matches
   for (lastptr = NULL, ptr = cmd->optargs; ptr && strcmp(ptr->name, name); lastptr = ptr, ptr = ptr->next)
     ;
 
   // If ptr, then we found the optarg to delete
   if (ptr) {
+    // A session still walking the list from here carries on past it, so ptr->next is left alone
     if (lastptr) {
       // Not first optarg
       lastptr->next = ptr->next;
-      ptr->next = NULL;
     } else {
       // First optarg
       cmd->optargs = ptr->next;
-      ptr->next = NULL;
     }
-    cli_free_optarg(ptr);
+    cli_int_retire_optarg(cmd, ptr);
     cli_optarg_build_shortest(cmd->optargs);
     retval = CLI_OK;
   }
+  cli_int_tree_written(cmd->command_type);
   return retval;
 }
 
 void cli_unregister_all_optarg(struct cli_command *c) {
   struct cli_optarg *o, *p;
 
-  for (o = c->optargs; o; o = p) {
+  cli_int_tree_write(c->command_type);
+  o = c->optargs;
+  c->optargs = NULL;
+  for (; o; o = p) {
     p = o->next;
-    cli_free_optarg(o);
+    cli_int_retire_optarg(c, o);
   }
+  cli_int_tree_written(c->command_type);
 }
 
 void cli_int_unset_optarg_value(struct cli_def *cli, const char *name) {
@@ -2333,9 +6215,14 @@ void cli_int_unset_optarg_value(struct cli_def *cli, const char *name) {
   }
 }
 
+/*
+ * Buildmode's optargs are kept from one command to the next, so are allocated as usual.  Any others only last as long
+ * as the command line they were found on and come from the arena along with it.
+ */
 int cli_set_optarg_value(struct cli_def *cli, const char *name, const char *value, int allow_multiple) {
   struct cli_optarg_pair *optarg_pair, **anchor;
-  int rc = CLI_ERROR;
+  int keep = cli->buildmode != NULL;
+  char *copy;
 
   for (optarg_pair = cli->found_optargs, anchor = &cli->found_optargs; optarg_pair;
        anchor = &optarg_pair->next, optarg_pair = optarg_pair->next) {
@@ -2344,23 +6231,29 @@ int cli_set_optarg_value(struct cli_def *cli, const char *name, const char *valu
       break;
     }
   }
+
+  if (!(copy = keep ? strdup(value) : cli_int_arena_strdup(cli, value))) return CLI_ERROR;
+
   // If we *didn't* find this, then allocate a new entry before proceeding
   if (!optarg_pair) {
-    optarg_pair = (struct cli_optarg_pair *)calloc(1, sizeof(struct cli_optarg_pair));
+    if (keep) {
+      if ((optarg_pair = (struct cli_optarg_pair *)calloc(1, sizeof(struct cli_optarg_pair))) &&
+          !(optarg_pair->name = strdup(name)))
+        free_z(optarg_pair);
+    } else if ((optarg_pair = cli_int_arena_alloc(cli, sizeof(struct cli_optarg_pair)))) {
+      optarg_pair->name = cli_int_arena_strdup(cli, name);
+    }
+    if (!optarg_pair || !optarg_pair->name) {
+      if (keep) free(copy);
+      return CLI_ERROR;
+    }
     *anchor = optarg_pair;
   }
-  // Set the value
-  if (optarg_pair) {
-    // Name is null only if we didn't find it
-    if (!optarg_pair->name) optarg_pair->name = strdup(name);
 
-    // Value may be overwritten, so free any old value.
-    if (optarg_pair->value) free_z(optarg_pair->value);
-    optarg_pair->value = strdup(value);
-
-    rc = CLI_OK;
-  }
-  return rc;
+  // Value may be overwritten, so free any old value.
+  if (keep && optarg_pair->value) free(optarg_pair->value);
+  optarg_pair->value = copy;
+  return CLI_OK;
 }
 
 struct cli_optarg_pair *cli_get_all_found_optargs(struct cli_def *cli) {
@@ -2389,11 +6282,13 @@ char *cli_get_optarg_value(struct cli_def *cli, const char *name, char *find_aft
 
 void cli_int_free_buildmode(struct cli_def *cli) {
   if (!cli || !cli->buildmode) return;
-  cli_unregister_tree(cli, cli->commands, CLI_BUILDMODE_COMMAND);
+  cli_unregister_tree(cli, cli->buildmode->commands, CLI_BUILDMODE_COMMAND);
+  cli_int_index_free(&cli->buildmode->index);
   cli->mode = cli->buildmode->mode;
   free_z(cli->buildmode->mode_text);
   cli_int_free_found_optargs(&cli->buildmode->found_optargs);
   free_z(cli->buildmode);
+  cli_int_unpin(cli);
 }
 
 int cli_int_enter_buildmode(struct cli_def *cli, struct cli_pipeline_stage *stage, char *mode_text) {
@@ -2402,6 +6297,7 @@ int cli_int_enter_buildmode(struct cli_def *cli, struct cli_pipeline_stage *stag
   struct cli_optarg *o;
   struct cli_buildmode *buildmode;
   struct cli_optarg *buildmodeOptarg = NULL;
+  struct cli_optarg_pair *found, *pair;
   int rc = CLI_BUILDMODE_START;
 
   if (!(buildmode = (struct cli_buildmode *)calloc(1, sizeof(struct cli_buildmode)))) {
@@ -2415,6 +6311,8 @@ int cli_int_enter_buildmode(struct cli_def *cli, struct cli_pipeline_stage *stag
 
   // Assign it so cli_int_register_buildmode_command() has something to work with
   cli->buildmode = buildmode;
+  // The command stays in use until buildmode is left
+  cli_int_pin(cli);
   cli->buildmode->mode = cli->mode;
   cli->buildmode->transient_mode = cli->transient_mode;
   if (mode_text) cli->buildmode->mode_text = strdup(mode_text);
@@ -2504,6 +6402,18 @@ int cli_int_enter_buildmode(struct cli_def *cli, struct cli_pipeline_stage *stag
     goto out;
   }
 
+  // The optargs found so far were only to last as long as the command line, but buildmode carries on with them
+  found = cli->found_optargs;
+  cli->found_optargs = NULL;
+  for (pair = found; pair; pair = pair->next) {
+    if (cli_set_optarg_value(cli, pair->name, pair->value, CLI_CMD_OPTION_MULTIPLE) != CLI_OK) {
+      cli_int_free_found_optargs(&cli->found_optargs);
+      cli->found_optargs = found;
+      rc = CLI_BUILDMODE_ERROR;
+      goto out;
+    }
+  }
+
 out:
   // And lastly set the initial help menu for the unset command
   cli_int_buildmode_reset_unset_help(cli);
@@ -2657,8 +6567,10 @@ char *cli_int_buildmode_extend_cmdline(char *cmdline, char *word) {
 void cli_int_buildmode_reset_unset_help(struct cli_def *cli) {
   struct cli_command *cmd;
 
+  if (!cli->buildmode) return;
+
   // find the buildmode unset command
-  for (cmd = cli->commands; cmd; cmd = cmd->next) {
+  for (cmd = cli->buildmode->commands; cmd; cmd = cmd->next) {
     if ((cmd->command_type == CLI_BUILDMODE_COMMAND) && !strcmp(cmd->command, "unset")) break;
   }
 
@@ -2678,7 +6590,7 @@ void cli_int_buildmode_reset_unset_help(struct cli_def *cli) {
 
       for (optarg_pair = cli->found_optargs; optarg_pair; optarg_pair = optarg_pair->next) {
         // Only show vars that are also current 'commands'
-        struct cli_command *c = cli->commands;
+        struct cli_command *c = cli->buildmode->commands;
         for (; c; c = c->next) {
           if (c->command_type != CLI_BUILDMODE_COMMAND) continue;
           if (!strcmp(c->command, optarg_pair->name)) {
@@ -2763,7 +6675,7 @@ int cli_int_buildmode_show_cback(struct cli_def *cli, const char *command, char
 
   for (optarg_pair = cli->found_optargs; optarg_pair; optarg_pair = optarg_pair->next) {
     // Only show vars that are also current 'commands'
-    struct cli_command *c = cli->commands;
+    struct cli_command *c = cli->buildmode->commands;
     for (; c; c = c->next) {
       if (c->command_type != CLI_BUILDMODE_COMMAND) continue;
       if (!strcmp(c->command, optarg_pair->name)) {
@@ -2785,7 +6697,7 @@ int cli_int_buildmode_unset_cback(struct cli_def *cli, const char *command, char
     return CLI_ERROR;
   }
   // Is this 'optarg' to remove one of the current commands?
-  for (c = cli->commands; c; c = c->next) {
+  for (c = cli->buildmode->commands; c; c = c->next) {
     if (c->command_type != CLI_BUILDMODE_COMMAND) continue;
     if (cli->privilege < c->privilege) continue;
     if ((cli->buildmode->mode != c->mode) && (cli->buildmode->transient_mode != c->mode) && (c->mode != MODE_ANY))
@@ -2808,7 +6720,7 @@ int cli_int_buildmode_unset_completor(struct cli_def *cli, const char *name, con
 
   for (optarg_pair = cli->found_optargs; optarg_pair; optarg_pair = optarg_pair->next) {
     // Only complete vars that could be set by current 'commands'
-    struct cli_command *c = cli->commands;
+    struct cli_command *c = cli->buildmode->commands;
     for (; c; c = c->next) {
       if (c->command_type != CLI_BUILDMODE_COMMAND) continue;
       if ((!strcmp(c->command, optarg_pair->name)) && (!word || !strncmp(word, optarg_pair->name, strlen(word)))) {
@@ -2828,7 +6740,7 @@ int cli_int_buildmode_unset_validator(struct cli_def *cli, const char *name, con
   }
   for (optarg_pair = cli->found_optargs; optarg_pair; optarg_pair = optarg_pair->next) {
     // Only complete vars that could be set by current 'commands'
-    struct cli_command *c = cli->commands;
+    struct cli_command *c = cli->buildmode->commands;
     for (; c; c = c->next) {
       if (c->command_type != CLI_BUILDMODE_COMMAND) continue;
       if (!strcmp(c->command, optarg_pair->name) && value && !strcmp(optarg_pair->name, value)) {
@@ -2869,17 +6781,20 @@ void cli_free_comphelp(struct cli_comphelp *comphelp) {
   }
 }
 
-static int cli_int_locate_command(struct cli_def *cli, struct cli_command *commands, int command_type, int start_word,
+// Find the command for the words of 'stage' from 'start_word' on, among the children of 'parent' (NULL for the top)
+static int cli_int_locate_command(struct cli_def *cli, struct cli_command *parent, int command_type, int start_word,
                                   struct cli_pipeline_stage *stage) {
   struct cli_command *c, *again_config = NULL, *again_any = NULL;
+  struct cli_command **match;
+  size_t n;
   int c_words = stage->num_words;
 
-  for (c = commands; c; c = c->next) {
-    if (c->command_type != command_type) continue;
+  // Only the commands starting with the word need to be looked at
+  for (n = cli_int_index_match(cli, parent, command_type, stage->words[start_word], &match); n; n--, match++) {
+    c = *match;
     if (cli->privilege < c->privilege) continue;
 
-    if (strncasecmp(c->command, stage->words[start_word], c->unique_len)) continue;
-    if (strncasecmp(c->command, stage->words[start_word], strlen(stage->words[start_word]))) continue;
+    if (strncasecmp(c->command, stage->words[start_word], cli_int_unique_len(cli, parent, match))) continue;
 
   AGAIN:
     if (c->mode == cli->mode || (c->mode == MODE_ANY && again_any != NULL)) {
@@ -2899,7 +6814,7 @@ static int cli_int_locate_command(struct cli_def *cli, struct cli_command *comma
           cli_error(cli, "Incomplete command");
           return CLI_ERROR;
         }
-        rc = cli_int_locate_command(cli, c->children, command_type, start_word + 1, stage);
+        rc = cli_int_locate_command(cli, c, command_type, start_word + 1, stage);
         if (rc == CLI_ERROR_ARG) {
           if (c->callback) {
             rc = CLI_OK;
@@ -2988,7 +6903,9 @@ int cli_int_validate_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline
       cli->found_optargs = cli->buildmode->found_optargs;
     else
       cli->found_optargs = NULL;
-    rc = cli_int_locate_command(cli, cli->commands, command_type, 0, &pipeline->stage[i]);
+    cli_int_tree_read();
+    rc = cli_int_locate_command(cli, NULL, command_type, 0, &pipeline->stage[i]);
+    cli_int_tree_unlock();
 
     // And save our found optargs for later use
     if (cli->buildmode)
@@ -3003,13 +6920,9 @@ int cli_int_validate_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline
   return rc;
 }
 
-void cli_int_free_pipeline(struct cli_pipeline *pipeline) {
-  int i;
-  if (!pipeline) return;
-  for (i = 0; i < pipeline->num_stages; i++) cli_int_free_found_optargs(&pipeline->stage[i].found_optargs);
-  for (i = 0; i < pipeline->num_words; i++) free_z(pipeline->words[i]);
-  free_z(pipeline->cmdline);
-  free_z(pipeline);
+void cli_int_free_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline) {
+  // Everything belonging to the command line was allocated after the pipeline itself
+  if (pipeline) cli_int_arena_release(cli, pipeline);
 }
 
 void cli_int_show_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline) {
@@ -3046,16 +6959,36 @@ struct cli_pipeline *cli_int_generate_pipeline(struct cli_def *cli, const char *
   struct cli_pipeline_stage *stage;
   char **word;
   struct cli_pipeline *pipeline = NULL;
+  char *words[CLI_MAX_LINE_WORDS];
+  char *line;
 
   cli->found_optargs = NULL;
   if (cli->buildmode) cli->found_optargs = cli->buildmode->found_optargs;
   if (!command) return NULL;
   while (*command && isspace(*command)) command++;
 
-  if (!(pipeline = (struct cli_pipeline *)calloc(1, sizeof(struct cli_pipeline)))) return NULL;
-  pipeline->cmdline = (char *)strdup(command);
-
-  pipeline->num_words = cli_parse_line(command, pipeline->words, CLI_MAX_LINE_WORDS);
+  // The pipeline comes first, cli_int_free_pipeline() releases everything from there on
+  if (!(pipeline = cli_int_arena_alloc(cli, sizeof(struct cli_pipeline)))) return NULL;
+  pipeline->cmdline = cli_int_arena_strdup(cli, command);
+  // The words are cut out of a copy of the line, cmdline is kept as it was
+  if (!pipeline->cmdline || !(line = cli_int_arena_strdup(cli, command))) {
+    cli_int_free_pipeline(cli, pipeline);
+    return NULL;
+  }
+  pipeline->num_words = cli_parse_line(line, words, CLI_MAX_LINE_WORDS);
+
+  // Only as many words and stages as the line has, with a NULL after the last word as parsing optargs expects
+  pipeline->num_stages = 1;
+  for (i = 0; i < pipeline->num_words; i++)
+    if (*words[i] == '|') pipeline->num_stages++;
+  pipeline->words = cli_int_arena_alloc(cli, (pipeline->num_words + 1) * sizeof(char *));
+  pipeline->stage = cli_int_arena_alloc(cli, pipeline->num_stages * sizeof(struct cli_pipeline_stage));
+  if (!pipeline->words || !pipeline->stage) {
+    cli_int_free_pipeline(cli, pipeline);
+    return NULL;
+  }
+  memcpy(pipeline->words, words, pipeline->num_words * sizeof(char *));
+  pipeline->num_stages = 0;
 
   pipeline->stage[0].num_words = 0;
   stage = &pipeline->stage[0];
@@ -3065,7 +6998,7 @@ struct cli_pipeline *cli_int_generate_pipeline(struct cli_def *cli, const char *
     if (*word[0] == '|') {
       if (cli->buildmode) {
         // Can't allow filters in buildmode commands
-        cli_int_free_pipeline(pipeline);
+        cli_int_free_pipeline(cli, pipeline);
         cli_error(cli, "\nPipelines are not allowed in buildmode");
         return NULL;
       }
@@ -3104,6 +7037,10 @@ int cli_int_execute_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline)
     }
   }
   pipeline->current_stage = NULL;
+  if (rc == CLI_OK) {
+    cli_int_fuse_filters(cli);
+    cli_int_compile_filters(cli);
+  }
 
   // Did everything init?  If so, execute, otherwise skip execution
   if ((rc == CLI_OK) && pipeline->stage[0].command->callback) {
@@ -3121,16 +7058,33 @@ int cli_int_execute_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline)
     pipeline->current_stage = NULL;
   }
 
+  cli->found_optargs = NULL;
+  cli->pipeline = NULL;
+
+  if (cli->stream) {
+    if (rc != CLI_OK) {
+      cli_int_stream_free(cli);
+    } else if (cli->session) {
+      // The session drives the stream as the client takes the output, which needs the filters to stay
+      cli->stream->filters = cli->filters;
+      cli->filters = NULL;
+    } else {
+      while (cli->stream) cli_int_stream_run(cli);
+    }
+  }
+
   // Now teardown any filters
+  cli_int_free_filters(cli);
+  return rc;
+}
+
+void cli_int_free_filters(struct cli_def *cli) {
   while (cli->filters) {
     struct cli_filter *filt = cli->filters;
     if (filt->filter) filt->filter(cli, NULL, cli->filters->data);
     cli->filters = filt->next;
     free_z(filt);
   }
-  cli->found_optargs = NULL;
-  cli->pipeline = NULL;
-  return rc;
 }
 
 /*
@@ -3150,8 +7104,8 @@ int cli_int_execute_pipeline(struct cli_def *cli, struct cli_pipeline *pipeline)
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MAXWIDTHCOL1 22
 
-void cli_int_wrap_help_line(char *nameptr, char *helpptr, struct cli_comphelp *comphelp) {
-  int maxwidth = 80;  // temporary assumption, to be fixed later when libcli 'understands' screen dimensions
+void cli_int_wrap_help_line(struct cli_def *cli, char *nameptr, char *helpptr, struct cli_comphelp *comphelp) {
+  int maxwidth = MAX(cli_int_term_width(cli), MAXWIDTHCOL1 + 10);
   int availwidth;
   int namewidth;
   int toprint;
@@ -3310,7 +7264,7 @@ static void cli_get_optarg_comphelp(struct cli_def *cli, struct cli_optarg *opta
       if (asprintf(&tname, "%s%s%s", delim_start, nameptr, delim_end) == -1) break;
       if (asprintf(&leftcolumn, "%*.*s%s", indent, indent, "", tname) == -1) break;
 
-      cli_int_wrap_help_line(leftcolumn, helpptr, comphelp);
+      cli_int_wrap_help_line(cli, leftcolumn, helpptr, comphelp);
 
       // clear out any delimiter settings and set indent for any subtext
       delim_start = DELIM_NONE;
@@ -3340,6 +7294,17 @@ static void cli_get_optarg_comphelp(struct cli_def *cli, struct cli_optarg *opta
   }
 }
 
+/*
+ * The built in filters' search flags are never taken from an abbreviation of their name (so 'include se' looks for
+ * "se"), are only given once, and only take a word which is a valid set of flags.  Anything else starting with '-' is
+ * left for the pattern, so 'include -100' looks for "-100" and 'include -v -e' for "-e".  The word being completed
+ * is always offered the flags.
+ */
+static int cli_int_search_flags_word(struct cli_def *cli, struct cli_optarg *optarg, const char *word, int completing) {
+  if (cli_find_optarg_value(cli, optarg->name, NULL)) return 0;
+  return completing || cli_search_flags_validator(cli, optarg->name, word) == CLI_OK;
+}
+
 static void cli_int_parse_optargs(struct cli_def *cli, struct cli_pipeline_stage *stage, struct cli_command *cmd,
                                   char lastchar, struct cli_comphelp *comphelp) {
   struct cli_optarg *optarg = NULL, *oaptr = NULL;
@@ -3406,12 +7371,16 @@ static void cli_int_parse_optargs(struct cli_def *cli, struct cli_pipeline_stage
           goto done;
         }
       } else if (stage->words[word_idx] && stage->words[word_idx][0] == '-' &&
-                 (oaptr->flags & (CLI_CMD_HYPHENATED_OPTION))) {
+                 (oaptr->flags & (CLI_CMD_HYPHENATED_OPTION)) &&
+                 (oaptr->validator != cli_search_flags_validator ||
+                  cli_int_search_flags_word(cli, oaptr, stage->words[word_idx],
+                                            lastchar != '\0' && word_idx == stage->num_words - 1))) {
         candidates[0] = oaptr;
         num_candidates = 1;
         break;
       } else if (stage->words[word_idx] && (oaptr->flags & CLI_CMD_OPTIONAL_FLAG) &&
-                 ((oaptr->validator && (oaptr->validator(cli, oaptr->name, stage->words[word_idx]) == CLI_OK)) ||
+                 ((oaptr->validator && (cli_int_preparing_param(cli, stage->words[word_idx]) ||
+                                        oaptr->validator(cli, oaptr->name, stage->words[word_idx]) == CLI_OK)) ||
                   (!oaptr->validator && !strcmp(oaptr->name, stage->words[word_idx])))) {
         candidates[0] = oaptr;
         num_candidates = 1;
@@ -3422,7 +7391,8 @@ static void cli_int_parse_optargs(struct cli_def *cli, struct cli_pipeline_stage
         num_candidates = 1;
         break;
       } else if (!stage->words[word_idx] || (oaptr->flags & CLI_CMD_ARGUMENT) ||
-                 !strncasecmp(oaptr->name, stage->words[word_idx], strlen(stage->words[word_idx]))) {
+                 (oaptr->validator != cli_search_flags_validator &&
+                  !strncasecmp(oaptr->name, stage->words[word_idx], strlen(stage->words[word_idx])))) {
         candidates[num_candidates++] = oaptr;
       }
       if (oaptr->flags & CLI_CMD_ARGUMENT) {
@@ -3503,7 +7473,7 @@ static void cli_int_parse_optargs(struct cli_def *cli, struct cli_pipeline_stage
      * mode check or enter build mode.
      */
 
-    if (!validator || (*validator)(cli, oaptr->name, value) == CLI_OK) {
+    if (!validator || cli_int_preparing_param(cli, value) || (*validator)(cli, oaptr->name, value) == CLI_OK) {
       if (oaptr->flags & CLI_CMD_DO_NOT_RECORD) {
         // We want completion and validation, but then leave this 'value' to be seen - used *only* by buildmode as
         // argv[0] with argc=1
@@ -3547,7 +7517,8 @@ static void cli_int_parse_optargs(struct cli_def *cli, struct cli_pipeline_stage
     }
 
     // If this optarg can set the transient mode, then evaluate it if we're not at last word
-    if (oaptr->transient_mode && oaptr->transient_mode(cli, oaptr->name, value)) {
+    if (oaptr->transient_mode && !cli_int_preparing_param(cli, value) &&
+        oaptr->transient_mode(cli, oaptr->name, value)) {
       stage->error_word = stage->words[word_idx];
       stage->status = CLI_ERROR;
       goto done;
@@ -3596,11 +7567,11 @@ done:
 }
 
 void cli_unregister_all_commands(struct cli_def *cli) {
-  cli_unregister_tree(cli, cli->commands, CLI_REGULAR_COMMAND);
+  cli_unregister_tree(cli, cli->registry->commands, CLI_REGULAR_COMMAND);
 }
 
 void cli_unregister_all_filters(struct cli_def *cli) {
-  cli_unregister_tree(cli, cli->commands, CLI_FILTER_COMMAND);
+  cli_unregister_tree(cli, cli->registry->commands, CLI_FILTER_COMMAND);
 }
 
 /*
@@ -11,9 +11,9 @@ extern "C" {
 #include <stdio.h>
 #include <sys/time.h>
 
-#define LIBCLI_VERSION_MAJOR 1
-#define LIBCLI_VERSION_MINOR 10
-#define LIBCLI_VERSION_REVISION 8
+#define LIBCLI_VERSION_MAJOR 2
+#define LIBCLI_VERSION_MINOR 0
+#define LIBCLI_VERSION_REVISION 0
 #define LIBCLI_VERSION ((LIBCLI_VERSION_MAJOR << 16) | (LIBCLI_VERSION_MINOR << 8) | LIBCLI_VERSION_REVISION)
 
 // for backward compatability
@@ -55,7 +55,7 @@ extern "C" {
 
 struct cli_def {
   int completion_callback;
-  struct cli_command *commands;
+  struct cli_registry *registry;  // Commands and filters, shared with other sessions made by cli_init_shared()
   int (*auth_callback)(const char *, const char *);
   int (*regular_callback)(struct cli_def *cli);
   int (*enable_callback)(const char *);
@@ -91,12 +91,30 @@ struct cli_def {
   int disallow_buildmode;
   struct cli_pipeline *pipeline;
   struct cli_buildmode *buildmode;
+  struct cli_session *session;
+  unsigned buf_len;  // Length of the text in buffer
+  struct cli_stream *stream;
+  size_t output_high_water;
+  size_t output_limit;  // Unsent output at which a command is stopped, 0 for the default
+  int pager;
+  int term_width;  // From telnet window size negotiation or cli_set_terminal_size(), 0 if unknown
+  int term_height;
+  int pins;                                 // Nesting of the hold on commands found, see cli_run_command()
+  unsigned long pin_epoch;                  // When the outermost hold was taken
+  struct cli_def *pin_next;                 // Other sessions holding on to commands
+  struct cli_arena_block *arena;            // Parse state of the command line being run
+  struct cli_command_cache *command_cache;  // Lines run before, see cli_set_command_cache()
+  struct cli_filter_pool *filter_pool;      // See cli_set_filter_threads()
 };
 
+struct cli_server;
+
 struct cli_filter {
   int (*filter)(struct cli_def *cli, const char *string, void *data);
   void *data;
   struct cli_filter *next;
+  // Optional, used instead of filter() for lines of output if set; line[len] is always '\0'
+  int (*filter_line)(struct cli_def *cli, const char *line, size_t len, void *data);
 };
 
 enum command_types {
@@ -123,6 +141,8 @@ struct cli_command {
   int (*init)(struct cli_def *cli, int, char **, struct cli_filter *filt);
   int command_type;
   int flags;
+  unsigned seq;                     // Order the command was registered in among its siblings
+  struct cli_command_index *index;  // Sorted index of the children
 };
 
 struct cli_comphelp {
@@ -143,6 +163,7 @@ enum optarg_flags {
   CLI_CMD_REMAINDER_OF_LINE = 1 << 8,
   CLI_CMD_HYPHENATED_OPTION = 1 << 9,
   CLI_CMD_SPOT_CHECK = 1 << 10,
+  CLI_CMD_STATIC = 1 << 11,  // Set by libcli on commands and optargs using the caller's strings in place
 };
 
 struct cli_optarg {
@@ -158,6 +179,31 @@ struct cli_optarg {
   struct cli_optarg *next;
 };
 
+// An optional argument in a struct cli_command_spec, as given to cli_register_optarg()
+struct cli_optarg_spec {
+  const char *name;
+  int flags;
+  int privilege;
+  int mode;
+  const char *help;
+  int (*get_completions)(struct cli_def *, const char *, const char *, struct cli_comphelp *);
+  int (*validator)(struct cli_def *, const char *, const char *);
+  int (*transient_mode)(struct cli_def *, const char *, const char *);
+};
+
+// An entry in a table of commands for cli_register_commands() or cli_register_static_commands()
+struct cli_command_spec {
+  const char *command;
+  int (*callback)(struct cli_def *, const char *, char **, int);
+  int privilege;
+  int mode;
+  const char *help;
+  const struct cli_command_spec *children;  // Registered with this command as their parent, may be NULL
+  size_t num_children;
+  const struct cli_optarg_spec *optargs;  // Registered on this command in order, may be NULL
+  size_t num_optargs;
+};
+
 struct cli_optarg_pair {
   char *name;
   char *value;
@@ -178,11 +224,12 @@ struct cli_pipeline_stage {
 
 struct cli_pipeline {
   char *cmdline;
-  char *words[CLI_MAX_LINE_WORDS];
+  char **words;  // num_words of them, followed by NULL
   int num_words;
   int num_stages;
-  struct cli_pipeline_stage stage[CLI_MAX_LINE_WORDS];
+  struct cli_pipeline_stage *stage;  // num_stages of them
   struct cli_pipeline_stage *current_stage;
+  int preparing;  // Words like $1 stand for values given later, see cli_prepare()
 };
 
 struct cli_buildmode {
@@ -192,6 +239,8 @@ struct cli_buildmode {
   int mode;
   int transient_mode;
   char *mode_text;
+  struct cli_command *commands;     // Commands available in buildmode, kept apart from the registry's
+  struct cli_command_index *index;  // Sorted index of them
 };
 
 /**
@@ -201,6 +250,29 @@ struct cli_buildmode {
  */
 struct cli_def *cli_init(void);
 
+/**
+ * @brief      cli object constructor for another session using the commands
+ *             of an existing one
+ *
+ * The new cli starts out as cli_init() would leave it, except that instead
+ * of its own set of commands it refers to those registered on 'cli'.  They
+ * are not copied, so commands registered or unregistered through either cli
+ * change them for both.  They are freed when the last cli using them is
+ * passed to cli_done().
+ *
+ * Sessions sharing commands may run on different threads, and commands may
+ * be registered or unregistered from any thread while they do.  A command
+ * unregistered while a session is running it is freed once it's finished.
+ * Each cli object itself must only be used by one thread at a time, and
+ * completion and validation callbacks must not register or unregister
+ * commands.
+ *
+ * @param      cli   cli whose commands the new one uses
+ *
+ * @return     new cli object or NULL in case of error
+ */
+struct cli_def *cli_init_shared(struct cli_def *cli);
+
 /**
  * @brief      terminating a cli object
  *
@@ -241,6 +313,42 @@ int cli_done(struct cli_def *cli);
 struct cli_command *cli_register_command(struct cli_def *cli, struct cli_command *parent, const char *command,
                                          int (*callback)(struct cli_def *, const char *, char **, int), int privilege,
                                          int mode, const char *help);
+
+/**
+ * @brief      register a table of commands in one go, e.g. when they are
+ *             generated from a schema
+ *
+ * @param      cli     target cli object
+ * @param      parent  parent of the commands, or NULL for the top level
+ * @param[in]  specs   the commands, each registered as cli_register_command()
+ *                     would, followed by its 'optargs' and 'children'
+ * @param[in]  n       number of entries in 'specs'
+ *
+ * @return     CLI_OK, or CLI_ERROR if any of them couldn't be registered (the
+ *             ones before it stay registered)
+ */
+int cli_register_commands(struct cli_def *cli, struct cli_command *parent, const struct cli_command_spec *specs,
+                          size_t n);
+
+/**
+ * @brief      register a table of commands without copying it, for command
+ *             trees built into the program as static const arrays
+ *
+ * The names and help are used where they are rather than duplicated, so the
+ * table must outlive the cli object.  All the commands and optargs in the
+ * table, including children, share one allocation which is released by
+ * cli_done().  Help on these optargs can't be extended with
+ * cli_optarg_addhelp().
+ *
+ * @param      cli     target cli object
+ * @param      parent  parent of the commands, or NULL for the top level
+ * @param[in]  specs   the commands, as for cli_register_commands()
+ * @param[in]  n       number of entries in 'specs'
+ *
+ * @return     CLI_OK, or CLI_ERROR if the table couldn't be registered
+ */
+int cli_register_static_commands(struct cli_def *cli, struct cli_command *parent, const struct cli_command_spec *specs,
+                                 size_t n);
 /**
  * @brief      function to un-register (remove) a command from commands tree;
  *             note that its children will be inaccessible obviously
@@ -263,6 +371,65 @@ int cli_unregister_command(struct cli_def *cli, const char *command);
  */
 int cli_run_command(struct cli_def *cli, const char *command);
 
+/**
+ * @brief      keep the commands found for the most recently run lines, so
+ *             running the same line again doesn't have to find its commands
+ *             and check its arguments again
+ *
+ * @note       a line is only looked up again in the same mode and at the same
+ *             privilege, and registering or unregistering any command or
+ *             optarg throws away everything found before; argument
+ *             validators are not called for a line found in the cache
+ *
+ * @param      cli      target cli object
+ * @param[in]  entries  how many lines to keep, 0 for none (the default)
+ *
+ * @return     CLI_OK, or CLI_ERROR if memory couldn't be allocated
+ */
+int cli_set_command_cache(struct cli_def *cli, unsigned int entries);
+
+struct cli_prepared;
+
+/**
+ * @brief      find the commands for a line once, to be run many times with
+ *             cli_execute_prepared()
+ *
+ * @note       words $1, $2 and so on are parameters, each replaced by a value
+ *             when the line is run; a parameter can't stand for a command
+ *
+ * @param      cli      target cli object
+ * @param[in]  command  line to prepare, as it would be given to
+ *                      cli_run_command()
+ *
+ * @return     the prepared line, or NULL if it isn't valid (the error has
+ *             been printed)
+ */
+struct cli_prepared *cli_prepare(struct cli_def *cli, const char *command);
+
+/**
+ * @brief      run a line prepared by cli_prepare()
+ *
+ * @note       each value is taken as a single word, with no quoting or
+ *             escapes; the commands found when the line was prepared are used
+ *             again unless the mode or privilege is different or commands
+ *             have been registered or unregistered since
+ *
+ * @param      cli       target cli object
+ * @param      prepared  line to run
+ * @param[in]  argc      number of values
+ * @param[in]  argv      values for $1, $2 and so on
+ *
+ * @return     CLI_OK or CLI_ERROR, as for cli_run_command()
+ */
+int cli_execute_prepared(struct cli_def *cli, struct cli_prepared *prepared, int argc, const char *argv[]);
+
+/**
+ * @brief      free a line prepared by cli_prepare()
+ *
+ * @param      prepared  line to free, may be NULL
+ */
+void cli_free_prepared(struct cli_prepared *prepared);
+
 /**
  * @brief      main loop function in which the code is waiting for user to enter
  *             something; this is called when you set up everything and
@@ -279,6 +446,174 @@ int cli_run_command(struct cli_def *cli, const char *command);
  */
 int cli_loop(struct cli_def *cli, int sockfd);
 
+/**
+ * @brief      start a session without running a loop for it, so it can be
+ *             driven from an application's own event loop with
+ *             cli_session_feed() and cli_session_tick(); the same setup as
+ *             cli_loop() is done (telnet negotiation, banner, authentication)
+ *
+ * @param      cli     target cli object
+ * @param[in]  sockfd  socket file descriptor output is written to, or -1 to
+ *                     collect output for cli_session_output() instead
+ *
+ * @return     CLI_OK or CLI_ERROR
+ */
+int cli_session_start(struct cli_def *cli, int sockfd);
+
+/**
+ * @brief      process input received from the user; the whole buffer is run
+ *             through the line editor and any commands entered are executed
+ *
+ * @param      cli    target cli object
+ * @param[in]  bytes  input exactly as received from the client, telnet
+ *                    commands are taken out and may be split across calls
+ * @param[in]  len    length of the input
+ *
+ * @return     CLI_OK, CLI_QUIT if the session has finished and should be
+ *             closed with cli_session_end(), or CLI_ERROR if there is no
+ *             session
+ */
+int cli_session_feed(struct cli_def *cli, const char *bytes, size_t len);
+
+/**
+ * @brief      run the regular callback and idle timeout checks of a session;
+ *             call this about once a second
+ *
+ * @param      cli  target cli object
+ *
+ * @return     CLI_OK, CLI_QUIT if the session should be closed, or CLI_ERROR
+ *             if there is no session
+ */
+int cli_session_tick(struct cli_def *cli);
+
+/**
+ * @brief      tell a session that its socket has become writable; pending
+ *             output is sent and a command streaming its output with
+ *             cli_stream() is allowed to produce more
+ *
+ * @note       while cli_session_output() returns anything the application
+ *             should wait for the socket to become writable and call this
+ *
+ * @param      cli  target cli object
+ *
+ * @return     CLI_OK, CLI_QUIT if the session should be closed, or CLI_ERROR
+ *             if there is no session
+ */
+int cli_session_writable(struct cli_def *cli);
+
+/**
+ * @brief      get the output waiting to be sent to the client; for a session
+ *             started without a socket it stays pending until
+ *             cli_session_consume_output() is called
+ *
+ * @param      cli  target cli object
+ * @param[out] len  number of bytes pending
+ *
+ * @return     pending output (not NUL terminated) or NULL if there is none
+ */
+const char *cli_session_output(struct cli_def *cli, size_t *len);
+
+/**
+ * @brief      discard output which has been sent to the client of a session
+ *             started without a socket; a command streaming its output with
+ *             cli_stream() may add more
+ *
+ * @param      cli  target cli object
+ * @param[in]  len  number of bytes from the start of the pending output
+ *
+ * @return     CLI_OK, CLI_QUIT if the session should be closed, or CLI_ERROR
+ *             if there is no session
+ */
+int cli_session_consume_output(struct cli_def *cli, size_t len);
+
+/**
+ * @brief      finish a session started with cli_session_start(); if it was
+ *             started with a socket the socket is closed
+ *
+ * @param      cli  target cli object
+ */
+void cli_session_end(struct cli_def *cli);
+
+/**
+ * @brief      create an event driven server which can run many cli sessions
+ *             from a single thread; use this instead of forking or starting a
+ *             thread to run cli_loop() for every connection
+ *
+ * @return     new server object or NULL in case of error
+ */
+struct cli_server *cli_server_init(void);
+
+/**
+ * @brief      add a connected client to a server; this does the same setup as
+ *             cli_loop() (telnet negotiation, banner, authentication) but
+ *             returns immediately, input is handled by cli_server_run()
+ *
+ * @note       the server takes ownership of the cli object; when the session
+ *             finishes the socket is closed and cli_done() is called on it, so
+ *             every session needs its own cli object
+ *
+ * @param      server  target server object
+ * @param      cli     cli object to be used for this session
+ * @param[in]  sockfd  socket file descriptor of the client
+ *
+ * @return     CLI_OK or CLI_ERROR; on error the socket is left open and the
+ *             cli object is not freed
+ */
+int cli_server_add_session(struct cli_server *server, struct cli_def *cli, int sockfd);
+
+/**
+ * @brief      add a listening socket to a server; whenever a new connection
+ *             is accepted 'session_init' is called to create the cli object
+ *             for it, which is then added with cli_server_add_session()
+ *
+ * @param      server        target server object
+ * @param[in]  sockfd        listening socket file descriptor
+ * @param[in]  session_init  callback returning a new cli object for an
+ *                           accepted connection, or NULL to reject it
+ *
+ * @return     CLI_OK or CLI_ERROR
+ */
+int cli_server_add_listener(struct cli_server *server, int sockfd,
+                            struct cli_def *(*session_init)(struct cli_server *server, int sockfd));
+
+/**
+ * @brief      run the server; regular callbacks and idle timeouts of every
+ *             session are handled as they are in cli_loop()
+ *
+ * @param      server  target server object
+ *
+ * @return     CLI_OK once there is nothing left to wait for (no sessions and
+ *             no listeners), or CLI_ERROR if waiting for events failed
+ */
+int cli_server_run(struct cli_server *server);
+
+/**
+ * @brief      run the server's sessions on a pool of worker threads rather
+ *             than in the thread calling cli_server_run(); that thread still
+ *             waits for events, accepts connections and runs the regular and
+ *             idle timeout callbacks
+ *
+ * @note       a session is only ever run by one thread at a time, but
+ *             sessions made with cli_init_shared() share commands with each
+ *             other, so their callbacks may run concurrently
+ *
+ * @param      server   target server object
+ * @param[in]  threads  number of worker threads, or 0 to run sessions in
+ *                      cli_server_run() itself (the default)
+ *
+ * @return     CLI_OK, or CLI_ERROR if the server is running
+ */
+int cli_server_set_threads(struct cli_server *server, int threads);
+
+/**
+ * @brief      close every session and listener of a server and free it
+ *
+ * @param      server  target server object
+ *
+ * @return     CLI_OK
+ */
+int cli_server_done(struct cli_server *server);
+
 /**
  * @brief      function to execute cli commands from a file in a specific
  *             privilege and mode; privilege and mode of the cli will not
@@ -476,6 +811,117 @@ void cli_bufprint(struct cli_def *cli, const char *format, ...) __attribute__((f
  */
 void cli_vabufprint(struct cli_def *cli, const char *format, va_list ap);
 
+/**
+ * @brief      write preformatted text to the user without going through
+ *             printf-style formatting; like cli_bufprint() every complete
+ *             line is filtered and printed, a trailing partial line is kept
+ *             until the rest of it is written
+ *
+ * @param      cli  target cli object
+ * @param[in]  buf  text to be written
+ * @param[in]  len  length of the text
+ */
+void cli_write(struct cli_def *cli, const char *buf, size_t len);
+
+/**
+ * @brief      produce the output of a command a piece at a time as the
+ *             client takes it, rather than all at once; call this from a
+ *             command callback, 'callback' is then called after the command
+ *             returns CLI_OK, each time printing some more output, until it
+ *             returns anything other than CLI_OK; the command's filters apply
+ *             to everything it prints
+ *
+ * @note       a session run by cli_server or cli_session_feed() carries on
+ *             with other work while the client is slow to read; cli_loop()
+ *             waits for the client instead
+ *
+ * @param      cli       target cli object
+ * @param[in]  callback  function printing the next part of the output
+ * @param[in]  cleanup   function called with 'arg' once the stream has
+ *                       finished or the session has ended, may be NULL
+ * @param[in]  arg       passed to 'callback' and 'cleanup'; the command's
+ *                       argv and optargs are gone by the time 'callback' is
+ *                       called, so anything needed must be kept here
+ *
+ * @return     CLI_OK or CLI_ERROR (e.g. if a stream has already been set up)
+ */
+int cli_stream(struct cli_def *cli, int (*callback)(struct cli_def *cli, void *arg), void (*cleanup)(void *arg),
+               void *arg);
+
+/**
+ * @brief      check whether the user has interrupted the command which is
+ *             running (Ctrl-C, or a telnet interrupt or break); once it has
+ *             been, anything the command prints is thrown away and a
+ *             cli_stream() callback is not called again, so a command only
+ *             needs to check this to stop work which doesn't print
+ *
+ * @param      cli  target cli object
+ *
+ * @return     non-zero if the command has been interrupted
+ */
+int cli_is_cancelled(struct cli_def *cli);
+
+/**
+ * @brief      set how much output may be waiting to be sent to the client
+ *             before a cli_stream() callback is held off
+ *
+ * @param      cli    target cli object
+ * @param[in]  bytes  high water mark in bytes, 0 for the default (64 KB)
+ */
+void cli_set_output_high_water(struct cli_def *cli, size_t bytes);
+
+/**
+ * @brief      set how much output may be waiting to be sent to the client
+ *             of a session with a socket before the command producing it is
+ *             stopped, as if interrupted, and told so; this keeps a client
+ *             which doesn't read from growing the session without bound
+ *
+ * @param      cli    target cli object
+ * @param[in]  bytes  limit in bytes, 0 for the default (4 MB)
+ */
+void cli_set_output_limit(struct cli_def *cli, size_t bytes);
+
+/**
+ * @brief      filter very large blocks of command output on extra threads;
+ *             an include, exclude, grep or egrep (or any run of them) at the
+ *             start of the filters is run over the block a chunk at a time on
+ *             each thread, and the rest of the filters and the printing carry
+ *             on in order on the session's own thread
+ *
+ * @note       only output of several hundred KB written at once, such as by a
+ *             single cli_bufprint() or cli_write(), is split up; a count,
+ *             begin or between sees exactly the lines it otherwise would
+ *
+ * @param      cli      target cli object
+ * @param[in]  threads  number of threads besides the session's own, 0 for
+ *                      none (the default)
+ *
+ * @return     CLI_OK, or CLI_ERROR if the threads couldn't be started (or
+ *             threads aren't supported on this platform)
+ */
+int cli_set_filter_threads(struct cli_def *cli, int threads);
+
+/**
+ * @brief      stop a command's output with --More-- each time it fills the
+ *             screen; space shows the next page, enter the next line and q
+ *             stops the command as if it had been interrupted
+ *
+ * @param      cli      target cli object
+ * @param[in]  enabled  if 0 then output is not paged (the default)
+ */
+void cli_set_pager(struct cli_def *cli, int enabled);
+
+/**
+ * @brief      set the size of the client's terminal, used for paging and for
+ *             wrapping help text; telnet clients which support window size
+ *             negotiation set this themselves
+ *
+ * @param      cli     target cli object
+ * @param[in]  width   columns, 0 for the default (80)
+ * @param[in]  height  rows, 0 for the default (24)
+ */
+void cli_set_terminal_size(struct cli_def *cli, int width, int height);
+
 /**
  * @brief      function to print something in the output as error
  *
@@ -722,6 +1168,10 @@ char *cli_get_optarg_value(struct cli_def *cli, const char *name, char *find_aft
  * @param[in]  allow_multiple  if 'allow_multiple' is 0 then the found optional
  *                             argument cannot be set
  *
+ * @note       outside buildmode the name and value copies only last until the
+ *             command being run returns, along with everything else parsed
+ *             from its command line
+ *
  * @return     CLI_OK or CLI_ERROR
  */
 int cli_set_optarg_value(struct cli_def *cli, const char *name, const char *value, int allow_multiple);
@@ -1,4 +1,4 @@
-Version: 1.10.8
+Version: 2.0.0
 Summary: Cisco-like telnet command-line library
 Name: libcli
 Release: 1
@@ -67,6 +67,13 @@ rm -rf $RPM_BUILD_ROOT
 %defattr(-, root, root)
 
 %changelog
+* Sat Oct 17 2026 agent <agent@local> 2.0.0
+- Commands are kept in a registry which sessions made by cli_init_shared() share,
+  so struct cli_def no longer has a commands member
+- The layouts of struct cli_def, cli_command, cli_pipeline and cli_buildmode
+  have changed; applications must be rebuilt against the new libcli.h
+- Soname is now libcli.so.2.0
+
 * Wed Dec 27 2023 Rob Sanders <rsanders@forcepointgov.com> 1.10.8
 - Replace strchrnul() with possibly 2 calls to strchr() (issue #78)
 